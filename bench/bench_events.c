@@ -0,0 +1,155 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Event dispatch benchmark.
+
+   Runs an echo server with srv_run() on one thread and drives it from the
+   main thread with nconns connections, each keeping one byte in flight.
+   Every round trip costs the server exactly one read event, so the round
+   trip rate is the rate at which the loop dispatches events.
+
+   Usage: bench_events [nconns] [seconds] [port] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "serv.h"
+
+static srv_t ctx;
+
+static void echo_read(srv_conn *conn) {
+    char buf[512];
+    int n;
+
+    n = srv_read(conn, buf, sizeof(buf));
+    if(n <= 0) {
+        if(n == 0 || errno != EAGAIN)
+            srv_close(conn);
+        return;
+    }
+
+    srv_write(conn, buf, n);
+}
+
+static void *server_thread(void *arg) {
+    (void) arg;
+
+    if(srv_run(&ctx) == -1)
+        perror("srv_run");
+    exit(1);
+    return NULL;
+}
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int connect_to(int port) {
+    struct sockaddr_in addr;
+    int fd, one = 1, tries;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for(tries = 0; tries < 100; tries++) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return fd;
+        }
+        close(fd);
+        usleep(10000); /* The server may not be listening yet */
+    }
+
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    int nconns = 64, seconds = 5, port = 5701;
+    int i, n, epfd, fd;
+    unsigned long events = 0;
+    struct epoll_event ev, *ready;
+    char portstr[16], c = 'x';
+    pthread_t server;
+    double start, elapsed;
+
+    if(argc > 1) nconns = atoi(argv[1]);
+    if(argc > 2) seconds = atoi(argv[2]);
+    if(argc > 3) port = atoi(argv[3]);
+
+    snprintf(portstr, sizeof(portstr), "%d", port);
+
+    srv_init(&ctx);
+    srv_set_port(&ctx, portstr);
+    srv_set_backlog(&ctx, 1024);
+    srv_hnd_read(&ctx, echo_read);
+
+    pthread_create(&server, NULL, server_thread, NULL);
+
+    epfd = epoll_create1(0);
+    ready = calloc(nconns, sizeof(struct epoll_event));
+
+    for(i = 0; i < nconns; i++) {
+        if((fd = connect_to(port)) == -1) {
+            perror("connect");
+            return 1;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        write(fd, &c, 1);
+    }
+
+    start = now();
+    do {
+        n = epoll_wait(epfd, ready, nconns, 100);
+        for(i = 0; i < n; i++) {
+            fd = ready[i].data.fd;
+            if(read(fd, &c, 1) == 1) {
+                events++;
+                write(fd, &c, 1);
+            }
+        }
+        elapsed = now() - start;
+    } while(elapsed < seconds);
+
+    printf("connections: %d\n", nconns);
+    printf("events:      %lu\n", events);
+    printf("events/sec:  %.0f\n", events / elapsed);
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Framing benchmark.
+
+   Fills a buffer with delimiter-terminated frames of random length and
+   splits it with srv_find_delim(), the scanner behind SRV_FRAME_DELIM, and
+   with a naive byte loop. Prints frames/sec and throughput of both.
+
+   Usage: bench_frames [avg frame length] [delimiter] [seconds] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "serv.h"
+
+#define BUF_SIZE (16 << 20)
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int naive_find(const char *buf, int len, const char *delim, int dlen) {
+    int i, j;
+
+    for(i = 0; i + dlen <= len; i++) {
+        for(j = 0; j < dlen && buf[i + j] == delim[j]; j++)
+            ;
+        if(j == dlen)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Split the whole buffer, as many times as fit in 'seconds' */
+static void run(const char *name, int (*find)(const char *, int, const char *, int),
+                const char *buf, int len, const char *delim, int dlen, double seconds) {
+    unsigned long long frames = 0, bytes = 0;
+    double start, elapsed;
+    int off, pos;
+
+    start = now();
+    do {
+        for(off = 0; (pos = (*find)(buf + off, len - off, delim, dlen)) != -1;
+                off += pos + dlen)
+            frames++;
+        bytes += off;
+        elapsed = now() - start;
+    } while(elapsed < seconds);
+
+    printf("%-14s %12.0f frames/sec %10.1f MB/s\n", name, frames / elapsed,
+           bytes / elapsed / 1e6);
+}
+
+int main(int argc, char **argv) {
+    int avg = 64, seconds = 2, len, flen, dlen, i;
+    const char *delim = "\r\n";
+    char *buf;
+
+    if(argc > 1) avg = atoi(argv[1]);
+    if(argc > 2) delim = argv[2];
+    if(argc > 3) seconds = atoi(argv[3]);
+
+    dlen = (int) strlen(delim);
+    if(avg < 1 || dlen < 1 || dlen > 8) {
+        fprintf(stderr, "usage: bench_frames [avg frame length] [delimiter] [seconds]\n");
+        return 1;
+    }
+
+    /* Random payload bytes that never form the delimiter */
+    buf = malloc(BUF_SIZE);
+    srand(1);
+    for(len = 0; ; len += flen + dlen) {
+        flen = 1 + rand() % (2 * avg);
+        if(len + flen + dlen > BUF_SIZE)
+            break;
+
+        for(i = 0; i < flen; i++)
+            buf[len + i] = 'a' + rand() % 26;
+        memcpy(buf + len + flen, delim, dlen);
+    }
+
+    printf("frames of %d bytes on average, %d byte delimiter, %d MB\n", avg, dlen, len >> 20);
+    run("byte loop", naive_find, buf, len, delim, dlen, seconds);
+    run("srv_find_delim", srv_find_delim, buf, len, delim, dlen, seconds);
+
+    free(buf);
+    return 0;
+}
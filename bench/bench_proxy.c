@@ -0,0 +1,300 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Proxy throughput benchmark.
+
+   Runs two forwarding servers in front of the same sink, one handing each
+   pair of connections to srv_proxy() and one copying through hnd_data
+   with srv_send(), and pushes a stream through each. Prints the
+   throughput and the CPU time the loop thread spent per megabyte.
+
+   Usage: bench_proxy [megabytes] [port] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "serv.h"
+
+#define CHUNK 65536
+
+static srv_t splice_ctx, copy_ctx;
+static char sink_port[16];
+
+/* The sink says hello, reads a length and that many bytes, and answers
+   with the number of bytes it got */
+static void *sink_thread(void *arg) {
+    static char buf[CHUNK];
+    int lfd = *(int *) arg, fd, n, one = 1;
+    uint64_t want, got;
+
+    for(;;) {
+        if((fd = accept(lfd, NULL, NULL)) == -1)
+            continue;
+
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+        write(fd, "R", 1);
+
+        for(got = 0; got < sizeof(want); got += n)
+            if((n = read(fd, (char *) &want + got, sizeof(want) - got)) <= 0)
+                break;
+
+        for(got = 0; got < want; got += n)
+            if((n = read(fd, buf, want - got < CHUNK ? want - got : CHUNK)) <= 0)
+                break;
+
+        write(fd, &got, sizeof(got));
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static int sink_listen(int port) {
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, 16) == -1)
+        return -1;
+
+    return fd;
+}
+
+/* Splice mode: join the client to its upstream once it is connected */
+static void splice_connected(srv_conn *up, int err, void *arg) {
+    srv_conn *conn = srv_handle_resolve(&splice_ctx, (srv_handle_t)(uintptr_t) arg);
+
+    (void) err;
+
+    if(up == NULL || conn == NULL) {
+        if(up)
+            srv_close(up);
+        if(conn)
+            srv_close(conn);
+        return;
+    }
+
+    if(srv_proxy(conn, up, NULL, NULL) == -1) {
+        srv_close(up);
+        srv_close(conn);
+    }
+}
+
+static void splice_data(srv_conn *conn, char *buf, int len) {
+    /* Kept until the upstream is there, srv_proxy() forwards it */
+    (void) conn;
+    (void) buf;
+    (void) len;
+}
+
+static void splice_accept(srv_conn *conn) {
+    srv_connect_async(&splice_ctx, "127.0.0.1", sink_port, splice_connected,
+                      (void *)(uintptr_t) srv_conn_handle(conn));
+}
+
+/* Copy mode: each side's data pointer is the other side */
+static void copy_connected(srv_conn *up, int err, void *arg) {
+    srv_conn *conn = srv_handle_resolve(&copy_ctx, (srv_handle_t)(uintptr_t) arg);
+
+    (void) err;
+
+    if(up == NULL || conn == NULL) {
+        if(up)
+            srv_close(up);
+        if(conn)
+            srv_close(conn);
+        return;
+    }
+
+    conn->data = up;
+    up->data = conn;
+}
+
+static void copy_accept(srv_conn *conn) {
+    conn->data = NULL;
+    srv_connect_async(&copy_ctx, "127.0.0.1", sink_port, copy_connected,
+                      (void *)(uintptr_t) srv_conn_handle(conn));
+}
+
+static void copy_data(srv_conn *conn, char *buf, int len) {
+    if(conn->data == NULL)
+        return; /* Kept until the upstream is there */
+
+    srv_send((srv_conn *) conn->data, buf, len);
+    srv_consume(conn, len);
+}
+
+static void copy_gone(srv_conn *conn) {
+    srv_conn *other = conn->data;
+
+    if(other) {
+        other->data = NULL;
+        conn->data = NULL;
+        srv_close(other);
+    }
+}
+
+static void copy_error(srv_conn *conn, int err) {
+    (void) err;
+    copy_gone(conn);
+}
+
+static void *server_thread(void *arg) {
+    if(srv_run((srv_t *) arg) == -1)
+        perror("srv_run");
+    exit(1);
+    return NULL;
+}
+
+static double now_sec(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to(int port) {
+    struct sockaddr_in addr;
+    int fd, tries;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for(tries = 0; tries < 100; tries++) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+            return fd;
+        close(fd);
+        usleep(10000); /* The server may not be listening yet */
+    }
+
+    return -1;
+}
+
+/* Push total bytes through the proxy on port, timing the transfer and the
+   loop thread's CPU */
+static int measure(const char *name, int port, pthread_t loop, uint64_t total) {
+    static char buf[CHUNK];
+    clockid_t cpu;
+    double start, cpu_start, secs, cpu_secs;
+    uint64_t sent, got = 0;
+    char c;
+    int fd, n;
+
+    pthread_getcpuclockid(loop, &cpu);
+    if((fd = connect_to(port)) == -1 || read(fd, &c, 1) != 1)
+        return -1;
+
+    start = now_sec(CLOCK_MONOTONIC);
+    cpu_start = now_sec(cpu);
+
+    if(write(fd, &total, sizeof(total)) != sizeof(total))
+        return -1;
+    for(sent = 0; sent < total; sent += n)
+        if((n = write(fd, buf, total - sent < CHUNK ? total - sent : CHUNK)) <= 0)
+            return -1;
+    if(read(fd, &got, sizeof(got)) != sizeof(got) || got != total) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    secs = now_sec(CLOCK_MONOTONIC) - start;
+    cpu_secs = now_sec(cpu) - cpu_start;
+    close(fd);
+
+    printf("%-6s  %8.1f MB/s  loop cpu %6.1f us/MB  (%.2f s, %.2f s cpu)\n", name,
+           total / 1048576.0 / secs, cpu_secs * 1e6 / (total / 1048576.0), secs, cpu_secs);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int megabytes = 1024, port = 5703, lfd;
+    char splice_port[16], copy_port[16];
+    pthread_t splice_thread, copy_thread, sink;
+
+    if(argc > 1) megabytes = atoi(argv[1]);
+    if(argc > 2) port = atoi(argv[2]);
+
+    if(megabytes < 1) {
+        fprintf(stderr, "usage: bench_proxy [megabytes] [port]\n");
+        return 1;
+    }
+
+    /* srv_proxy() writes with splice() */
+    signal(SIGPIPE, SIG_IGN);
+
+    snprintf(splice_port, sizeof(splice_port), "%d", port);
+    snprintf(copy_port, sizeof(copy_port), "%d", port + 1);
+    snprintf(sink_port, sizeof(sink_port), "%d", port + 2);
+
+    if((lfd = sink_listen(port + 2)) == -1) {
+        perror("sink");
+        return 1;
+    }
+    pthread_create(&sink, NULL, sink_thread, &lfd);
+
+    srv_init(&splice_ctx);
+    srv_set_host(&splice_ctx, "127.0.0.1");
+    srv_set_port(&splice_ctx, splice_port);
+    srv_hnd_accept(&splice_ctx, splice_accept);
+    srv_hnd_data(&splice_ctx, splice_data);
+
+    /* Same forwarding through the input and output buffers */
+    srv_init(&copy_ctx);
+    srv_set_host(&copy_ctx, "127.0.0.1");
+    srv_set_port(&copy_ctx, copy_port);
+    srv_hnd_accept(&copy_ctx, copy_accept);
+    srv_hnd_data(&copy_ctx, copy_data);
+    srv_hnd_rdhup(&copy_ctx, copy_gone);
+    srv_hnd_hup(&copy_ctx, copy_gone);
+    srv_hnd_error(&copy_ctx, copy_error);
+
+    pthread_create(&splice_thread, NULL, server_thread, &splice_ctx);
+    pthread_create(&copy_thread, NULL, server_thread, &copy_ctx);
+
+    printf("transfer: %d MB per run\n", megabytes);
+
+    if(measure("splice", port, splice_thread, (uint64_t) megabytes << 20) == -1 ||
+            measure("copy", port + 1, copy_thread, (uint64_t) megabytes << 20) == -1) {
+        perror("measure");
+        return 1;
+    }
+
+    return 0;
+}
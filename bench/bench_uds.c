@@ -0,0 +1,189 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Unix domain vs loopback TCP latency benchmark.
+
+   Runs two echo servers with the same hnd_data handler, one listening on a
+   unix socket and one on loopback TCP, and measures request/response round
+   trips over one connection to each. Prints the mean, median and 99th
+   percentile round trip time for both.
+
+   Usage: bench_uds [round trips] [message size] [port] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "serv.h"
+
+#define MAX_SIZE 65536
+
+static srv_t tcp_ctx, uds_ctx;
+static char uds_path[64];
+
+static void echo_data(srv_conn *conn, char *buf, int len) {
+    srv_send(conn, buf, len);
+    srv_consume(conn, len);
+}
+
+static void *server_thread(void *arg) {
+    if(srv_run((srv_t *) arg) == -1)
+        perror("srv_run");
+    exit(1);
+    return NULL;
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int connect_tcp(int port) {
+    struct sockaddr_in addr;
+    int fd, one = 1, tries;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for(tries = 0; tries < 100; tries++) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return fd;
+        }
+        close(fd);
+        usleep(10000); /* The server may not be listening yet */
+    }
+
+    return -1;
+}
+
+static int connect_uds(const char *path) {
+    int fd, tries;
+
+    for(tries = 0; tries < 100; tries++) {
+        if((fd = srv_unix_connect(path)) != -1)
+            return fd;
+        usleep(10000);
+    }
+
+    return -1;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Send size bytes and wait for all of them to come back, rounds times */
+static int measure(const char *name, int fd, int rounds, int size) {
+    static char out[MAX_SIZE], in[MAX_SIZE];
+    double *rtt, start, sum = 0;
+    int i, n, got;
+
+    rtt = malloc(rounds * sizeof(double));
+    memset(out, 'x', size);
+
+    /* Warm up */
+    for(i = 0; i < rounds / 10 + 1; i++) {
+        write(fd, out, size);
+        for(got = 0; got < size; got += n)
+            if((n = read(fd, in + got, size - got)) <= 0)
+                return -1;
+    }
+
+    for(i = 0; i < rounds; i++) {
+        start = now_us();
+        if(write(fd, out, size) != size)
+            return -1;
+        for(got = 0; got < size; got += n)
+            if((n = read(fd, in + got, size - got)) <= 0)
+                return -1;
+        rtt[i] = now_us() - start;
+        sum += rtt[i];
+    }
+
+    qsort(rtt, rounds, sizeof(double), cmp_double);
+    printf("%-4s  mean %7.2f us  p50 %7.2f us  p99 %7.2f us  %9.0f rt/sec\n", name,
+           sum / rounds, rtt[rounds / 2], rtt[rounds * 99 / 100], rounds / (sum / 1e6));
+
+    free(rtt);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int rounds = 100000, size = 64, port = 5702;
+    int tcp_fd, uds_fd;
+    char portstr[16];
+    pthread_t tcp_thread, uds_thread;
+
+    if(argc > 1) rounds = atoi(argv[1]);
+    if(argc > 2) size = atoi(argv[2]);
+    if(argc > 3) port = atoi(argv[3]);
+
+    if(rounds < 1 || size < 1 || size > MAX_SIZE) {
+        fprintf(stderr, "usage: bench_uds [round trips] [1..%d] [port]\n", MAX_SIZE);
+        return 1;
+    }
+
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    snprintf(uds_path, sizeof(uds_path), "@libserv_bench_%d", port);
+
+    /* Same handler and settings, only the listen address differs */
+    srv_init(&tcp_ctx);
+    srv_set_host(&tcp_ctx, "127.0.0.1");
+    srv_set_port(&tcp_ctx, portstr);
+    srv_hnd_data(&tcp_ctx, echo_data);
+
+    srv_init(&uds_ctx);
+    srv_set_unix(&uds_ctx, uds_path);
+    srv_hnd_data(&uds_ctx, echo_data);
+
+    pthread_create(&tcp_thread, NULL, server_thread, &tcp_ctx);
+    pthread_create(&uds_thread, NULL, server_thread, &uds_ctx);
+
+    if((tcp_fd = connect_tcp(port)) == -1 || (uds_fd = connect_uds(uds_path)) == -1) {
+        perror("connect");
+        return 1;
+    }
+
+    printf("round trips: %d, message size: %d\n", rounds, size);
+
+    if(measure("tcp", tcp_fd, rounds, size) == -1 ||
+            measure("uds", uds_fd, rounds, size) == -1) {
+        perror("measure");
+        return 1;
+    }
+
+    return 0;
+}
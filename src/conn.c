@@ -20,44 +20,293 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
-#include "serv.h"
+#include "serv_internal.h"
+#include "serv_loop.h"
 
-srv_conn **conns;
-int szconns;
+#include <stddef.h>
 
-void conn_init(int maxfd) {
-    szconns = maxfd;
-    conns = malloc(maxfd * sizeof(srv_conn *));
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+/* The hot part of srv_conn must stay within one cache line */
+typedef char conn_hot_fits[offsetof(srv_conn, host) <= CONN_CACHELINE ? 1 : -1];
+
+/* Upper bound for fds, and so for the size of the table */
+static int conn_fd_limit(void) {
+#ifdef _WIN32
+    /* Sockets are handles, not small integers */
+    return 1000000;
+#else
+    struct rlimit rl;
+
+    if(getrlimit(RLIMIT_NOFILE, &rl) == -1)
+        return 1000000;
+
+    if(rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT_MAX)
+        return INT_MAX;
+
+    return (int) rl.rlim_cur;
+#endif
 }
 
-srv_conn *new_conn(srv_t *ctx, int fd) {
-    if(fd >= szconns) {
-        return 0;
+int conn_init(conn_table_t *t) {
+    t->maxconns = conn_fd_limit();
+    t->szconns = t->maxconns < CONN_TABLE_CHUNK ? t->maxconns : CONN_TABLE_CHUNK;
+    t->slabs = NULL;
+    t->free_conns = NULL;
+    t->closed = NULL;
+    t->conns = calloc(t->szconns, sizeof(srv_conn *));
+    t->gens = calloc(t->szconns, sizeof(unsigned int));
+    if(t->conns == NULL || t->gens == NULL) {
+        free(t->conns);
+        free(t->gens);
+        return -1;
+    }
+
+    return 0;
+}
+
+void conn_free(conn_table_t *t) {
+    conn_slab_t *slab;
+    int fd;
+
+    conn_collect(t);
+
+    /* Buffers of the connections still open. Holds on each other's reads
+       don't matter any more */
+    for(fd = 0; fd < t->szconns; fd++) {
+        if(t->conns[fd]) {
+            t->conns[fd]->wm_held = SRV_HANDLE_NONE;
+            in_free(t->conns[fd]);
+            out_free(t->conns[fd]);
+            zc_free(t->conns[fd]);
+        }
+    }
+
+    /* Live connections, closed ones and free ones all live in the slabs */
+    while(t->slabs) {
+        slab = t->slabs;
+        t->slabs = slab->next;
+#ifdef _WIN32
+        _aligned_free(slab);
+#else
+        free(slab);
+#endif
+    }
+
+    t->free_conns = NULL;
+    t->closed = NULL;
+
+    free(t->conns);
+    free(t->gens);
+    t->conns = NULL;
+    t->gens = NULL;
+    t->szconns = 0;
+}
+
+/* Make room in the table for fd. Grows by doubling, in whole chunks */
+static int conn_table_grow(conn_table_t *t, int fd) {
+    srv_conn **conns;
+    unsigned int *gens;
+    int n;
+
+    if(fd >= t->maxconns) {
+        /* The limit may have been raised since the table was set up */
+        t->maxconns = conn_fd_limit();
+        if(fd >= t->maxconns) {
+            errno = EMFILE;
+            return -1;
+        }
     }
 
+    n = t->szconns;
+    while(n <= fd)
+        n = n > t->maxconns / 2 ? t->maxconns : n * 2;
+    n = (n + CONN_TABLE_CHUNK - 1) / CONN_TABLE_CHUNK * CONN_TABLE_CHUNK;
+    if(n > t->maxconns)
+        n = t->maxconns;
+
+    conns = realloc(t->conns, sizeof(srv_conn *) * n);
+    if(conns == NULL)
+        return -1;
+
+    t->conns = conns;
+
+    gens = realloc(t->gens, sizeof(unsigned int) * n);
+    if(gens == NULL)
+        return -1;
+    t->gens = gens;
+
+    memset(conns + t->szconns, 0, sizeof(srv_conn *) * (n - t->szconns));
+    memset(gens + t->szconns, 0, sizeof(unsigned int) * (n - t->szconns));
+    t->szconns = n;
+
+    return 0;
+}
+
+/* Carve a new slab into free connections. The slab header takes the first
+   cache line so that every connection starts on a line of its own */
+static int conn_slab_alloc(conn_table_t *t) {
+    conn_slab_t *slab;
     srv_conn *conn;
-    conn = malloc(sizeof(srv_conn));
-    conn->ctx = ctx;
+    size_t size;
+    int i;
+
+    size = CONN_CACHELINE + CONN_SIZE * CONN_SLAB;
+#ifdef _WIN32
+    slab = _aligned_malloc(size, CONN_CACHELINE);
+    if(slab == NULL)
+        return -1;
+#else
+    if(posix_memalign((void **) &slab, CONN_CACHELINE, size) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+#endif
+
+    slab->next = t->slabs;
+    t->slabs = slab;
+
+    for(i = CONN_SLAB - 1; i >= 0; i--) {
+        conn = (srv_conn *) ((char *) slab + CONN_CACHELINE + CONN_SIZE * i);
+        conn->next = t->free_conns;
+        t->free_conns = conn;
+    }
+
+    return 0;
+}
+
+srv_conn *new_conn(conn_table_t *t, srv_loop *loop, int fd) {
+    srv_conn *conn;
+
+    if(fd < 0)
+        return 0;
+
+    if(fd >= t->szconns && conn_table_grow(t, fd) == -1)
+        return 0;
+
+    if(t->free_conns == NULL && conn_slab_alloc(t) == -1)
+        return 0;
+
+    conn = t->free_conns;
+    t->free_conns = conn->next;
+
+    conn->ctx = loop->ctx;
+    conn->loop = loop;
     conn->fd = fd;
-    conn->hnd_read = ctx->hnd_read;
-    conn->hnd_write = ctx->hnd_write;
+    conn->gen = (t->gens[fd] + 1) & HANDLE_GEN_MASK;
+    if(conn->gen == 0)
+        conn->gen = 1;
+    t->gens[fd] = conn->gen;
+    conn->events = loop->ctx->newfd_event_flags;
+    conn->flags = (conn->events & EVENTET) ? CONN_EDGE : 0;
+    conn->idle_timer = NULL;
+    conn->idle_timeout = 0;
+    conn->in_buf = NULL;
+    conn->in_start = conn->in_end = conn->in_size = 0;
+    conn->in_scan = 0;
+    conn->framing = NULL;
+    memset(&conn->http, 0, sizeof(conn->http));
+    conn->out_head = conn->out_tail = NULL;
+    conn->out_bytes = 0;
+    conn->out_mem = 0;
+    conn->zc = NULL;
+    conn->connect_cb = NULL;
+    conn->connect_arg = NULL;
+    conn->connect_timer = NULL;
+    conn->upstream = NULL;
+    conn->idle_next = NULL;
+    conn->proxy = NULL;
+    conn->wm_high = loop->ctx->wm_high;
+    conn->wm_low = loop->ctx->wm_low;
+    conn->wm_peer = conn->wm_held = SRV_HANDLE_NONE;
+    conn->holds = 0;
+    conn->data = NULL;
+    conn->last_active = loop->now;
+    conn->hnd_read = loop->ctx->hnd_read;
+    conn->hnd_write = loop->ctx->hnd_write;
+    conn->next = NULL;
 
-    conns[fd] = conn;
+    t->conns[fd] = conn;
     
     return conn;
 }
 
-srv_conn *get_conn_by_fd(int fd) {
-    if(fd >= szconns) {
+srv_conn *get_conn_by_fd(conn_table_t *t, int fd) {
+    if(fd < 0 || fd >= t->szconns) {
         return 0;
     }
-    return conns[fd];
+    return t->conns[fd];
+}
+
+/* O(1). NULL if the handle's connection has been closed */
+srv_conn *conn_resolve(conn_table_t *t, srv_handle_t h) {
+    srv_conn *conn;
+    int fd;
+
+    fd = HANDLE_FD(h);
+    if(fd >= t->szconns)
+        return NULL;
+
+    conn = t->conns[fd];
+    if(conn == NULL || conn->gen != HANDLE_GEN(h))
+        return NULL;
+
+    return conn;
 }
 
-void remove_conn_by_fd(int fd) {
-    if(fd < szconns) {
-        free(conns[fd]);
-        conns[fd] = 0;
+void remove_conn_by_fd(conn_table_t *t, int fd) {
+    srv_conn *conn;
+
+    if(fd >= 0 && fd < t->szconns && t->conns[fd]) {
+        conn = t->conns[fd];
+        t->conns[fd] = 0;
+
+        /* Mark the connection as closed and defer freeing it */
+        conn->fd = -1;
+        conn->next = t->closed;
+        t->closed = conn;
+    }
+}
+
+void conn_collect(conn_table_t *t) {
+    srv_conn *conn;
+
+    while(t->closed) {
+        conn = t->closed;
+        t->closed = conn->next;
+
+        /* Handlers may have been looking at the input buffer up to here */
+        in_free(conn);
+
+        /* Back to the free list. The slab memory stays with the loop */
+        conn->next = t->free_conns;
+        t->free_conns = conn;
+    }
+}
+
+/* Stop reading from the connection until the matching conn_unhold_read().
+   Holds nest: the output queue, the linked connections and the worker pool
+   each take their own. The application's wish for EVENTRD is kept in
+   CONN_RDHELD meanwhile, see srv_notify_event() */
+void conn_hold_read(srv_conn *conn) {
+    if(conn->holds++ > 0 || !(conn->events & EVENTRD))
+        return;
+
+    if(event_mod_fd(&conn->loop->ev, conn->fd, conn->events & ~EVENTRD, conn) == 0) {
+        conn->events &= ~EVENTRD;
+        conn->flags |= CONN_RDHELD;
     }
 }
 
+/* Readiness that built up in the meantime is reported on the next wait,
+   edge-triggered or not */
+void conn_unhold_read(srv_conn *conn) {
+    if(--conn->holds > 0 || !(conn->flags & CONN_RDHELD))
+        return;
+
+    conn->flags &= ~CONN_RDHELD;
+    if(event_mod_fd(&conn->loop->ev, conn->fd, conn->events | EVENTRD, conn) == 0)
+        conn->events |= EVENTRD;
+}
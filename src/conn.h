@@ -0,0 +1,97 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _CONN_H
+#define _CONN_H
+
+/* Connection state flags */
+#define CONN_EDGE     1  /* Edge-triggered notifications */
+#define CONN_RDREADY  2  /* Readable until a read sees EAGAIN or EOF */
+#define CONN_WRREADY  4  /* Writable until a write sees EAGAIN */
+#define CONN_RDSEEN   8  /* The handler has read since it was called */
+#define CONN_WRSEEN  16  /* The handler has written since it was called */
+#define CONN_OFFLOAD 32  /* Waiting on the worker pool, reads paused */
+#define CONN_FLUSH   64  /* On the loop's list of output queues to flush */
+#define CONN_WRAUTO 128  /* EVENTWR armed by the output queue */
+#define CONN_INPOOL 256  /* in_buf is borrowed from the loop's buffer pool */
+#define CONN_CONNECTING 512 /* Outbound, connect() in progress */
+#define CONN_IDLE  1024  /* Parked in an upstream pool */
+#define CONN_PROXY 2048  /* Joined to another by srv_proxy() */
+#define CONN_HIGH  4096  /* Output above the high watermark, reads held */
+#define CONN_RDHELD 8192 /* EVENTRD taken away by a hold, due back after it */
+#define CONN_PIPEWAIT 16384 /* Waiting for the pipe at the head of the output
+                               queue to fill. See out_pipe_wait() */
+
+/* Connections are carved out of slabs of CONN_SLAB objects, each rounded up
+   to a cache line, and recycled through a free list */
+#define CONN_SLAB      64
+#define CONN_CACHELINE 64
+#define CONN_SIZE      ((sizeof(srv_conn) + CONN_CACHELINE - 1) & ~(CONN_CACHELINE - 1))
+
+/* The fd-indexed table starts at CONN_TABLE_CHUNK entries and grows on
+   demand, up to the process fd limit */
+#define CONN_TABLE_CHUNK 1024
+
+/* srv_handle_t layout: fd in bits 0-31, index of the owning loop in bits
+   32-39, generation of the fd's slot in bits 40-63. Generation 0 is never
+   used so no live connection has SRV_HANDLE_NONE as its handle */
+#define HANDLE_MAKE(gen, loop, fd) (((srv_handle_t) (gen) << 40) | \
+                                    ((srv_handle_t) (loop) << 32) | \
+                                    (srv_handle_t) (unsigned int) (fd))
+#define HANDLE_FD(h)    ((int) ((h) & 0x7fffffff))
+#define HANDLE_LOOP(h)  ((int) (((h) >> 32) & 0xff))
+#define HANDLE_GEN(h)   ((unsigned int) ((h) >> 40))
+#define HANDLE_GEN_MASK 0xffffff
+#define HANDLE_MAX_LOOPS 256
+
+typedef struct _conn_slab {
+    struct _conn_slab *next;
+} conn_slab_t;
+
+/* Per-loop connection table indexed by fd */
+typedef struct {
+    srv_conn **conns;
+    unsigned int *gens; /* Generation of each slot, parallel to conns */
+    int szconns;
+    int maxconns; /* RLIMIT_NOFILE when the table was set up */
+
+    conn_slab_t *slabs;
+    srv_conn *free_conns;
+
+    /* Connections removed while a batch of events was being dispatched.
+       Later events in the same batch may still point to them, so they are
+       only freed by conn_collect() once the batch is done */
+    srv_conn *closed;
+} conn_table_t;
+
+int conn_init(conn_table_t *t);
+void conn_free(conn_table_t *t);
+
+srv_conn *new_conn(conn_table_t *t, srv_loop *loop, int fd);
+srv_conn *get_conn_by_fd(conn_table_t *t, int fd);
+srv_conn *conn_resolve(conn_table_t *t, srv_handle_t h);
+void remove_conn_by_fd(conn_table_t *t, int fd);
+void conn_collect(conn_table_t *t);
+void conn_hold_read(srv_conn *conn);
+void conn_unhold_read(srv_conn *conn);
+
+#endif
@@ -23,92 +23,194 @@ SOFTWARE.
 #include "serv.h"
 #include "serv_internal.h"
 #include "serv_tcp.h"
-#include "serv_select.h"
-#include "serv_epoll.h"
+#include "serv_unix.h"
+#include "serv_loop.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+THREAD_LOCAL srv_loop *loop_current = NULL;
+
+/* Blocking connect. See srv_connect_async() for one that doesn't hold up
+   the loop */
 int srv_connect(char *hostname, char *port) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
     int status, fd;
-    struct addrinfo hints;
-    struct addrinfo *servinfo;
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
 
-    status = getaddrinfo(hostname, port, &hints, &servinfo);
-    if(status) {
-        /* TODO: Check the error code and set errno appropriately */
+    if(!hostname || !port) {
+        errno = EINVAL;
         return -1;
     }
 
-    fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
-    if(fd == -1)
+    if(resolve_sync(hostname, port, &addr, &addrlen) == -1)
         return -1;
 
-    status = connect(fd, servinfo->ai_addr, servinfo->ai_addrlen);
-    if(status == -1)
+    fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if(fd == -1)
         return -1;
 
-    freeaddrinfo(servinfo);
+    if(connect(fd, (struct sockaddr *) &addr, addrlen) == -1) {
+        status = errno;
+        close(fd);
+        errno = status;
+        return -1;
+    }
 
     return fd;
 }
 
 int srv_close(srv_conn *conn) {
-    int fd;
+    int fd, status;
+    srv_loop *loop;
+
     fd = conn->fd;
-    event_remove_fd(conn->ctx->ev, fd);
-    remove_conn_by_fd(fd);
-    return close(fd);
+    loop = conn->loop;
+
+    /* Takes the other side of the proxy down too */
+    if(conn->proxy)
+        proxy_close(conn);
+
+    if(conn->idle_timer) {
+        srv_timer_cancel(conn->idle_timer);
+        conn->idle_timer = NULL;
+    }
+
+    if(conn->flags & CONN_PIPEWAIT)
+        out_pipe_unwait(conn);
+
+    if(conn->connect_timer) {
+        srv_timer_cancel(conn->connect_timer);
+        conn->connect_timer = NULL;
+    }
+
+    /* Last chance for queued output. Whatever doesn't fit in the socket
+       buffer is dropped */
+    if(conn->out_head)
+        out_flush(conn);
+    out_free(conn);
+
+    /* The kernel may still be sending from zero-copy buffers. The socket
+       outlives the connection then */
+    if(conn->zc && zc_linger(conn)) {
+        remove_conn_by_fd(&loop->conns, fd);
+        status = 0;
+    }
+    else {
+        event_remove_fd(&loop->ev, fd);
+        remove_conn_by_fd(&loop->conns, fd);
+        status = close(fd);
+    }
+
+    /* May hand the freed place straight to a waiting srv_upstream_get() */
+    if(conn->upstream)
+        upstream_close(conn);
+
+    return status;
+}
+
+/* Track the readiness of edge-triggered connections. A read that sees
+   EAGAIN or EOF means the socket has been drained */
+static inline void conn_read_done(srv_conn *conn, int nread) {
+    conn->flags |= CONN_RDSEEN;
+    if(nread == 0 || (nread == -1 && WOULDBLOCK()))
+        conn->flags &= ~CONN_RDREADY;
+}
+
+static inline void conn_write_done(srv_conn *conn, int nwritten) {
+    conn->flags |= CONN_WRSEEN;
+    if(nwritten == -1 && WOULDBLOCK())
+        conn->flags &= ~CONN_WRREADY;
 }
 
 int srv_read(srv_conn *conn, char *buf, int size) {
     /* TODO: WSAGetLastError */
-    return read(conn->fd, buf, size);
+    int nread;
+
+    if(conn->in_end > conn->in_start) {
+        /* Buffered by the library first */
+        nread = conn->in_end - conn->in_start;
+        if(nread > size)
+            nread = size;
+        memcpy(buf, conn->in_buf + conn->in_start, nread);
+        conn->in_start += nread;
+        conn->in_scan = 0;
+        return nread;
+    }
+
+    nread = read(conn->fd, buf, size);
+    conn_read_done(conn, nread);
+    return nread;
 }
 
+/* Read until 'size' bytes are read, the peer closes the connection or the
+   socket runs dry. Returns the number of bytes read, or -1 if nothing could
+   be read. errno is EAGAIN if the socket ran dry before anything was read */
 int srv_readall(srv_conn *conn, char *buf, int size) {
-    /* TODO: Handle EINTR */
     int nread, total_read = 0;
 
     /* Make sure 'size' bytes are read */
     while(total_read != size) {
         nread = read(conn->fd, buf, size - total_read);
 
-        if(nread <= 0)
-            return total_read;
+        if(nread == -1 && errno == EINTR)
+            continue;
+
+        if(nread <= 0) {
+            conn_read_done(conn, nread);
+            return (total_read || nread == 0) ? total_read : -1;
+        }
 
         total_read += nread;
         buf += nread;
     }
+
+    conn->flags |= CONN_RDSEEN;
     return total_read;
 }
 
 int srv_write(srv_conn *conn, char *buf, int size) {
     /* TODO: WSAGetLastError */
-    return write(conn->fd, buf, size);
+    int nwritten;
+
+    nwritten = write(conn->fd, buf, size);
+    conn_write_done(conn, nwritten);
+    return nwritten;
 }
 
+/* Write all of buf. Whatever the socket buffer doesn't take is queued with
+   srv_send() and written once the socket is writable again, so the call
+   never blocks and nothing is lost. Returns 'size', or -1 on errors */
 int srv_writeall(srv_conn *conn, char *buf, int size) {
-    /* TODO: Handle EINTR */
     int nwritten, total_written = 0;
 
-    /* Make sure 'size' bytes are written */
+    /* Queued output must go first */
+    if(conn->out_head)
+        return srv_send(conn, buf, size) == -1 ? -1 : size;
+
     while(total_written != size) {
         nwritten = write(conn->fd, buf, size - total_written);
 
-        switch(nwritten) {
-            case 0: return total_written; break;
-            case -1: return -1; break;
+        if(nwritten == -1 && errno == EINTR)
+            continue;
+
+        if(nwritten <= 0) {
+            conn_write_done(conn, nwritten);
+            if(nwritten == -1 && !WOULDBLOCK())
+                return -1;
+
+            /* Socket buffer full. Queue the rest */
+            if(srv_send(conn, buf, size - total_written) == -1)
+                return -1;
+            return size;
         }
 
         total_written += nwritten;
         buf += nwritten;
     }
+
+    conn->flags |= CONN_WRSEEN;
     return total_written;
 }
 
@@ -122,11 +224,6 @@ int srv_init(srv_t *ctx) {
         return -1;
     }
 
-    /* Initialize the connection list */
-    /* TODO: The number is chosen arbitrarily. Get the fd limits from
-       the OS instead */
-    conn_init(1000000);
-
 #ifdef _WIN32
     if(WSAStartup(MAKEWORD(2,2), &wsaData) != 0) {
         /* TODO: Set errno */
@@ -137,10 +234,28 @@ int srv_init(srv_t *ctx) {
     /* Set default values for the options */
     ctx->host = NULL;
     ctx->port = NULL;
+    ctx->unix_path = NULL;
     ctx->backlog = 1;
     ctx->maxevents = 1000; /* Good enough? */
-    ctx->szreadbuf  = 512;
-    ctx->szwritebuf = 512;
+    ctx->szreadbuf  = 4096;
+    ctx->maxreadbuf = 1 << 20;
+    ctx->szwritebuf = 4096;
+    ctx->fdlistener = -1;
+    ctx->loops = NULL;
+    ctx->nloops = 0;
+    ctx->pool = NULL;
+    ctx->nworkers = 0;
+    ctx->busy_poll = 0;
+    ctx->file_cache_max = 64;
+    ctx->file_cache_ttl = 1000;
+    ctx->zerocopy_min = 65536;
+    ctx->szpoolbuf = 16384;
+    ctx->npoolbufs = 0;
+    ctx->connect_timeout = 0;
+    ctx->wm_high = SIZE_MAX;
+    ctx->wm_low = 0;
+    ctx->out_limit = 0;
+    ctx->out_total = 0;
 
     /* Initialize handler pointers to 0 */
     ctx->hnd_accept = 0;
@@ -149,6 +264,13 @@ int srv_init(srv_t *ctx) {
     ctx->hnd_hup    = 0;
     ctx->hnd_rdhup  = 0;
     ctx->hnd_error  = 0;
+    ctx->hnd_timeout = 0;
+    ctx->hnd_data = 0;
+    ctx->hnd_message = 0;
+    ctx->hnd_request = 0;
+    ctx->hnd_datagram = 0;
+    memset(&ctx->framing, 0, sizeof(ctx->framing));
+    ctx->datagram = 0;
 
     /* By default, only read events are reported for new fds */
     ctx->newfd_event_flags = EVENTRD;
@@ -156,172 +278,659 @@ int srv_init(srv_t *ctx) {
     return 0;
 }
 
-/* TODO: WSACleanup on error */
-int srv_run(srv_t *ctx) {
-    event_t ev;
+/* Create the socket a loop accepts on. Unix sockets can't share an address
+   through SO_REUSEPORT, so the loops of srv_run_threads(), which sit next
+   to each other in ctx's array, all accept from the first loop's socket.
+   It is registered with EVENTEXCL so a connection wakes one loop rather
+   than all of them. Unlike SO_REUSEPORT that doesn't spread connections
+   evenly: the kernel wakes whichever loop is waiting, so a lightly loaded
+   one takes more. Without EPOLLEXCLUSIVE every loop still wakes and all
+   but one see EAGAIN */
+static int loop_listener(srv_loop *loop, srv_t *ctx, int reuseport) {
+    if(ctx->unix_path) {
+        if(loop->index > 0)
+            return dup((loop - loop->index)->fdlistener);
+        return srv_unix_create_listener(ctx);
+    }
 
-    int event_fd, cli_fd, event_type;
+    return srv_tcp_create_listener(ctx, reuseport);
+}
 
-    int  cli_port;
-    char cli_addr[INET6_ADDRSTRLEN];
-    
-    srv_conn *conn;
+/* Create the listener, the event mechanism and the connection table of a
+   loop. With reuseport set, the listener is bound with SO_REUSEPORT so that
+   several loops can listen on the same address */
+static int loop_init(srv_loop *loop, srv_t *ctx, int index, int reuseport) {
+    int status;
+
+    loop->ctx = ctx;
+    loop->index = index;
+    loop->flush = NULL;
+    loop->in_scratch = NULL;
+    loop->udp = NULL;
+    loop->zc_linger = NULL;
+    loop->status = 0;
+    file_cache_init(&loop->files);
+    buf_pool_init(&loop->bufs, ctx->szpoolbuf, ctx->npoolbufs);
+    loop->now = srv_clock_ms();
+    memset(&loop->busy, 0, sizeof(loop->busy));
 
-    if(!ctx) {
-        errno = EINVAL;
+    /* Create a listener socket */
+    if((loop->fdlistener = loop_listener(loop, ctx, reuseport)) == -1)
         return -1;
+
+    /* The listener must not block */
+    if(srv_setnoblock(loop->fdlistener) == -1)
+        goto err_listener;
+
+    if(ctx->datagram && udp_init(loop) == -1)
+        goto err_listener;
+
+    /* Initialize the connection list */
+    if(conn_init(&loop->conns) == -1)
+        goto err_listener;
+
+    /* Initialize the event notification mechanism */
+    if(event_init(&loop->ev, ctx->maxevents) == -1)
+        goto err_conns;
+
+    /* Request read event notifications for the listener. A UDP socket is
+       read like any other fd. A shared unix listener wakes one loop, see
+       loop_listener() */
+#ifdef EVENTACCEPT
+    if(!ctx->datagram)
+        status = event_add_listener(&loop->ev, loop->fdlistener, &loop->fdlistener);
+    else
+#endif
+    status = event_add_fd(&loop->ev, loop->fdlistener,
+                          EVENTRD | (ctx->unix_path ? EVENTEXCL : 0), &loop->fdlistener);
+    if(status == -1)
+        goto err_ev;
+
+    /* Wakeup channel for srv_post() */
+    if(post_init(&loop->post) == -1)
+        goto err_ev;
+
+    if(loop->post.fd != -1 &&
+            event_add_fd(&loop->ev, loop->post.fd, EVENTRD, &loop->post) == -1)
+        goto err_post;
+
+    tw_init(&loop->timers, loop->now);
+
+    return 0;
+
+err_post:
+    status = errno;
+    post_free(&loop->post);
+    errno = status;
+err_ev:
+    status = errno;
+    event_free(&loop->ev);
+    errno = status;
+err_conns:
+    conn_free(&loop->conns);
+err_listener:
+    status = errno;
+    udp_free(loop);
+    close(loop->fdlistener);
+    errno = status;
+    return -1;
+}
+
+static int loop_free(srv_loop *loop) {
+    int status = 0;
+
+    /* Close the listener socket. There is nothing to shut down on a UDP
+       socket, and a unix socket may still be shared with other loops */
+    if(!loop->udp && !loop->ctx->unix_path &&
+            shutdown(loop->fdlistener, SHUT_RDWR) == -1)
+        status = -1;
+
+    if(close(loop->fdlistener) == -1)
+        status = -1;
+
+    if(loop->index == 0)
+        srv_unix_unlink(loop->ctx);
+
+    /* Deinitialize the event mechanism */
+    if(event_free(&loop->ev) == -1)
+        status = -1;
+
+    resolve_cancel(loop);
+    post_free(&loop->post);
+    tw_free(&loop->timers);
+    conn_free(&loop->conns);
+    zc_linger_free(loop);
+    file_cache_free(&loop->files);
+    buf_pool_free(&loop->bufs);
+    udp_free(loop);
+    free(loop->in_scratch);
+
+    return status;
+}
+
+/* Register a connection just accepted. Its peer address is in loop->addr */
+static void loop_add_conn(srv_loop *loop, int cli_fd) {
+    srv_t *ctx;
+    srv_conn *conn;
+
+    ctx = loop->ctx;
+
+    /* Add the connection to the list */
+    conn = new_conn(&loop->conns, loop, cli_fd);
+    if(conn == NULL) {
+        close(cli_fd);
+        return;
+    }
+    memcpy(&conn->addr, &loop->addr, loop->addrlen);
+    conn->addrlen = loop->addrlen;
+    conn->port = srv_tcp_port(&loop->addr);
+    conn->host = NULL;
+
+    /* Add the new fd to the event list */
+    if(event_add_fd(&loop->ev, cli_fd, ctx->newfd_event_flags, conn) == -1) {
+        remove_conn_by_fd(&loop->conns, cli_fd);
+        close(cli_fd);
+        return;
     }
 
-    /* Pointer to th event_t structure. Needed for srv_notify_event()
-       and srv_newfd_notify_event() */
-    ctx->ev = (void *) &ev;
+    /* Accepted connection. Call the accept handler */
+    if(ctx->hnd_accept) {
+        (*(ctx->hnd_accept))(conn);
+    }
+}
 
-    /* Port must be specified and we must have a read handler */
-    if(ctx->port == NULL || ctx->hnd_read == NULL) {
-        errno = EINVAL; /* Invalid argument */
-        return -1;
+/* Accept every pending connection on the loop's listener */
+static void loop_accept(srv_loop *loop) {
+    srv_t *ctx;
+    int cli_fd;
+
+    ctx = loop->ctx;
+
+    while(1) {
+        /* Accept the connection */
+        cli_fd = srv_tcp_accept(loop->fdlistener, &loop->addr, &loop->addrlen,
+                    SOCK_NONBLOCK, ctx->unix_path ? 0 : ctx->busy_poll);
+
+        if(cli_fd == -1) {
+#ifdef _WIN32
+            if(WSAGetLastError() == WSAEWOULDBLOCK) {
+#else
+            if(likely((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+#endif
+                /* We've processed all incoming connections */
+                break;
+            }
+            else {
+                /* accept returned error */
+                if(ctx->hnd_error)
+                    ((*ctx->hnd_error))(NULL, SRV_EACCEPT);
+                break;
+            }
+        }
+
+        loop_add_conn(loop, cli_fd);
     }
+}
 
-    /* Create a listener socket */
-    if((ctx->fdlistener = srv_tcp_create_listener(ctx)) == -1)
-        return -1;
+#ifdef EVENTACCEPT
+/* The backend has already accepted the connection. 'res' is the new fd or
+   -errno */
+static void loop_accepted(srv_loop *loop, int res) {
+    if(res < 0) {
+        if(loop->ctx->hnd_error)
+            (*(loop->ctx->hnd_error))(NULL, SRV_EACCEPT);
+        return;
+    }
 
-    /* The listener must not block */
-    if(srv_setnoblock(ctx->fdlistener) == -1)
-        return -1;
+    if(srv_tcp_peer(res, &loop->addr, &loop->addrlen) == -1) {
+        loop->addr.ss_family = AF_UNSPEC;
+        loop->addrlen = 0;
+    }
 
-    /* Initialize the event notification mechanism */
-    if(event_init(&ev, ctx->maxevents) == -1)
-        return -1;
+    if(!loop->ctx->unix_path)
+        srv_tcp_busy_poll(res, loop->ctx->busy_poll);
+
+    loop_add_conn(loop, res);
+}
+#endif
+
+/* Edge-triggered connections are notified only once when they become ready.
+   Keep calling the handler until it has seen EAGAIN, so that nothing is
+   left unread. The drain stops early if the handler returns without trying
+   to read, closes the connection or stops asking for read events */
+static void conn_drain_read(srv_conn *conn) {
+    void (*hnd)(srv_conn *) = conn->ctx->hnd_read;
+
+    while((conn->flags & CONN_RDREADY) && (conn->events & EVENTRD)) {
+        conn->flags &= ~CONN_RDSEEN;
+        (*hnd)(conn);
+
+        if(conn->fd == -1 || !(conn->flags & CONN_RDSEEN))
+            break;
+    }
+}
+
+static void conn_drain_write(srv_conn *conn) {
+    void (*hnd)(srv_conn *) = conn->ctx->hnd_write;
+
+    while((conn->flags & CONN_WRREADY) && (conn->events & EVENTWR)) {
+        conn->flags &= ~CONN_WRSEEN;
+        (*hnd)(conn);
 
-    /* Request read event notifications for the listener */
-    if(event_add_fd(&ev, ctx->fdlistener, EVENTRD) == -1)
+        if(conn->fd == -1 || !(conn->flags & CONN_WRSEEN))
+            break;
+    }
+}
+
+/* Counters read by other threads. Only the loop itself writes them */
+static inline void loop_stat_add(unsigned long long *stat, unsigned long long n) {
+    __atomic_store_n(stat, *stat + n, __ATOMIC_RELAXED);
+}
+
+/* Spin on non-blocking waits for up to ctx->busy_poll microseconds before
+   blocking. Trades a core for the wakeup latency of a blocking wait */
+static int loop_busy_wait(srv_loop *loop, int timeout) {
+    uint64_t start, now, budget;
+    int nevents;
+
+    budget = loop->ctx->busy_poll;
+    if(timeout > 0 && (uint64_t) timeout * 1000 < budget)
+        budget = (uint64_t) timeout * 1000;
+
+    start = srv_clock_us();
+    do {
+        nevents = event_wait(&loop->ev, 0);
+        now = srv_clock_us();
+
+        /* A signal only cuts one try short */
+        if(nevents == -1 && errno == EINTR)
+            nevents = 0;
+    } while(nevents == 0 && now - start < budget);
+
+    loop_stat_add(&loop->busy.spin_usec, now - start);
+
+    if(nevents == -1)
         return -1;
 
+    if(nevents > 0) {
+        loop_stat_add(&loop->busy.hits, 1);
+        return nevents;
+    }
+
+    loop_stat_add(&loop->busy.misses, 1);
+
+    if(timeout > 0) {
+        /* Whatever is left of the timer timeout */
+        timeout -= (int) ((now - start) / 1000);
+        if(timeout < 0)
+            timeout = 0;
+    }
+
+    return event_wait(&loop->ev, timeout);
+}
+
+static int loop_run(srv_loop *loop) {
+    srv_t *ctx;
+    event_t *ev;
+
+    int i, nevents, timeout;
+    uint32_t event_type;
+    void *event_data;
+    uint64_t next;
+
+    srv_conn *conn;
+
+    ctx = loop->ctx;
+    ev = &loop->ev;
+    loop_current = loop;
+
     /* Event loop */
     while(1) {
-        if(event_wait(&ev, &event_fd, &event_type) == -1) {
-            /* TODO: Handle EINTR */
+        /* Sleep until the next timer is due */
+        next = tw_next(&loop->timers);
+        if(loop->post.more)
+            timeout = 0;
+        else if(next == UINT64_MAX)
+            timeout = -1;
+        else if(next <= loop->now)
+            timeout = 0;
+        else if(next - loop->now > INT_MAX)
+            timeout = INT_MAX;
+        else
+            timeout = (int) (next - loop->now);
+
+        if(ctx->busy_poll && timeout != 0)
+            nevents = loop_busy_wait(loop, timeout);
+        else
+            nevents = event_wait(ev, timeout);
+        loop->now = srv_clock_ms();
+
+        if(nevents == -1) {
+            if(errno == EINTR)
+                continue;
             return -1;
         }
 
-        /* Handle the event */
-        if(!event_type) {
-            /* No events. We should never get here in the first place */
-            continue;
-        }
+        /* Walk the ready batch. Connections carry themselves as the event
+           data so no lookup is needed */
+        for(i = 0; i < nevents; i++) {
+            event_data = EVENT_DATA(ev, i);
+            event_type = EVENT_TYPE(ev, i);
+
+            if(event_data == &loop->fdlistener) {
+                if(loop->udp) {
+                    /* Datagrams, or room for the queued replies */
+                    if(event_type & EVENTRD)
+                        udp_readable(loop);
+                    if(event_type & EVENTWR)
+                        udp_flush(loop);
+                    continue;
+                }
+#ifdef EVENTACCEPT
+                if(event_type & EVENTACCEPT) {
+                    loop_accepted(loop, EVENT_RESULT(ev, i));
+                    continue;
+                }
+#endif
+                /* Incoming connection */
+                loop_accept(loop);
+                continue;
+            }
 
-        if(event_type & EVENTERR) {
-            /* An error has occured */
+            if(event_data == &loop->post) {
+                /* Tasks posted from other threads */
+                post_run(loop);
+                continue;
+            }
 
-            /* Notify the caller */
-            if(ctx->hnd_error) {
-                conn = get_conn_by_fd(event_fd);
-                (*(ctx->hnd_error))(conn, 0); /* TODO: Return the proper error no */
+            if(unlikely((uintptr_t) event_data & OUT_PIPE_TAG)) {
+                /* A pipe queued with srv_splice() has data again */
+                out_pipe_ready(event_data);
+                continue;
             }
 
-            event_remove_fd(&ev, event_fd);
-            close(event_fd);
-        }
+            if(event_data == &loop->zc_linger) {
+                /* Completions for closed connections */
+                zc_linger_reap(loop);
+                continue;
+            }
 
-        if(event_type & EVENTHUP) {
-            /* The connection has been shutdown unexpectedly */
+            conn = (srv_conn *) event_data;
+            if(unlikely(conn->fd == -1)) {
+                /* Closed by an earlier event of this batch */
+                continue;
+            }
 
-            /* Notify the caller */
-            if(ctx->hnd_hup) {
-                conn = get_conn_by_fd(event_fd);
-                (*(ctx->hnd_hup))(conn);
+            /* Checked lazily by the idle timer */
+            conn->last_active = loop->now;
+
+            if(unlikely(conn->flags & (CONN_CONNECTING | CONN_IDLE | CONN_PROXY))) {
+                /* Not the application's yet, parked in a pool, or joined
+                   to another connection */
+                if(conn->flags & CONN_PROXY)
+                    proxy_event(conn, event_type);
+                else
+                    upstream_event(conn, event_type);
+                continue;
             }
 
-            event_remove_fd(&ev, event_fd);
-            close(event_fd);
-        }
+            if((event_type & EVENTERR) && !(conn->zc && zc_reap(conn))) {
+                /* An error has occured. Zero-copy completions are reported
+                   the same way, those were reaped above */
 
-        if (event_type & EVENTRDHUP) {
-            /* The client has closed the connection */
+                /* Notify the caller */
+                if(ctx->hnd_error)
+                    (*(ctx->hnd_error))(conn, 0); /* TODO: Return the proper error no */
 
-            /* Notify the caller */
-            if(ctx->hnd_rdhup) {
-                conn = get_conn_by_fd(event_fd);
-                (*(ctx->hnd_rdhup))(conn);
+                if(conn->fd != -1)
+                    srv_close(conn);
+                continue;
             }
 
-            event_remove_fd(&ev, event_fd);
-            close(event_fd);
-        }
+            if(event_type & EVENTHUP) {
+                /* The connection has been shutdown unexpectedly */
 
-        if(event_type & EVENTRD) {
-            if(event_fd == ctx->fdlistener) {
-                /* Incoming connection */
-                while(1) {
-                    /* Accept the connection */
-                    cli_fd = srv_tcp_accept(ctx->fdlistener, (char *)&cli_addr,
-                                (int *)&cli_port, SOCK_NONBLOCK);
+                /* Notify the caller */
+                if(ctx->hnd_hup)
+                    (*(ctx->hnd_hup))(conn);
 
-                    if(cli_fd == -1) {
-#ifdef _WIN32
-                        if(WSAGetLastError() == WSAEWOULDBLOCK) {
-#else
-                        if(likely((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
-#endif
-                            /* We've processed all incoming connections */
-                            break;
-                        }
-                        else {
-                            /* accept returned error */
-                            if(ctx->hnd_error) {
-                                conn = get_conn_by_fd(cli_fd);
-                                ((*ctx->hnd_error))(conn, SRV_EACCEPT);
-                            }
-                            break;
-                        }
-                    }
-
-                    /* Add the new fd to the event list */
-                    event_add_fd(&ev, cli_fd, ctx->newfd_event_flags); /* TODO: Error handling */
-
-                    /* Add the connection to the list */
-                    conn = new_conn(ctx, cli_fd);
-                    conn->host = cli_addr;
-                    conn->port = cli_port;
-
-                    /* Accepted connection. Call the accept handler */
-                    if(ctx->hnd_accept) {
-                        (*(ctx->hnd_accept))(conn);
-                    }
+                if(conn->fd != -1)
+                    srv_close(conn);
+                continue;
+            }
+
+            if(event_type & EVENTRDHUP) {
+                /* The client has closed the connection */
+
+                /* Notify the caller */
+                if(ctx->hnd_rdhup)
+                    (*(ctx->hnd_rdhup))(conn);
+
+                if(conn->fd != -1)
+                    srv_close(conn);
+                continue;
+            }
+
+            if((event_type & EVENTRD) && (conn->events & EVENTRD)) {
+                /* Data available for read, unless reads have been held
+                   since the batch was collected */
+                if(IN_MANAGED(ctx))
+                    in_readable(conn);
+                else if(conn->flags & CONN_EDGE) {
+                    conn->flags |= CONN_RDREADY;
+                    conn_drain_read(conn);
                 }
+                else
+                    (*(ctx->hnd_read))(conn);
             }
-            else {
-                /* Data available for read */
-                conn = get_conn_by_fd(event_fd);
-                (*(ctx->hnd_read))(conn);
+
+            if((event_type & EVENTWR) && conn->fd != -1 && conn->out_head) {
+                /* Room for queued output */
+                if(out_flush(conn) == -1) {
+                    if(ctx->hnd_error)
+                        (*(ctx->hnd_error))(conn, SRV_ESOCKET);
+
+                    if(conn->fd != -1)
+                        srv_close(conn);
+                    continue;
+                }
+            }
+
+            if((event_type & EVENTWR) && conn->fd != -1 && ctx->hnd_write &&
+                    (conn->events & EVENTWR) && !(conn->flags & CONN_WRAUTO)) {
+                /* Socket ready for write, and the application asked for it */
+                if(conn->flags & CONN_EDGE) {
+                    conn->flags |= CONN_WRREADY;
+                    conn_drain_write(conn);
+                }
+                else
+                    (*(ctx->hnd_write))(conn);
             }
         }
+
+        /* Run the expired timers */
+        tw_advance(&loop->timers, loop->now);
+
+        /* Tasks left over from the last drain, or posted by the loop to
+           itself */
+        if(loop->post.more)
+            post_run(loop);
+
+        /* Write out everything sent during this iteration */
+        loop_flush(loop);
+
+        /* Free the connections closed during this batch */
+        conn_collect(&loop->conns);
     }
 
-    if(event_type & EVENTWR) {
-        /* Socket ready for write */
-        if(ctx->hnd_write) {
-            conn = get_conn_by_fd(event_fd);
-            (*(ctx->hnd_write))(conn);
-        }
+    return 0; /* Terminated succesfully */
+}
+
+#ifndef _WIN32
+static void *loop_thread(void *arg) {
+    srv_loop *loop = (srv_loop *) arg;
+
+    loop->status = loop_run(loop);
+    return NULL;
+}
+#endif
+
+/* A port or unix path, and something to hand the input to. In datagram mode that is
+   hnd_datagram, connection handlers are never called */
+static int srv_runnable(srv_t *ctx) {
+    if(ctx->port == NULL && ctx->unix_path == NULL)
+        return 0;
+
+    if(ctx->datagram)
+        return ctx->hnd_datagram != NULL;
+
+    return ctx->hnd_read != NULL || IN_MANAGED(ctx);
+}
+
+/* TODO: WSACleanup on error */
+int srv_run(srv_t *ctx) {
+    srv_loop loop;
+    int status;
+
+    if(!ctx) {
+        errno = EINVAL;
+        return -1;
     }
 
-    /* Close the listener socket */
-    if(shutdown(ctx->fdlistener, SHUT_RDWR) == -1)
+    /* Port must be specified and we must have a read handler */
+    if(!srv_runnable(ctx)) {
+        errno = EINVAL; /* Invalid argument */
         return -1;
+    }
 
-    if(close(ctx->fdlistener) == -1)
+    if(loop_init(&loop, ctx, 0, 0) == -1)
         return -1;
 
-    /* Deinitialize the event mechanism */
-    if(event_free(&ev) == -1)
+    if(pool_start(ctx) == -1) {
+        status = errno;
+        loop_free(&loop);
+        errno = status;
         return -1;
+    }
+
+    /* Needed for srv_get_listenerfd() and srv_post() */
+    ctx->nloops = 1;
+    ctx->fdlistener = loop.fdlistener;
+    __atomic_store_n(&ctx->loops, &loop, __ATOMIC_RELEASE);
+
+    status = loop_run(&loop);
+
+    /* Workers may still post results, so stop them before the loop goes */
+    pool_stop(ctx);
+
+    __atomic_store_n(&ctx->loops, NULL, __ATOMIC_RELEASE);
+    ctx->nloops = 0;
+
+    if(loop_free(&loop) == -1)
+        status = -1;
 
 #ifdef _WIN32
     WSACleanup();
 #endif
-    return 0; /* Terminated succesfully */
+    return status;
+}
+
+/* Run nthreads independent event loops, each on its own thread with its own
+   listener, event mechanism and connection table. Listeners are bound with
+   SO_REUSEPORT so that the kernel spreads incoming connections across the
+   loops. A connection stays on the loop that accepted it for its lifetime.
+   The calling thread runs the first loop */
+int srv_run_threads(srv_t *ctx, int nthreads) {
+#ifdef _WIN32
+    if(nthreads == 1)
+        return srv_run(ctx);
+
+    /* TODO: SO_REUSEPORT has no equivalent in Winsock */
+    errno = ENOSYS;
+    return -1;
+#else
+    srv_loop *loops;
+    int i, status;
+
+    if(!ctx || nthreads < 1 || nthreads > HANDLE_MAX_LOOPS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Port must be specified and we must have a read handler */
+    if(!srv_runnable(ctx)) {
+        errno = EINVAL; /* Invalid argument */
+        return -1;
+    }
+
+    loops = calloc(nthreads, sizeof(srv_loop));
+    if(loops == NULL)
+        return -1;
+
+    /* Bind every listener before any loop starts accepting */
+    for(i = 0; i < nthreads; i++) {
+        if(loop_init(&loops[i], ctx, i, 1) == -1) {
+            status = errno;
+            while(i--)
+                loop_free(&loops[i]);
+            free(loops);
+            errno = status;
+            return -1;
+        }
+    }
+
+    if(pool_start(ctx) == -1) {
+        status = errno;
+        for(i = 0; i < nthreads; i++)
+            loop_free(&loops[i]);
+        free(loops);
+        errno = status;
+        return -1;
+    }
+
+    ctx->nloops = nthreads;
+    ctx->fdlistener = loops[0].fdlistener;
+    __atomic_store_n(&ctx->loops, loops, __ATOMIC_RELEASE);
+
+    for(i = 1; i < nthreads; i++) {
+        if((status = pthread_create(&loops[i].thread, NULL, loop_thread, &loops[i])) != 0) {
+            /* Run with the loops we have. Closing the listeners of the loops
+               that could not be started takes them out of the kernel's
+               SO_REUSEPORT group */
+            int j;
+            ctx->nloops = i;
+            for(j = i; j < nthreads; j++)
+                loop_free(&loops[j]);
+            break;
+        }
+    }
+
+    /* The calling thread drives the first loop */
+    loops[0].thread = pthread_self();
+    loop_thread(&loops[0]);
+
+    status = loops[0].status;
+    for(i = 1; i < ctx->nloops; i++) {
+        pthread_join(loops[i].thread, NULL);
+        if(loops[i].status == -1)
+            status = -1;
+    }
+
+    pool_stop(ctx);
+
+    nthreads = ctx->nloops;
+    __atomic_store_n(&ctx->loops, NULL, __ATOMIC_RELEASE);
+    ctx->nloops = 0;
+
+    for(i = 0; i < nthreads; i++) {
+        if(loop_free(&loops[i]) == -1)
+            status = -1;
+    }
+
+    free(loops);
+
+    return status;
+#endif
 }
 
 int srv_hnd_read(srv_t *ctx, void (*h)(srv_conn *)) {
@@ -384,6 +993,31 @@ int srv_hnd_error(srv_t *ctx, void (*h)(srv_conn *, int)) {
     return 0;
 }
 
+/* Have the library read into a per-connection buffer and call h with the
+   unconsumed bytes. h releases what it has used with srv_consume(); the
+   rest stays in place and is passed again, with whatever arrives next. h
+   is called again straight away as long as it keeps consuming. Replaces
+   hnd_read */
+int srv_hnd_data(srv_t *ctx, void (*h)(srv_conn *, char *, int)) {
+    if(!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->hnd_data = h;
+    return 0;
+}
+
+int srv_hnd_timeout(srv_t *ctx, void (*h)(srv_conn *)) {
+    if(!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->hnd_timeout = h;
+    return 0;
+}
+
 void srv_set_host(srv_t *ctx, char *host) {
     ctx->host = host;
 }
@@ -402,6 +1036,56 @@ int srv_set_backlog(srv_t *ctx, int backlog) {
     return 0;
 }
 
+/* Spin for up to usec microseconds waiting for events before blocking, and
+   have the kernel busy-poll accepted sockets. 0, the default, disables it */
+int srv_set_busy_poll(srv_t *ctx, unsigned int usec) {
+    if(!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->busy_poll = usec;
+    return 0;
+}
+
+/* Busy-poll counters summed over the running loops. May be called from any
+   thread; counters are reset when the loops stop */
+int srv_get_busy_poll_stats(srv_t *ctx, srv_busy_poll_stats *stats) {
+    srv_loop *loops;
+    int i, nloops;
+
+    if(!ctx || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(srv_busy_poll_stats));
+
+    loops = __atomic_load_n(&ctx->loops, __ATOMIC_ACQUIRE);
+    nloops = ctx->nloops;
+    for(i = 0; loops && i < nloops; i++) {
+        stats->spin_usec += __atomic_load_n(&loops[i].busy.spin_usec, __ATOMIC_RELAXED);
+        stats->hits += __atomic_load_n(&loops[i].busy.hits, __ATOMIC_RELAXED);
+        stats->misses += __atomic_load_n(&loops[i].busy.misses, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+/* Initial and maximum size of the hnd_data input buffer of a connection.
+   A connection whose unconsumed input would exceed max is closed with
+   SRV_EOVERFLOW */
+int srv_set_readbuf(srv_t *ctx, int initial, int max) {
+    if(!ctx || initial < 1 || max < initial) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->szreadbuf = initial;
+    ctx->maxreadbuf = max;
+    return 0;
+}
+
 int srv_set_maxevents(srv_t *ctx, int n) {
     if(!ctx) {
         errno = EINVAL;
@@ -431,6 +1115,9 @@ int srv_register_fd(srv_t *ctx, int fd, unsigned int flags) {
 }
 */
 
+/* Select the events reported for the connection. With SRV_EVENTET the fd
+   is registered edge-triggered: the library then keeps calling the read
+   (write) handler until srv_read() (srv_write()) returns EAGAIN */
 int srv_notify_event(srv_conn *conn, unsigned int flags) {
     uint32_t f;
     srv_t *ctx;
@@ -446,8 +1133,37 @@ int srv_notify_event(srv_conn *conn, unsigned int flags) {
         f |= EVENTRD;
     if(flags & SRV_EVENTWR)
         f |= EVENTWR;
+    if(flags & SRV_EVENTET)
+        f |= EVENTET;
+
+    if(conn->flags & CONN_WRAUTO) {
+        /* The output queue is waiting for room. Keep EVENTWR unless the
+           application takes it over */
+        if(f & EVENTWR)
+            conn->flags &= ~CONN_WRAUTO;
+        else
+            f |= EVENTWR;
+    }
+
+    if(conn->holds) {
+        /* Reads are held. EVENTRD comes back once they are released */
+        if(f & EVENTRD)
+            conn->flags |= CONN_RDHELD;
+        else
+            conn->flags &= ~CONN_RDHELD;
+        f &= ~EVENTRD;
+    }
 
-    return event_mod_fd((event_t *) ctx->ev, conn->fd, f);
+    if(event_mod_fd(&conn->loop->ev, conn->fd, f, conn) == -1)
+        return -1;
+
+    conn->events = f;
+    if(f & EVENTET)
+        conn->flags |= CONN_EDGE;
+    else
+        conn->flags &= ~CONN_EDGE;
+
+    return 0;
 }
 
 int srv_newfd_notify_event(srv_t *ctx, unsigned int flags) {
@@ -463,11 +1179,56 @@ int srv_newfd_notify_event(srv_t *ctx, unsigned int flags) {
         f |= EVENTRD;
     if(flags & SRV_EVENTWR)
         f |= EVENTWR;
+    if(flags & SRV_EVENTET)
+        f |= EVENTET;
 
     ctx->newfd_event_flags = f;
     return 0;
 }
 
+/* Handle for the connection, to be kept instead of the srv_conn pointer by
+   anything that may outlive it */
+srv_handle_t srv_conn_handle(srv_conn *conn) {
+    if(!conn || conn->fd == -1)
+        return SRV_HANDLE_NONE;
+
+    return HANDLE_MAKE(conn->gen, conn->loop->index, conn->fd);
+}
+
+/* The connection behind a handle, or NULL if it has been closed. O(1), no
+   locking: only works on the thread of the loop that owns the connection,
+   and returns NULL anywhere else. Use srv_handle_post() to get there */
+srv_conn *srv_handle_resolve(srv_t *ctx, srv_handle_t h) {
+    srv_loop *loop = loop_current;
+
+    if(!ctx || !loop || loop->ctx != ctx || loop->index != HANDLE_LOOP(h))
+        return NULL;
+
+    return conn_resolve(&loop->conns, h);
+}
+
+/* Peer address of the connection as text. Formatted on first use only, so
+   that accepting stays free of string work */
+const char *srv_conn_peer_str(srv_conn *conn) {
+    if(!conn) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(conn->host == NULL) {
+        if(conn->addr.ss_family == AF_UNIX) {
+            if(srv_unix_format_addr(&conn->addr, conn->addrlen, conn->hostbuf,
+                                    sizeof(conn->hostbuf)) == -1)
+                return NULL;
+        }
+        else if(srv_tcp_format_addr(&conn->addr, conn->hostbuf, sizeof(conn->hostbuf)) == -1)
+            return NULL;
+        conn->host = conn->hostbuf;
+    }
+
+    return conn->host;
+}
+
 int srv_get_listenerfd(srv_t *ctx) {
     if(!ctx) {
         errno = EINVAL;
@@ -35,6 +35,13 @@
 #endif
 #endif 
 
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#endif
+
 #define SRV_EACCEPT   1
 #define SRV_ESOCKET   2
 #define SRV_ENOBLOCK  4
@@ -42,17 +49,105 @@
 #define SRV_EEVADD    16
 #define SRV_ECLOSE    32
 #define SRV_ESHUT     64
+#define SRV_EOVERFLOW 128 /* More unconsumed input than maxreadbuf */
+#define SRV_EPROTO    256 /* Malformed input. See srv_hnd_request() */
 
 #define SRV_EVENTRD   1
 #define SRV_EVENTWR   2
+#define SRV_EVENTET   4 /* Edge-triggered. See srv_notify_event() */
+
+/* Kinds of message framing. See srv_set_framing() */
+#define SRV_FRAME_NONE   0
+#define SRV_FRAME_LENGTH 1 /* Length prefix */
+#define SRV_FRAME_DELIM  2 /* Delimiter */
 
 typedef struct _srv      srv_t;
 typedef struct _srv_conn srv_conn;
+typedef struct _srv_loop srv_loop;
+typedef struct _srv_timer srv_timer;
+typedef struct _srv_upstream srv_upstream;
+typedef struct _srv_file srv_file;
+
+/* Reference to a connection that can be kept across its lifetime. Once the
+   connection is closed the handle goes stale and no longer resolves, even
+   if its fd is reused. See srv_conn_handle() */
+typedef unsigned long long srv_handle_t;
+#define SRV_HANDLE_NONE 0
+
+/* See srv_get_busy_poll_stats() */
+typedef struct {
+    unsigned long long spin_usec; /* Time spent spinning */
+    unsigned long long hits;      /* Spins that found events */
+    unsigned long long misses;    /* Spins that ran out and went on to block */
+} srv_busy_poll_stats;
+
+/* How input is split into messages for hnd_message. Set up with
+   srv_framing_length() or srv_framing_delim() */
+typedef struct {
+    int type;
+    int prefix;     /* Bytes of the length prefix */
+    int big_endian; /* Byte order of the length prefix */
+    char delim[8];
+    int delimlen;
+    int max;        /* Largest payload accepted, 0 for ctx->maxreadbuf */
+} srv_framing;
+
+/* A request parsed by the HTTP/1.1 module. Every pointer refers to the
+   input buffer and is only valid until hnd_request returns. Nothing is
+   NUL terminated. See srv_hnd_request() */
+#define SRV_HTTP_MAX_HEADERS 64
+
+typedef struct {
+    const char *name, *value;
+    int name_len, value_len;
+} srv_http_header;
+
+typedef struct {
+    const char *method, *path;
+    int method_len, path_len;
+    int minor_version;         /* x in HTTP/1.x */
+    int keep_alive;            /* From the version and Connection */
+    int chunked;               /* The body came chunked, it is decoded */
+    long long content_length;  /* -1 if absent */
+
+    srv_http_header headers[SRV_HTTP_MAX_HEADERS];
+    int nheaders;
+
+    const char *body;
+    int body_len;
+} srv_http_request;
+
+/* See srv_get_buffer_stats() */
+typedef struct {
+    unsigned long long size;       /* Buffers held by the pools */
+    unsigned long long in_use;     /* Buffers lent to connections */
+    unsigned long long high_water; /* Most buffers in use at once */
+    unsigned long long failures;   /* Requests an exhausted pool refused */
+} srv_buffer_stats;
+
+/* Bytes moved by srv_proxy(), and why it ended: 0 when both sides shut
+   down cleanly, an errno value otherwise */
+typedef struct {
+    unsigned long long a_to_b, b_to_a;
+    int error;
+} srv_proxy_stats;
+
+/* Counters of the name resolution cache. See srv_get_resolve_stats() */
+typedef struct {
+    unsigned long long hits;      /* Answered from the cache */
+    unsigned long long misses;    /* Needed a lookup */
+    unsigned long long coalesced; /* Joined a lookup already in flight */
+    unsigned long long failures;  /* Lookups that failed */
+    unsigned long long entries;   /* Names cached right now */
+} srv_resolve_stats;
 
 struct _srv {
     char *host, *port;
+    const char *unix_path; /* Listen here instead. See srv_set_unix() */
     int fdlistener, maxevents, backlog;
-    int szreadbuf, szwritebuf;
+    int szreadbuf;  /* Initial size of the buffer hnd_data reads into */
+    int maxreadbuf; /* Most unconsumed input a connection may hold */
+    int szwritebuf; /* Smallest segment srv_send() copies into */
     unsigned int newfd_event_flags;
 
     void (*hnd_read)(srv_conn *);
@@ -61,20 +156,125 @@ struct _srv {
     void (*hnd_hup)(srv_conn *);
     void (*hnd_rdhup)(srv_conn *);
     void (*hnd_error)(srv_conn *, int);
+    void (*hnd_timeout)(srv_conn *);
+    void (*hnd_data)(srv_conn *, char *, int);
+    void (*hnd_message)(srv_conn *, char *, int);
+    void (*hnd_request)(srv_conn *, srv_http_request *);
+    void (*hnd_datagram)(srv_t *, char *, int, struct sockaddr *, socklen_t);
+    srv_framing framing;
+    int datagram; /* Serve UDP instead of TCP. See srv_set_datagram() */
+
+    /* Event loops started by srv_run() or srv_run_threads() */
+    srv_loop *loops;
+    int nloops;
+
+    /* Worker pool for srv_conn_offload(). See srv_set_workers() */
+    struct _srv_pool *pool;
+    int nworkers;
+
+    /* Busy-poll budget in microseconds. See srv_set_busy_poll() */
+    unsigned int busy_poll;
+
+    /* Open files kept per loop, and how often in ms they are checked for
+       changes. See srv_set_file_cache() */
+    int file_cache_max;
+    unsigned int file_cache_ttl;
+
+    /* Smallest buffer srv_send_zerocopy() doesn't copy. See
+       srv_set_zerocopy() */
+    int zerocopy_min;
+
+    /* Per-loop I/O buffer pool. See srv_set_buffer_pool() */
+    int szpoolbuf, npoolbufs;
 
-    /* Pointer to the event_t structure declared in srv_run() */
-    void *ev;
+    /* Give up on outbound connects after this many ms, 0 for never. See
+       srv_set_connect_timeout() */
+    unsigned int connect_timeout;
+
+    /* Backpressure. Watermarks given to new connections, SIZE_MAX when off,
+       and the ceiling on output queued in memory by all loops together, 0
+       for none. See srv_set_watermarks() and srv_set_memory_limit() */
+    size_t wm_high, wm_low;
+    size_t out_limit;
+    size_t out_total; /* Updated atomically while out_limit is set */
 };
 
 struct _srv_conn {
-    srv_t *ctx;
+    /* Hot part, touched on every event. Fits in one 64 byte cache line on
+       LP64 targets */
     int fd;
-    char *host;
-    int port;
+
+    /* Internal state. Events registered for the fd and CONN_* flags */
+    unsigned int events, flags;
+
+    /* Generation of the fd's slot in the connection table. See
+       srv_handle_t */
+    unsigned int gen;
+
+    srv_t *ctx;
+    srv_loop *loop; /* The loop that owns the connection */
 
     /* To be used internally for higher-level IO functions */
     void (*hnd_read)(srv_conn *);
     void (*hnd_write)(srv_conn *);
+
+    /* Internal list linkage */
+    srv_conn *next;
+
+    unsigned long long last_active;
+
+    /* Cold part */
+
+    /* Peer address. host is NULL until srv_conn_peer_str() formats it */
+    char *host;
+    int port;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char hostbuf[46]; /* INET6_ADDRSTRLEN */
+
+    /* Idle timeout. See srv_conn_set_idle_timeout() */
+    srv_timer *idle_timer;
+    unsigned int idle_timeout;
+
+    /* Input buffer for hnd_data. See srv_consume() */
+    char *in_buf;
+    int in_start, in_end, in_size;
+    int in_scan; /* Bytes after in_start searched for a delimiter already */
+    const srv_framing *framing; /* NULL for ctx->framing */
+
+    /* Progress of the HTTP request being received, as offsets from
+       in_start. See srv_hnd_request() */
+    struct {
+        int head;            /* Length of the head, 0 until it is complete */
+        int chunk, body;     /* Next chunk line, end of the decoded body */
+        int trailer;         /* Past the last chunk */
+        long long clen;
+    } http;
+
+    /* Output queue. See srv_send() */
+    struct _out_seg *out_head, *out_tail;
+    size_t out_bytes;
+    size_t out_mem; /* Part of out_bytes held in memory */
+    srv_conn *flush_next; /* Link in the loop's list of queues to flush */
+    struct _zc_state *zc; /* See srv_send_zerocopy() */
+
+    /* Outbound connections. See srv_connect_async() and
+       srv_upstream_get() */
+    void (*connect_cb)(srv_conn *, int, void *);
+    void *connect_arg;
+    srv_timer *connect_timer;
+    struct _upstream_loop *upstream; /* Pool the connection belongs to */
+    srv_conn *idle_next;             /* Link in the pool's idle list */
+
+    struct _proxy_state *proxy; /* See srv_proxy() */
+
+    /* Backpressure. See srv_conn_set_watermarks() and srv_conn_link() */
+    size_t wm_high, wm_low;
+    srv_handle_t wm_peer; /* Reads from it are held too above wm_high */
+    srv_handle_t wm_held; /* The peer a hold was actually taken on */
+    unsigned int holds;   /* Reasons reads are held for. See conn_hold_read() */
+
+    void *data; /* Free for the application, NULL on new connections */
 };
 
 #ifdef __cplusplus
@@ -84,18 +284,71 @@ extern "C" {
 libserv_EXPORT int srv_init(srv_t *);
 
 libserv_EXPORT int srv_run(srv_t *);
+libserv_EXPORT int srv_run_threads(srv_t *, int);
 libserv_EXPORT int srv_read(srv_conn *, char *, int);
 libserv_EXPORT int srv_write(srv_conn *, char *, int);
 libserv_EXPORT int srv_readall(srv_conn *, char *, int);
 libserv_EXPORT int srv_writeall(srv_conn *, char *, int);
+libserv_EXPORT int srv_consume(srv_conn *, int);
+libserv_EXPORT int srv_send(srv_conn *, const char *, int);
+libserv_EXPORT int srv_send_ref(srv_conn *, const char *, int, void (*)(void *), void *);
+libserv_EXPORT size_t srv_send_pending(srv_conn *);
+libserv_EXPORT int srv_set_watermarks(srv_t *, size_t, size_t);
+libserv_EXPORT int srv_conn_set_watermarks(srv_conn *, size_t, size_t);
+libserv_EXPORT int srv_conn_link(srv_conn *, srv_conn *);
+libserv_EXPORT int srv_set_memory_limit(srv_t *, size_t);
+libserv_EXPORT size_t srv_get_memory_queued(srv_t *);
+libserv_EXPORT int srv_send_zerocopy(srv_conn *, const char *, int, void (*)(void *), void *);
+libserv_EXPORT int srv_set_zerocopy(srv_t *, int);
+libserv_EXPORT int srv_sendfile(srv_conn *, int, long long, long long);
+libserv_EXPORT int srv_splice(srv_conn *, int, long long);
+libserv_EXPORT int srv_proxy(srv_conn *, srv_conn *, void (*)(const srv_proxy_stats *, void *), void *);
+libserv_EXPORT int srv_proxy_get_stats(srv_conn *, srv_proxy_stats *);
+
+libserv_EXPORT srv_file *srv_file_open(srv_t *, const char *);
+libserv_EXPORT void srv_file_close(srv_file *);
+libserv_EXPORT long long srv_file_size(srv_file *);
+libserv_EXPORT long long srv_file_mtime(srv_file *);
+libserv_EXPORT int srv_file_send(srv_conn *, srv_file *, long long, long long);
+libserv_EXPORT int srv_set_file_cache(srv_t *, int, unsigned int);
+
+libserv_EXPORT int srv_set_datagram(srv_t *, int);
+libserv_EXPORT int srv_sendto(srv_t *, const char *, int, const struct sockaddr *, socklen_t);
 
 libserv_EXPORT int srv_connect(char *, char *);
+libserv_EXPORT int srv_unix_connect(const char *);
+libserv_EXPORT int srv_connect_async(srv_t *, const char *, const char *,
+                                     void (*)(srv_conn *, int, void *), void *);
+libserv_EXPORT int srv_set_connect_timeout(srv_t *, unsigned int);
+
+libserv_EXPORT int srv_resolve(srv_t *, const char *, const char *,
+                               void (*)(const struct sockaddr *, socklen_t, int, void *), void *);
+libserv_EXPORT int srv_set_resolve_cache(unsigned int, int);
+libserv_EXPORT int srv_get_resolve_stats(srv_resolve_stats *);
+
+libserv_EXPORT srv_upstream *srv_upstream_create(srv_t *, const char *, const char *, int, int);
+libserv_EXPORT void srv_upstream_free(srv_upstream *);
+libserv_EXPORT int srv_upstream_get(srv_upstream *, void (*)(srv_conn *, int, void *), void *);
+libserv_EXPORT int srv_upstream_put(srv_conn *);
 libserv_EXPORT int srv_close(srv_conn *);
 
 libserv_EXPORT void srv_set_host(srv_t *, char *);
 libserv_EXPORT void srv_set_port(srv_t *, char *);
+libserv_EXPORT int srv_set_unix(srv_t *, const char *);
 libserv_EXPORT int srv_set_backlog(srv_t *, int);
 libserv_EXPORT int srv_set_maxevents(srv_t *, int);
+libserv_EXPORT int srv_set_readbuf(srv_t *, int, int);
+libserv_EXPORT int srv_set_busy_poll(srv_t *, unsigned int);
+libserv_EXPORT int srv_get_busy_poll_stats(srv_t *, srv_busy_poll_stats *);
+libserv_EXPORT int srv_set_buffer_pool(srv_t *, int, int);
+libserv_EXPORT int srv_get_buffer_stats(srv_t *, srv_buffer_stats *);
+
+libserv_EXPORT int srv_post(srv_t *, void (*)(void *), void *);
+libserv_EXPORT int srv_conn_post(srv_conn *, void (*)(srv_conn *, void *), void *);
+
+libserv_EXPORT int srv_set_workers(srv_t *, int);
+libserv_EXPORT int srv_conn_offload(srv_conn *, void (*)(void *),
+                                    void (*)(srv_conn *, void *), void *);
 
 libserv_EXPORT int srv_notify_event(srv_conn *, unsigned int);
 libserv_EXPORT int srv_newfd_notify_event(srv_t *, unsigned int);
@@ -106,6 +359,33 @@ libserv_EXPORT int srv_hnd_accept(srv_t *, void (*)(srv_conn *));
 libserv_EXPORT int srv_hnd_hup(srv_t *, void (*)(srv_conn *));
 libserv_EXPORT int srv_hnd_rdhup(srv_t *, void (*)(srv_conn *));
 libserv_EXPORT int srv_hnd_error(srv_t *, void (*)(srv_conn *, int));
+libserv_EXPORT int srv_hnd_timeout(srv_t *, void (*)(srv_conn *));
+libserv_EXPORT int srv_hnd_data(srv_t *, void (*)(srv_conn *, char *, int));
+libserv_EXPORT int srv_hnd_message(srv_t *, void (*)(srv_conn *, char *, int));
+libserv_EXPORT int srv_hnd_request(srv_t *, void (*)(srv_conn *, srv_http_request *));
+libserv_EXPORT int srv_hnd_datagram(srv_t *, void (*)(srv_t *, char *, int, struct sockaddr *, socklen_t));
+
+libserv_EXPORT int srv_framing_length(srv_framing *, int, int, int);
+libserv_EXPORT int srv_framing_delim(srv_framing *, const char *, int, int);
+libserv_EXPORT int srv_set_framing(srv_t *, const srv_framing *);
+libserv_EXPORT int srv_conn_set_framing(srv_conn *, const srv_framing *);
+libserv_EXPORT int srv_find_delim(const char *, int, const char *, int);
+
+libserv_EXPORT int srv_http_parse(const char *, int, srv_http_request *);
+libserv_EXPORT const char *srv_http_header_get(srv_http_request *, const char *, int *);
+
+libserv_EXPORT srv_timer *srv_timer_add(srv_t *, unsigned int, unsigned int,
+                                        void (*)(srv_timer *, void *), void *);
+libserv_EXPORT int srv_timer_rearm(srv_timer *, unsigned int);
+libserv_EXPORT int srv_timer_cancel(srv_timer *);
+libserv_EXPORT int srv_conn_set_idle_timeout(srv_conn *, unsigned int);
+
+libserv_EXPORT const char *srv_conn_peer_str(srv_conn *);
+
+libserv_EXPORT srv_handle_t srv_conn_handle(srv_conn *);
+libserv_EXPORT srv_conn *srv_handle_resolve(srv_t *, srv_handle_t);
+libserv_EXPORT int srv_handle_post(srv_t *, srv_handle_t,
+                                   void (*)(srv_conn *, void *), void *);
 
 libserv_EXPORT int srv_get_listenerfd(srv_t *);
 
@@ -0,0 +1,196 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_loop.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+/* Counters read by other threads. Only the loop itself writes them */
+static inline void buf_stat_set(unsigned long long *stat, unsigned long long n) {
+    __atomic_store_n(stat, n, __ATOMIC_RELAXED);
+}
+
+void buf_pool_init(buf_pool_t *p, size_t size, int max) {
+    /* Room for the free list link, and pointer alignment */
+    if(size < sizeof(void *))
+        size = sizeof(void *);
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    p->free = NULL;
+    p->size = size;
+    p->max = max;
+    p->arenas = NULL;
+    p->narenas = 0;
+    memset(&p->stats, 0, sizeof(p->stats));
+}
+
+static size_t buf_arena_size(buf_pool_t *p) {
+    return p->size > BUF_ARENA ? (p->size + BUF_ARENA - 1) & ~((size_t) BUF_ARENA - 1)
+                               : BUF_ARENA;
+}
+
+void buf_pool_free(buf_pool_t *p) {
+    int i;
+
+    for(i = 0; i < p->narenas; i++) {
+#ifndef _WIN32
+        munmap(p->arenas[i], buf_arena_size(p));
+#else
+        _aligned_free(p->arenas[i]);
+#endif
+    }
+
+    free(p->arenas);
+    p->arenas = NULL;
+    p->narenas = 0;
+    p->free = NULL;
+}
+
+/* Map an arena aligned to BUF_ARENA. Returns NULL on failure */
+static char *buf_arena_map(size_t size) {
+    char *mem;
+#ifndef _WIN32
+    char *aligned;
+    size_t head;
+
+    /* Over-map, then trim to an aligned range */
+    mem = mmap(NULL, size + BUF_ARENA, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+        return NULL;
+
+    aligned = (char *) (((uintptr_t) mem + BUF_ARENA - 1) & ~((uintptr_t) BUF_ARENA - 1));
+    head = aligned - mem;
+    if(head)
+        munmap(mem, head);
+    munmap(aligned + size, BUF_ARENA - head);
+    mem = aligned;
+
+#ifdef MADV_HUGEPAGE
+    madvise(mem, size, MADV_HUGEPAGE);
+#endif
+#else
+    mem = _aligned_malloc(size, BUF_ARENA);
+#endif
+
+    return mem;
+}
+
+/* Add an arena's worth of buffers, up to the pool's limit */
+static int buf_grow(buf_pool_t *p) {
+    size_t size;
+    void **arenas;
+    char *mem;
+    long long n, i;
+
+    size = buf_arena_size(p);
+    n = size / p->size;
+    if(p->max && n > p->max - (long long) p->stats.size)
+        n = p->max - (long long) p->stats.size;
+    if(n <= 0)
+        return -1;
+
+    arenas = realloc(p->arenas, (p->narenas + 1) * sizeof(void *));
+    if(arenas == NULL)
+        return -1;
+    p->arenas = arenas;
+
+    if((mem = buf_arena_map(size)) == NULL)
+        return -1;
+    p->arenas[p->narenas++] = mem;
+
+    /* Chain the new buffers in address order */
+    for(i = n - 1; i >= 0; i--) {
+        *(void **) (mem + i * p->size) = p->free;
+        p->free = mem + i * p->size;
+    }
+
+    buf_stat_set(&p->stats.size, p->stats.size + n);
+    return 0;
+}
+
+/* Borrow a buffer of p->size bytes. Returns NULL, and counts a failure,
+   when the pool is exhausted */
+void *buf_get(buf_pool_t *p) {
+    void *buf;
+
+    if(p->free == NULL && buf_grow(p) == -1) {
+        buf_stat_set(&p->stats.failures, p->stats.failures + 1);
+        return NULL;
+    }
+
+    buf = p->free;
+    p->free = *(void **) buf;
+
+    buf_stat_set(&p->stats.in_use, p->stats.in_use + 1);
+    if(p->stats.in_use > p->stats.high_water)
+        buf_stat_set(&p->stats.high_water, p->stats.in_use);
+    return buf;
+}
+
+void buf_put(buf_pool_t *p, void *buf) {
+    *(void **) buf = p->free;
+    p->free = buf;
+    buf_stat_set(&p->stats.in_use, p->stats.in_use - 1);
+}
+
+/* Size of the buffers in each loop's pool, and how many buffers a pool may
+   hold at most, 0 for no limit. Input and copied output are staged in
+   these buffers whenever they fit, and in the heap otherwise or once the
+   pool is exhausted */
+int srv_set_buffer_pool(srv_t *ctx, int size, int count) {
+    if(!ctx || size < 256 || count < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->szpoolbuf = size;
+    ctx->npoolbufs = count;
+    return 0;
+}
+
+/* Buffer pool occupancy, summed over the loops */
+int srv_get_buffer_stats(srv_t *ctx, srv_buffer_stats *stats) {
+    srv_loop *loops;
+    int i, nloops;
+
+    if(!ctx || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(srv_buffer_stats));
+
+    loops = __atomic_load_n(&ctx->loops, __ATOMIC_ACQUIRE);
+    nloops = ctx->nloops;
+    for(i = 0; loops && i < nloops; i++) {
+        stats->size += __atomic_load_n(&loops[i].bufs.stats.size, __ATOMIC_RELAXED);
+        stats->in_use += __atomic_load_n(&loops[i].bufs.stats.in_use, __ATOMIC_RELAXED);
+        stats->high_water += __atomic_load_n(&loops[i].bufs.stats.high_water, __ATOMIC_RELAXED);
+        stats->failures += __atomic_load_n(&loops[i].bufs.stats.failures, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
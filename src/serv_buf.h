@@ -0,0 +1,48 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SERV_BUF_H
+#define _SERV_BUF_H
+
+/* Buffers are carved out of arenas of this size, aligned to it so that the
+   kernel can back them with transparent huge pages */
+#define BUF_ARENA (2 << 20)
+
+/* Loop-wide pool of fixed-size I/O buffers. Connections borrow one while
+   they have input or output in flight and give it back once it drains, so
+   idle connections hold no buffer memory. Free buffers are linked through
+   their first word */
+typedef struct {
+    void *free;
+    size_t size;  /* Of one buffer */
+    int max;      /* Most buffers the pool may hold, 0 for no limit */
+    void **arenas;
+    int narenas;
+    srv_buffer_stats stats;
+} buf_pool_t;
+
+void buf_pool_init(buf_pool_t *p, size_t size, int max);
+void buf_pool_free(buf_pool_t *p);
+void *buf_get(buf_pool_t *p);
+void buf_put(buf_pool_t *p, void *buf);
+
+#endif
@@ -26,29 +26,32 @@ SOFTWARE.
 #ifdef EPOLL
 int event_init(event_t *ev, int max_events) {
     ev->epfd = epoll_create1(0);
-    ev->nfds = 0;
-    ev->fd_index = 0;
+    if(ev->epfd == -1)
+        return -1;
+
     ev->max_events = max_events;
 
     ev->events = calloc(max_events, sizeof(struct epoll_event));
-    if(ev->events == NULL)
+    if(ev->events == NULL) {
+        close(ev->epfd);
         return -1;
+    }
 
     return ev->epfd;
 }
 
-int event_add_fd(event_t *ev, int fd, uint32_t flags) {
+int event_add_fd(event_t *ev, int fd, uint32_t flags, void *data) {
         struct epoll_event tmp_event;
 
-        tmp_event.data.fd = fd;
+        tmp_event.data.ptr = data;
         tmp_event.events = flags;
 
         return epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &tmp_event);
 }
 
-int event_mod_fd(event_t *ev, int fd, uint32_t flags) {
+int event_mod_fd(event_t *ev, int fd, uint32_t flags, void *data) {
     struct epoll_event tmp_event;
-    tmp_event.data.fd = fd;
+    tmp_event.data.ptr = data;
     tmp_event.events = flags;
 
     return epoll_ctl(ev->epfd, EPOLL_CTL_MOD, fd, &tmp_event);
@@ -60,35 +63,11 @@ int event_remove_fd(event_t *ev, int fd) {
     return epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, &tmp_event);
 }
 
-int event_wait(event_t *ev, int *event_fd, int *event_type) {
-    if(ev->nfds == 0) {
-        /* All events processed so far. Wait for new events */
-        ev->fd_index = 0;
-        ev->nfds = epoll_wait(ev->epfd, ev->events, ev->max_events, -1);
-    }
-
-    /* Preserve the errno and notify the caller that an error has occured */
-    if(ev->nfds <= 0) {
-        /* Error occured or there are no events waiting to be handled */
-        *event_type = 0;
-        return ev->nfds; /* Return value is -1 on error */
-    }
-
-    /* Pass the next event to the caller */
-    *event_type = ev->events[ev->fd_index].events;
-    *event_fd = ev->events[ev->fd_index].data.fd;
-
-    /* Point to the next event to be handled */
-    if(ev->fd_index < ev->nfds)
-        ev->fd_index++;
-    else {
-        ev->nfds = 0;
-        *event_type = 0;
-        return 0; /* All events have been handled */
-    }
-
-    /* Return the number of events waiting to be handled */
-    return (ev->nfds - ev->fd_index);
+int event_wait(event_t *ev, int timeout) {
+    /* The ready events are left in ev->events for the caller to walk with
+       EVENT_DATA() and EVENT_TYPE(). Waits for at most 'timeout' ms, forever
+       if it is -1. Returns -1 on error */
+    return epoll_wait(ev->epfd, ev->events, ev->max_events, timeout);
 }
 
 int event_free(event_t *ev) {
@@ -96,5 +75,7 @@ int event_free(event_t *ev) {
 
     if(close(ev->epfd) == -1)
         return -1;
+
+    return 0;
 }
 #endif
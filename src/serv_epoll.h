@@ -29,17 +29,29 @@
 #define EVENTHUP   EPOLLHUP
 #define EVENTRDHUP EPOLLRDHUP
 #define EVENTERR   EPOLLERR
+#define EVENTET    EPOLLET
+#ifdef EPOLLEXCLUSIVE
+#define EVENTEXCL  EPOLLEXCLUSIVE /* Wake one waiter of an fd shared between
+                                     loops. Can't be combined with
+                                     event_mod_fd() */
+#else
+#define EVENTEXCL  0
+#endif
 
 typedef struct {
     struct epoll_event *events;
-    int epfd, nfds, fd_index, max_events;
+    int epfd, max_events;
 } event_t;
 
+/* Accessors for the i-th entry of the batch returned by event_wait() */
+#define EVENT_DATA(ev, i) ((ev)->events[(i)].data.ptr)
+#define EVENT_TYPE(ev, i) ((ev)->events[(i)].events)
+
 int event_init(event_t *ev, int max_events);
-int event_add_fd(event_t *ev, int fd, uint32_t flags);
-int event_mod_fd(event_t *ev, int fd, uint32_t flags);
+int event_add_fd(event_t *ev, int fd, uint32_t flags, void *data);
+int event_mod_fd(event_t *ev, int fd, uint32_t flags, void *data);
 int event_remove_fd(event_t *ev, int fd);
-int event_wait(event_t *ev, int *event_fd, int *event_type);
+int event_wait(event_t *ev, int timeout);
 int event_free(event_t *ev);
 
 #endif
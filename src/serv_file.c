@@ -0,0 +1,253 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_loop.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Per-loop cache of open files. Hot files are served without an open()
+   and fstat() per request; their metadata is checked again with a stat()
+   at most once every ctx->file_cache_ttl ms. Entries are dropped least
+   recently used first, but an entry's fd stays open for as long as a
+   pending send still references it */
+
+int file_cache_init(file_cache_t *c) {
+    c->buckets = NULL;
+    c->nbuckets = 0;
+    c->lru.prev = c->lru.next = &c->lru;
+    c->count = 0;
+    return 0;
+}
+
+void file_unref(srv_file *f) {
+    if(--f->refs > 0)
+        return;
+
+    close(f->fd);
+    free(f->path);
+    free(f);
+}
+
+static unsigned int file_hash(const char *path) {
+    unsigned int h = 2166136261U; /* FNV-1a */
+
+    while(*path)
+        h = (h ^ (unsigned char) *path++) * 16777619U;
+    return h;
+}
+
+static void file_uncache(file_cache_t *c, srv_file *f) {
+    srv_file **p;
+
+    p = &c->buckets[file_hash(f->path) & (c->nbuckets - 1)];
+    while(*p != f)
+        p = &(*p)->hnext;
+    *p = f->hnext;
+
+    f->prev->next = f->next;
+    f->next->prev = f->prev;
+    f->cached = 0;
+    c->count--;
+
+    file_unref(f);
+}
+
+void file_cache_free(file_cache_t *c) {
+    while(c->lru.next != &c->lru)
+        file_uncache(c, c->lru.next);
+
+    free(c->buckets);
+    c->buckets = NULL;
+    c->nbuckets = 0;
+}
+
+static void file_link(file_cache_t *c, srv_file *f) {
+    f->next = c->lru.next;
+    f->prev = &c->lru;
+    c->lru.next->prev = f;
+    c->lru.next = f;
+}
+
+static void file_touch(file_cache_t *c, srv_file *f) {
+    f->prev->next = f->next;
+    f->next->prev = f->prev;
+    file_link(c, f);
+}
+
+static void file_stat(srv_file *f, struct stat *st) {
+    f->size = st->st_size;
+    f->mtime = st->st_mtime;
+    f->ino = st->st_ino;
+}
+
+/* Open path for sending, through the cache of the calling loop. Must be
+   called from a loop thread of ctx. The file is released with
+   srv_file_close() */
+srv_file *srv_file_open(srv_t *ctx, const char *path) {
+    srv_loop *loop = loop_current;
+    file_cache_t *c;
+    srv_file *f, **bucket;
+    struct stat st;
+    int fd, i, max;
+
+    if(!ctx || !path || !loop || loop->ctx != ctx) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    c = &loop->files;
+    max = ctx->file_cache_max;
+
+    if(max > 0 && c->buckets == NULL) {
+        /* Twice as many buckets as entries, a power of two */
+        for(i = 1; i < max * 2; i <<= 1)
+            ;
+        c->buckets = calloc(i, sizeof(srv_file *));
+        if(c->buckets == NULL)
+            return NULL;
+        c->nbuckets = i;
+    }
+
+    if(c->buckets) {
+        for(f = c->buckets[file_hash(path) & (c->nbuckets - 1)]; f; f = f->hnext) {
+            if(strcmp(f->path, path) != 0)
+                continue;
+
+            if(loop->now - f->checked >= ctx->file_cache_ttl) {
+                /* Replaced, modified or removed since? */
+                if(stat(path, &st) == -1 || (unsigned long long) st.st_ino != f->ino ||
+                        st.st_size != f->size || st.st_mtime != f->mtime) {
+                    file_uncache(c, f);
+                    break;
+                }
+                f->checked = loop->now;
+            }
+
+            file_touch(c, f);
+            f->refs++;
+            return f;
+        }
+    }
+
+    errno = 0;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        return NULL;
+
+    if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        i = errno;
+        close(fd);
+        errno = i == 0 ? EINVAL : i;
+        return NULL;
+    }
+
+    f = malloc(sizeof(srv_file));
+    if(f == NULL || (f->path = strdup(path)) == NULL) {
+        free(f);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    f->fd = fd;
+    f->refs = 1;
+    f->cached = 0;
+    f->checked = loop->now;
+    file_stat(f, &st);
+
+    if(max > 0) {
+        if(c->count >= max)
+            file_uncache(c, c->lru.prev);
+
+        bucket = &c->buckets[file_hash(path) & (c->nbuckets - 1)];
+        f->hnext = *bucket;
+        *bucket = f;
+
+        file_link(c, f);
+
+        f->cached = 1;
+        f->refs++;
+        c->count++;
+    }
+
+    return f;
+}
+
+void srv_file_close(srv_file *f) {
+    if(f)
+        file_unref(f);
+}
+
+long long srv_file_size(srv_file *f) {
+    return f->size;
+}
+
+long long srv_file_mtime(srv_file *f) {
+    return f->mtime;
+}
+#else
+/* TODO: TransmitFile() */
+int file_cache_init(file_cache_t *c) {
+    c->buckets = NULL;
+    c->nbuckets = 0;
+    c->count = 0;
+    return 0;
+}
+
+void file_cache_free(file_cache_t *c) {
+}
+
+void file_unref(srv_file *f) {
+}
+
+srv_file *srv_file_open(srv_t *ctx, const char *path) {
+    errno = ENOSYS;
+    return NULL;
+}
+
+void srv_file_close(srv_file *f) {
+}
+
+long long srv_file_size(srv_file *f) {
+    return 0;
+}
+
+long long srv_file_mtime(srv_file *f) {
+    return 0;
+}
+#endif
+
+/* Number of open files each loop keeps cached, and how often in ms a
+   cached file is checked for changes. 0 entries disables the cache */
+int srv_set_file_cache(srv_t *ctx, int entries, unsigned int ttl) {
+    if(!ctx || entries < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->file_cache_max = entries;
+    ctx->file_cache_ttl = ttl;
+    return 0;
+}
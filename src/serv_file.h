@@ -0,0 +1,50 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SERV_FILE_H
+#define _SERV_FILE_H
+
+/* An open file shared through the loop's cache. See srv_file_open() */
+struct _srv_file {
+    struct _srv_file *hnext;       /* Hash chain */
+    struct _srv_file *prev, *next; /* LRU list, most recently used first */
+    char *path;
+    int fd;
+    long long size, mtime;
+    unsigned long long ino;
+    uint64_t checked; /* loop->now when the metadata was last checked */
+    int refs;         /* One for the cache, one per user */
+    int cached;
+};
+
+typedef struct {
+    struct _srv_file **buckets;
+    int nbuckets;
+    struct _srv_file lru; /* Sentinel */
+    int count;
+} file_cache_t;
+
+int file_cache_init(file_cache_t *c);
+void file_cache_free(file_cache_t *c);
+void file_unref(struct _srv_file *f);
+
+#endif
@@ -0,0 +1,306 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_loop.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define FRAME_SSE2
+#include <immintrin.h>
+#endif
+
+/* Message framing. Splits the input of hnd_data style connections into
+   frames, either behind a fixed-size length prefix or ended by a delimiter,
+   and passes each complete frame to hnd_message. Delimiters are searched
+   16 or 32 bytes at a time by comparing the first and the last byte of the
+   delimiter at once, and only candidates matching both are compared in
+   full */
+
+static const char *frame_scan_scalar(const char *p, size_t len, const char *d, size_t dlen) {
+    size_t i;
+
+    for(i = 0; i + dlen <= len; i++) {
+        if(p[i] == d[0] && memcmp(p + i + 1, d + 1, dlen - 1) == 0)
+            return p + i;
+    }
+
+    return NULL;
+}
+
+#ifdef FRAME_SSE2
+static const char *frame_scan_sse2(const char *p, size_t len, const char *d, size_t dlen) {
+    const __m128i first = _mm_set1_epi8(d[0]);
+    const __m128i last = _mm_set1_epi8(d[dlen - 1]);
+    __m128i a, b;
+    unsigned int mask;
+    size_t i;
+    int bit;
+
+    for(i = 0; i + dlen - 1 + 16 <= len; i += 16) {
+        a = _mm_loadu_si128((const __m128i *) (p + i));
+        b = _mm_loadu_si128((const __m128i *) (p + i + dlen - 1));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                               _mm_cmpeq_epi8(b, last)));
+        while(mask) {
+            bit = __builtin_ctz(mask);
+            if(dlen <= 2 || memcmp(p + i + bit + 1, d + 1, dlen - 2) == 0)
+                return p + i + bit;
+            mask &= mask - 1;
+        }
+    }
+
+    return frame_scan_scalar(p + i, len - i, d, dlen);
+}
+
+__attribute__((target("avx2")))
+static const char *frame_scan_avx2(const char *p, size_t len, const char *d, size_t dlen) {
+    const __m256i first = _mm256_set1_epi8(d[0]);
+    const __m256i last = _mm256_set1_epi8(d[dlen - 1]);
+    __m256i a, b;
+    unsigned int mask;
+    size_t i;
+    int bit;
+
+    for(i = 0; i + dlen - 1 + 32 <= len; i += 32) {
+        a = _mm256_loadu_si256((const __m256i *) (p + i));
+        b = _mm256_loadu_si256((const __m256i *) (p + i + dlen - 1));
+        mask = (unsigned int) _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                                    _mm256_cmpeq_epi8(b, last)));
+        while(mask) {
+            bit = __builtin_ctz(mask);
+            if(dlen <= 2 || memcmp(p + i + bit + 1, d + 1, dlen - 2) == 0)
+                return p + i + bit;
+            mask &= mask - 1;
+        }
+    }
+
+    return frame_scan_sse2(p + i, len - i, d, dlen);
+}
+#endif
+
+typedef const char *(*frame_scan_fn)(const char *, size_t, const char *, size_t);
+
+/* Best kernel for the CPU we run on. Picked on first use, every thread
+   would pick the same one */
+static frame_scan_fn frame_scan_pick(void) {
+    static frame_scan_fn fn;
+
+    if(fn == NULL) {
+#ifdef FRAME_SSE2
+        __builtin_cpu_init();
+        fn = __builtin_cpu_supports("avx2") ? frame_scan_avx2 : frame_scan_sse2;
+#else
+        fn = frame_scan_scalar;
+#endif
+    }
+
+    return fn;
+}
+
+/* Offset of the first occurrence of delim in buf, or -1 */
+int srv_find_delim(const char *buf, int len, const char *delim, int dlen) {
+    const char *p;
+
+    if(!buf || !delim || len < 0 || dlen < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(len < dlen)
+        return -1;
+
+    p = (*frame_scan_pick())(buf, len, delim, dlen);
+    return p ? (int) (p - buf) : -1;
+}
+
+static unsigned long long frame_prefix(const unsigned char *p, int n, int big_endian) {
+    unsigned long long v = 0;
+    int i;
+
+    if(big_endian) {
+        for(i = 0; i < n; i++)
+            v = (v << 8) | p[i];
+    }
+    else {
+        for(i = n - 1; i >= 0; i--)
+            v = (v << 8) | p[i];
+    }
+
+    return v;
+}
+
+/* Size of the frame at the start of buf, prefix or delimiter included.
+   Returns 0 if it is incomplete and -1 if it is larger than allowed. The
+   payload is at buf + *off, *len bytes long */
+static int frame_next(srv_conn *conn, const srv_framing *f, const char *buf, int avail,
+                      int *off, int *len) {
+    unsigned long long n;
+    int limit, pos;
+
+    limit = conn->ctx->maxreadbuf;
+    if(f->max && f->max < limit)
+        limit = f->max;
+
+    switch(f->type) {
+    case SRV_FRAME_LENGTH:
+        if(avail < f->prefix)
+            return 0;
+
+        n = frame_prefix((const unsigned char *) buf, f->prefix, f->big_endian);
+        if(n > (unsigned long long) limit)
+            return -1;
+
+        if((unsigned long long) avail < f->prefix + n)
+            return 0;
+
+        *off = f->prefix;
+        *len = (int) n;
+        return f->prefix + (int) n;
+
+    case SRV_FRAME_DELIM:
+        pos = srv_find_delim(buf + conn->in_scan, avail - conn->in_scan, f->delim, f->delimlen);
+        if(pos == -1) {
+            /* Don't search the same bytes again. A delimiter may straddle
+               the end of what has arrived so far */
+            conn->in_scan = avail - f->delimlen + 1 > 0 ? avail - f->delimlen + 1 : 0;
+            return conn->in_scan > limit ? -1 : 0;
+        }
+
+        pos += conn->in_scan;
+        conn->in_scan = 0;
+        if(pos > limit)
+            return -1;
+
+        *off = 0;
+        *len = pos;
+        return pos + f->delimlen;
+
+    default:
+        /* No framing. Whatever has arrived is a message */
+        *off = 0;
+        *len = avail;
+        return avail;
+    }
+}
+
+/* Pass every complete frame in the input buffer to hnd_message */
+void frame_deliver(srv_conn *conn) {
+    srv_t *ctx = conn->ctx;
+    const srv_framing *f;
+    char *buf;
+    int n, off, len;
+
+    f = conn->framing ? conn->framing : &ctx->framing;
+
+    while(conn->fd != -1 && conn->in_end > conn->in_start &&
+            !conn->holds) {
+        buf = conn->in_buf + conn->in_start;
+        n = frame_next(conn, f, buf, conn->in_end - conn->in_start, &off, &len);
+        if(n == 0)
+            break;
+
+        if(n == -1) {
+            if(ctx->hnd_error)
+                (*(ctx->hnd_error))(conn, SRV_EOVERFLOW);
+
+            if(conn->fd != -1)
+                srv_close(conn);
+            return;
+        }
+
+        /* Consumed up front. The frame stays in place until the handler
+           returns */
+        conn->in_start += n;
+        (*(ctx->hnd_message))(conn, buf + off, len);
+    }
+}
+
+/* Frames behind a length prefix of 'bytes' bytes, 1, 2, 4 or 8, that
+   counts the payload only. max limits the payload, 0 for no limit other
+   than ctx->maxreadbuf */
+int srv_framing_length(srv_framing *f, int bytes, int big_endian, int max) {
+    if(!f || (bytes != 1 && bytes != 2 && bytes != 4 && bytes != 8) || max < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(f, 0, sizeof(srv_framing));
+    f->type = SRV_FRAME_LENGTH;
+    f->prefix = bytes;
+    f->big_endian = big_endian;
+    f->max = max;
+    return 0;
+}
+
+/* Frames ended by the 'len' bytes of delim, e.g. "\n" or "\r\n". The
+   delimiter is not part of the payload */
+int srv_framing_delim(srv_framing *f, const char *delim, int len, int max) {
+    if(!f || !delim || len < 1 || len > (int) sizeof(f->delim) || max < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(f, 0, sizeof(srv_framing));
+    f->type = SRV_FRAME_DELIM;
+    memcpy(f->delim, delim, len);
+    f->delimlen = len;
+    f->max = max;
+    return 0;
+}
+
+/* Framing of every connection, unless set otherwise for the connection */
+int srv_set_framing(srv_t *ctx, const srv_framing *f) {
+    if(!ctx || !f) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->framing = *f;
+    return 0;
+}
+
+/* Framing of one connection. f must stay valid as long as the connection
+   uses it. NULL goes back to the framing of the srv_t */
+int srv_conn_set_framing(srv_conn *conn, const srv_framing *f) {
+    if(!conn) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    conn->framing = f;
+    conn->in_scan = 0;
+    return 0;
+}
+
+/* Have the library split the input into frames, as set by srv_set_framing(),
+   and call h once per complete frame with its payload. Takes precedence
+   over hnd_data and replaces hnd_read. hnd_request takes precedence over
+   it */
+int srv_hnd_message(srv_t *ctx, void (*h)(srv_conn *, char *, int)) {
+    if(!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->hnd_message = h;
+    return 0;
+}
@@ -0,0 +1,414 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_loop.h"
+
+/* HTTP/1.1 requests on top of the library-managed read path. The end of
+   the request head is searched for incrementally, as input arrives, with
+   the same SIMD scanner as delimiter framing. The head is then split into
+   the request line and headers in one pass without copying anything: the
+   request handed to hnd_request points into the input buffer. Bodies are
+   gathered in place, chunked ones are decoded by moving each chunk's data
+   over the chunk headers before it. Pipelined requests are handled one
+   after another, straight from the same buffer */
+
+/* conn->http.clen of a request with a chunked body */
+#define HTTP_CHUNKED -1
+
+/* tchar of RFC 7230 3.2.6, what method and header names are made of */
+static int http_is_token(const char *s, int len) {
+    unsigned char c;
+    int i;
+
+    for(i = 0; i < len; i++) {
+        c = (unsigned char) s[i];
+        if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                (c > 0x20 && c < 0x7f && strchr("!#$%&'*+-.^_`|~", c))))
+            return 0;
+    }
+
+    return len > 0;
+}
+
+static int http_ieq(const char *a, int alen, const char *b) {
+    int i;
+
+    for(i = 0; i < alen && b[i]; i++) {
+        if((a[i] | 0x20) != (b[i] | 0x20))
+            return 0;
+    }
+
+    return i == alen && b[i] == '\0';
+}
+
+/* Does the comma separated list contain the token? */
+static int http_has_token(const char *v, int len, const char *token) {
+    int start, end;
+
+    for(start = 0; start < len; start = end + 1) {
+        end = start;
+        while(end < len && v[end] != ',')
+            end++;
+
+        /* Trim the element */
+        while(start < end && (v[start] == ' ' || v[start] == '\t'))
+            start++;
+        while(end > start && (v[end - 1] == ' ' || v[end - 1] == '\t'))
+            end--;
+
+        if(http_ieq(v + start, end - start, token))
+            return 1;
+
+        while(end < len && v[end] != ',')
+            end++;
+    }
+
+    return 0;
+}
+
+/* Parse the request line and headers. buf holds the whole head, the final
+   empty line included. Returns 0 or -1 if it is malformed */
+static int http_parse_head(const char *buf, int len, srv_http_request *req) {
+    const char *line, *end, *name, *value;
+    srv_http_header *h;
+    long long clen;
+    int n, pos, te, vlen, i;
+
+    memset(req, 0, sizeof(srv_http_request));
+    req->content_length = -1;
+
+    /* Request line: method SP target SP HTTP/1.x */
+    n = srv_find_delim(buf, len, "\r\n", 2);
+    pos = srv_find_delim(buf, n, " ", 1);
+    if(pos <= 0 || !http_is_token(buf, pos))
+        return -1;
+    req->method = buf;
+    req->method_len = pos;
+
+    line = buf + pos + 1;
+    pos = srv_find_delim(line, (int) (buf + n - line), " ", 1);
+    if(pos <= 0)
+        return -1;
+    req->path = line;
+    req->path_len = pos;
+
+    line += pos + 1;
+    if(buf + n - line != 8 || memcmp(line, "HTTP/1.", 7) != 0 || line[7] < '0' || line[7] > '9')
+        return -1;
+    req->minor_version = line[7] - '0';
+    req->keep_alive = req->minor_version >= 1;
+
+    te = 0;
+    line = buf + n + 2;
+    end = buf + len - 2;
+    while(line < end) {
+        n = srv_find_delim(line, (int) (end + 2 - line), "\r\n", 2);
+
+        /* Also rejects obsolete line folding and whitespace before the
+           colon, RFC 7230 3.2.4 */
+        pos = srv_find_delim(line, n, ":", 1);
+        if(pos <= 0 || !http_is_token(line, pos))
+            return -1;
+
+        if(req->nheaders == SRV_HTTP_MAX_HEADERS)
+            return -1;
+
+        name = line;
+        value = line + pos + 1;
+        vlen = n - pos - 1;
+        while(vlen && (*value == ' ' || *value == '\t')) {
+            value++;
+            vlen--;
+        }
+        while(vlen && (value[vlen - 1] == ' ' || value[vlen - 1] == '\t'))
+            vlen--;
+
+        h = &req->headers[req->nheaders++];
+        h->name = name;
+        h->name_len = pos;
+        h->value = value;
+        h->value_len = vlen;
+
+        if(http_ieq(name, pos, "content-length")) {
+            if(vlen == 0 || vlen > 18)
+                return -1;
+
+            clen = 0;
+            for(i = 0; i < vlen; i++) {
+                if(value[i] < '0' || value[i] > '9')
+                    return -1;
+                clen = clen * 10 + (value[i] - '0');
+            }
+
+            /* Repeated, it has to say the same */
+            if(req->content_length != -1 && req->content_length != clen)
+                return -1;
+            req->content_length = clen;
+        }
+        else if(http_ieq(name, pos, "transfer-encoding")) {
+            /* Only a body that ends in chunked can be delimited */
+            te = 1;
+            req->chunked = vlen >= 7 && http_ieq(value + vlen - 7, 7, "chunked") &&
+                           (vlen == 7 || value[vlen - 8] == ',' || value[vlen - 8] == ' ');
+        }
+        else if(http_ieq(name, pos, "connection")) {
+            if(http_has_token(value, vlen, "close"))
+                req->keep_alive = 0;
+            else if(http_has_token(value, vlen, "keep-alive"))
+                req->keep_alive = 1;
+        }
+
+        line += n + 2;
+    }
+
+    /* Ambiguous framing invites request smuggling, RFC 7230 3.3.3 */
+    if(te && (!req->chunked || req->content_length != -1))
+        return -1;
+
+    return 0;
+}
+
+/* Parse the request at the start of buf. Returns the length of its head,
+   0 if the head is incomplete and -1 if it is malformed. The body, if
+   any, follows the head and is not looked at */
+int srv_http_parse(const char *buf, int len, srv_http_request *req) {
+    int pos;
+
+    if(!buf || !req || len < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pos = srv_find_delim(buf, len, "\r\n\r\n", 4);
+    if(pos == -1)
+        return len > HTTP_MAX_HEAD ? -1 : 0;
+
+    if(pos + 4 > HTTP_MAX_HEAD)
+        return -1;
+
+    if(http_parse_head(buf, pos + 4, req) == -1)
+        return -1;
+
+    return pos + 4;
+}
+
+/* Decode as much of a chunked body as has arrived, moving the data of each
+   chunk down to the end of the body decoded so far. Returns the length of
+   the whole request once the last chunk and the trailers are in, 0 if more
+   is needed and -1 if the body is malformed or too large */
+static int http_chunks(srv_conn *conn, char *buf, int avail) {
+    unsigned long long size;
+    int pos, i;
+
+    for(;;) {
+        pos = srv_find_delim(buf + conn->http.chunk, avail - conn->http.chunk, "\r\n", 2);
+        if(pos == -1)
+            return avail - conn->http.chunk > HTTP_MAX_CHUNK_LINE ? -1 : 0;
+
+        if(conn->http.trailer) {
+            /* Trailer fields are skipped. The empty line ends the request */
+            conn->http.chunk += pos + 2;
+            if(pos == 0)
+                return conn->http.chunk;
+            continue;
+        }
+
+        /* chunk-size [ ; extensions ] CRLF */
+        size = 0;
+        for(i = 0; i < pos; i++) {
+            char c = buf[conn->http.chunk + i];
+
+            if(c >= '0' && c <= '9')
+                size = size * 16 + (c - '0');
+            else if((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+                size = size * 16 + ((c | 0x20) - 'a' + 10);
+            else
+                break;
+
+            if(size > (unsigned long long) conn->ctx->maxreadbuf)
+                return -1;
+        }
+
+        if(i == 0 || (i < pos && buf[conn->http.chunk + i] != ';' &&
+                      buf[conn->http.chunk + i] != ' ' && buf[conn->http.chunk + i] != '\t'))
+            return -1;
+
+        if(size == 0) {
+            conn->http.trailer = 1;
+            conn->http.chunk += pos + 2;
+            continue;
+        }
+
+        if(conn->http.body - conn->http.head + (long long) size > conn->ctx->maxreadbuf)
+            return -1;
+
+        /* The data and its CRLF have to be in */
+        if(avail - conn->http.chunk - pos - 2 < (long long) size + 2)
+            return 0;
+
+        i = conn->http.chunk + pos + 2;
+        if(buf[i + size] != '\r' || buf[i + size + 1] != '\n')
+            return -1;
+
+        memmove(buf + conn->http.body, buf + i, (size_t) size);
+        conn->http.body += (int) size;
+        conn->http.chunk = i + (int) size + 2;
+    }
+}
+
+static void http_reset(srv_conn *conn) {
+    conn->http.head = 0;
+    conn->http.chunk = 0;
+    conn->http.body = 0;
+    conn->http.trailer = 0;
+    conn->http.clen = 0;
+}
+
+static void http_fail(srv_conn *conn, int err) {
+    srv_t *ctx = conn->ctx;
+
+    http_reset(conn);
+    if(ctx->hnd_error)
+        (*(ctx->hnd_error))(conn, err);
+
+    if(conn->fd != -1)
+        srv_close(conn);
+}
+
+/* Pass every complete request in the input buffer to hnd_request */
+void http_deliver(srv_conn *conn) {
+    srv_t *ctx = conn->ctx;
+    srv_http_request req;
+    char *buf;
+    int avail, pos, total, parsed;
+
+    while(conn->fd != -1 && conn->in_end > conn->in_start &&
+            !conn->holds) {
+        buf = conn->in_buf + conn->in_start;
+        avail = conn->in_end - conn->in_start;
+        parsed = 0;
+
+        if(conn->http.head == 0) {
+            /* Empty lines ahead of a request are ignored, RFC 7230 3.5 */
+            if(buf[0] == '\r' || buf[0] == '\n') {
+                conn->in_start++;
+                conn->in_scan = 0;
+                continue;
+            }
+
+            pos = srv_find_delim(buf + conn->in_scan, avail - conn->in_scan, "\r\n\r\n", 4);
+            if(pos == -1) {
+                conn->in_scan = avail > 3 ? avail - 3 : 0;
+                if(avail > HTTP_MAX_HEAD)
+                    http_fail(conn, SRV_EOVERFLOW);
+                break;
+            }
+
+            conn->http.head = conn->in_scan + pos + 4;
+            conn->in_scan = 0;
+
+            if(conn->http.head > HTTP_MAX_HEAD) {
+                http_fail(conn, SRV_EOVERFLOW);
+                break;
+            }
+
+            if(http_parse_head(buf, conn->http.head, &req) == -1) {
+                http_fail(conn, SRV_EPROTO);
+                break;
+            }
+            parsed = 1;
+
+            if(req.chunked) {
+                conn->http.clen = HTTP_CHUNKED;
+                conn->http.chunk = conn->http.body = conn->http.head;
+            }
+            else
+                conn->http.clen = req.content_length > 0 ? req.content_length : 0;
+
+            if(conn->http.clen > ctx->maxreadbuf) {
+                http_fail(conn, SRV_EOVERFLOW);
+                break;
+            }
+        }
+
+        /* The body */
+        if(conn->http.clen == HTTP_CHUNKED) {
+            total = http_chunks(conn, buf, avail);
+            if(total == -1) {
+                http_fail(conn, SRV_EPROTO);
+                break;
+            }
+        }
+        else
+            total = avail - conn->http.head >= conn->http.clen ?
+                    conn->http.head + (int) conn->http.clen : 0;
+
+        if(total == 0)
+            break; /* Waiting for more */
+
+        /* Parsed on an earlier pass, before the body had arrived */
+        if(!parsed)
+            http_parse_head(buf, conn->http.head, &req);
+
+        req.body = buf + conn->http.head;
+        req.body_len = conn->http.clen == HTTP_CHUNKED ? conn->http.body - conn->http.head
+                                                       : (int) conn->http.clen;
+        http_reset(conn);
+
+        /* Consumed up front. The request stays in place until the handler
+           returns */
+        conn->in_start += total;
+        (*(ctx->hnd_request))(conn, &req);
+    }
+}
+
+/* Have the library parse HTTP/1.1 requests and call h once per complete
+   request, body included. Requests are delivered in the order they came
+   in, pipelined or not. Malformed requests are reported to hnd_error with
+   SRV_EPROTO, oversized ones with SRV_EOVERFLOW, and the connection is
+   closed after that. Takes precedence over hnd_message and hnd_data */
+int srv_hnd_request(srv_t *ctx, void (*h)(srv_conn *, srv_http_request *)) {
+    if(!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->hnd_request = h;
+    return 0;
+}
+
+/* The value of the first header called name, or NULL. *len receives the
+   length of the value */
+const char *srv_http_header_get(srv_http_request *req, const char *name, int *len) {
+    int i;
+
+    for(i = 0; req && name && i < req->nheaders; i++) {
+        if(http_ieq(req->headers[i].name, req->headers[i].name_len, name)) {
+            if(len)
+                *len = req->headers[i].value_len;
+            return req->headers[i].value;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,257 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_loop.h"
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+/* Library-managed reads. Each connection gets a linear buffer holding
+   in_buf[in_start, in_end). Handlers see that range in place and release
+   what they have used with srv_consume(), so a partial message stays where
+   it is until the rest arrives. Bytes are only moved when room is needed
+   and more than half of the buffer is already consumed. The buffer is
+   borrowed from the loop's pool and given back as soon as it is empty, so
+   idle connections hold none */
+
+void in_free(srv_conn *conn) {
+    if(conn->flags & CONN_INPOOL) {
+        buf_put(&conn->loop->bufs, conn->in_buf);
+        conn->flags &= ~CONN_INPOOL;
+    }
+    else
+        free(conn->in_buf);
+    conn->in_buf = NULL;
+    conn->in_start = conn->in_end = conn->in_size = 0;
+    conn->in_scan = 0;
+    conn->http.head = conn->http.chunk = conn->http.body = conn->http.trailer = 0;
+    conn->http.clen = 0;
+}
+
+/* Make room for at least 'need' more bytes after in_end */
+static int in_reserve(srv_conn *conn, int need) {
+    srv_t *ctx = conn->ctx;
+    char *buf;
+    int len, size;
+
+    if(conn->in_size - conn->in_end >= need)
+        return 0;
+
+    len = conn->in_end - conn->in_start;
+    if(conn->in_start && conn->in_start >= conn->in_size / 2 &&
+            conn->in_size - len >= need) {
+        memmove(conn->in_buf, conn->in_buf + conn->in_start, len);
+        conn->in_start = 0;
+        conn->in_end = len;
+        return 0;
+    }
+
+    if(conn->in_buf == NULL && need <= ctx->szpoolbuf && ctx->szpoolbuf <= ctx->maxreadbuf &&
+            (buf = buf_get(&conn->loop->bufs)) != NULL) {
+        conn->in_buf = buf;
+        conn->in_size = (int) conn->loop->bufs.size;
+        conn->flags |= CONN_INPOOL;
+        return 0;
+    }
+
+    /* Only the unconsumed bytes count against the limit */
+    if(len + need > ctx->maxreadbuf) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    size = conn->in_size ? conn->in_size : ctx->szreadbuf;
+    while(size - conn->in_end < need && size < ctx->maxreadbuf)
+        size = size > ctx->maxreadbuf / 2 ? ctx->maxreadbuf : size * 2;
+
+    if(size - len < need) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if(size - conn->in_end < need) {
+        /* As large as allowed. Fits once the consumed bytes are dropped */
+        memmove(conn->in_buf, conn->in_buf + conn->in_start, len);
+        conn->in_start = 0;
+        conn->in_end = len;
+    }
+
+    if(size == conn->in_size)
+        return 0;
+
+    if(conn->flags & CONN_INPOOL) {
+        /* Outgrown the pool buffer */
+        buf = malloc(size);
+        if(buf == NULL)
+            return -1;
+
+        memcpy(buf, conn->in_buf, conn->in_end);
+        buf_put(&conn->loop->bufs, conn->in_buf);
+        conn->flags &= ~CONN_INPOOL;
+    }
+    else if((buf = realloc(conn->in_buf, size)) == NULL)
+        return -1;
+
+    conn->in_buf = buf;
+    conn->in_size = size;
+    return 0;
+}
+
+/* One read into the buffer. Returns the number of bytes read, 0 on EOF and
+   -1 on errors, including EAGAIN */
+static int in_fill(srv_conn *conn) {
+    srv_loop *loop = conn->loop;
+    int n, room;
+#ifndef _WIN32
+    int spill;
+    struct iovec iov[2];
+#endif
+
+    if(conn->in_start == conn->in_end)
+        conn->in_start = conn->in_end = 0;
+
+    if(in_reserve(conn, 1) == -1)
+        return -1;
+
+    room = conn->in_size - conn->in_end;
+
+#ifndef _WIN32
+    if(loop->in_scratch == NULL)
+        loop->in_scratch = malloc(IN_SCRATCH);
+
+    /* Never take more off the socket than the buffer may grow to hold, or
+       what didn't fit would be lost */
+    spill = conn->ctx->maxreadbuf - (conn->in_end - conn->in_start) - room;
+    if(spill < 0)
+        spill = 0;
+    else if(spill > IN_SCRATCH)
+        spill = IN_SCRATCH;
+
+    iov[0].iov_base = conn->in_buf + conn->in_end;
+    iov[0].iov_len = room;
+    iov[1].iov_base = loop->in_scratch;
+    iov[1].iov_len = loop->in_scratch ? spill : 0;
+
+    do {
+        n = readv(conn->fd, iov, 2);
+    } while(n == -1 && errno == EINTR);
+#else
+    /* TODO: WSARecv() */
+    n = recv(conn->fd, conn->in_buf + conn->in_end, room, 0);
+#endif
+
+    if(n <= 0)
+        return n;
+
+    if(n <= room) {
+        conn->in_end += n;
+        return n;
+    }
+
+    /* The rest landed in the loop's scratch segment */
+    conn->in_end = conn->in_size;
+    if(in_reserve(conn, n - room) == -1)
+        return -1;
+
+    memcpy(conn->in_buf + conn->in_end, loop->in_scratch, n - room);
+    conn->in_end += n - room;
+    return n;
+}
+
+/* Hand the buffered bytes to the handler until it stops consuming them, or
+   reads are held: offloaded, or output backed up */
+void in_deliver(srv_conn *conn) {
+    void (*hnd)(srv_conn *, char *, int) = conn->ctx->hnd_data;
+    int start;
+
+    if(conn->ctx->hnd_request) {
+        /* Parsed into HTTP requests for hnd_request instead */
+        http_deliver(conn);
+    }
+    else if(conn->ctx->hnd_message) {
+        /* Split into frames for hnd_message instead */
+        frame_deliver(conn);
+    }
+    else {
+        while(conn->fd != -1 && conn->in_end > conn->in_start &&
+                !conn->holds) {
+            start = conn->in_start;
+            (*hnd)(conn, conn->in_buf + conn->in_start, conn->in_end - conn->in_start);
+
+            if(conn->in_start == start)
+                break; /* Waiting for more data */
+        }
+    }
+
+    /* Everything consumed, give the buffer back */
+    if(conn->fd != -1 && conn->in_start == conn->in_end && conn->in_buf)
+        in_free(conn);
+}
+
+/* The socket is readable. Read once, or until EAGAIN on edge-triggered
+   connections, and deliver after every read */
+void in_readable(srv_conn *conn) {
+    srv_t *ctx = conn->ctx;
+    int n;
+
+    do {
+        n = in_fill(conn);
+        if(n > 0) {
+            conn->flags |= CONN_RDSEEN;
+            in_deliver(conn);
+        }
+    } while(n > 0 && (conn->flags & CONN_EDGE) && conn->fd != -1 &&
+            (conn->events & EVENTRD));
+
+    if(n > 0 || conn->fd == -1)
+        return;
+
+    if(n == 0) {
+        /* The peer has closed its side */
+        conn->flags &= ~CONN_RDREADY;
+        if(ctx->hnd_rdhup)
+            (*(ctx->hnd_rdhup))(conn);
+    }
+    else if(WOULDBLOCK()) {
+        conn->flags &= ~CONN_RDREADY;
+        return;
+    }
+    else if(ctx->hnd_error)
+        (*(ctx->hnd_error))(conn, errno == ENOBUFS ? SRV_EOVERFLOW : SRV_ESOCKET);
+
+    if(conn->fd != -1)
+        srv_close(conn);
+}
+
+/* Release the first n bytes of the view passed to hnd_data */
+int srv_consume(srv_conn *conn, int n) {
+    if(!conn || n < 0 || n > conn->in_end - conn->in_start) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    conn->in_start += n;
+    conn->in_scan = 0;
+    return 0;
+}
@@ -23,6 +23,10 @@ SOFTWARE.
 #ifndef __SERV_INTERNAL_H
 #define __SERV_INTERNAL_H
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* accept4() */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,6 +34,7 @@ SOFTWARE.
 #include <errno.h>
 #include <sys/types.h>
 #include <stdint.h>
+#include <limits.h>
 
 #include "serv.h"
 
@@ -39,6 +44,7 @@ SOFTWARE.
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>
 #endif
 
 #ifdef _MSC_VER
@@ -59,17 +65,21 @@ SOFTWARE.
 /* Detect the best event notification mechanism available */
 #ifdef __linux__
     #include <linux/version.h>
-    #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,5,44)
+    #if defined(SRV_WITH_URING) && LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+        /* Opt-in. Falls back to epoll at runtime if the kernel refuses it */
+        #define URING
+    #elif !defined(SRV_WITH_POLL) && LINUX_VERSION_CODE >= KERNEL_VERSION(2,5,44)
         #define EPOLL
     #else
-    /* TODO: Check if poll, kqueue or IOCP is avalable.
-        If not, fallback to select */
-        #define SELECT
+        #define POLL
     #endif
 #else
 	#ifdef _WIN32
     	/* TODO: Check if IOCP exists. Otherwise, fallback to select */
     	#define SELECT
+	#else
+        /* TODO: kqueue */
+        #define POLL
 	#endif
 #endif
 
@@ -77,15 +87,13 @@ SOFTWARE.
     #include <sys/epoll.h>
 #endif
 
+#ifdef URING
+    #include <sys/epoll.h>
+    #include <linux/io_uring.h>
+#endif
+
 #ifdef SELECT
-    #ifdef _WIN32
-        #define FD_SETSIZE 10000 /* TODO: Find the max # of open sockets instead of a hardcoded value */
-    #else
-        #define FD_SETSIZE FOPEN_MAX
-    #endif
-    #ifdef __linux__
-        #include <sys/select.h>
-    #endif
+    #define FD_SETSIZE 10000 /* TODO: Find the max # of open sockets instead of a hardcoded value */
 #endif
 
 #ifndef INET6_ADDRSTRLEN
@@ -100,6 +108,19 @@ SOFTWARE.
 #define unlikely(x) x
 #endif
 
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/* True if the last socket call failed because it would have blocked */
+#ifdef _WIN32
+#define WOULDBLOCK() (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+#define WOULDBLOCK() ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+#endif
+
 #ifndef SOCK_NONBLOCK
 #define SOCK_NONBLOCK 1
 #endif
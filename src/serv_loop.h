@@ -0,0 +1,82 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SERV_LOOP_H
+#define _SERV_LOOP_H
+
+#include "serv_select.h"
+#include "serv_poll.h"
+#include "serv_epoll.h"
+#include "serv_uring.h"
+#include "serv_timer.h"
+#include "serv_post.h"
+#include "serv_resolve.h"
+#include "serv_pool.h"
+#include "serv_out.h"
+#include "serv_zc.h"
+#include "serv_in.h"
+#include "serv_file.h"
+#include "serv_buf.h"
+#include "serv_frame.h"
+#include "serv_http.h"
+#include "serv_udp.h"
+#include "conn.h"
+#include "serv_upstream.h"
+#include "serv_proxy.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+/* State owned by a single event loop. srv_run() drives one of these on the
+   calling thread, srv_run_threads() drives one per thread. Nothing in here
+   is shared between loops, so none of it needs locking */
+struct _srv_loop {
+    srv_t *ctx;
+    int index; /* Position in ctx->loops, part of every srv_handle_t */
+    event_t ev;
+    int fdlistener;
+    conn_table_t conns;
+    struct sockaddr_storage addr; /* Peer address of the connection being accepted */
+    socklen_t addrlen;
+
+    post_queue_t post;
+    srv_conn *flush; /* Connections with output to write this iteration */
+    char *in_scratch; /* Overflow segment for reads. See IN_SCRATCH */
+    timer_wheel_t timers;
+    file_cache_t files; /* See srv_file_open() */
+    buf_pool_t bufs;    /* See srv_set_buffer_pool() */
+    udp_state_t *udp;   /* Datagram mode only. See srv_set_datagram() */
+    zc_state_t *zc_linger; /* Closed with zero-copy sends in flight. See zc_linger() */
+    srv_busy_poll_stats busy;
+    uint64_t now; /* Monotonic time in ms, read once per iteration */
+    int status; /* Return value of the loop */
+
+#ifndef _WIN32
+    pthread_t thread;
+#endif
+};
+
+/* The loop driven by the calling thread, if any */
+extern THREAD_LOCAL srv_loop *loop_current;
+
+#endif
@@ -0,0 +1,845 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_loop.h"
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+/* Queue the connection for a flush at the end of the loop iteration, so
+   that everything sent while handling one batch goes out in one writev */
+static void out_schedule(srv_conn *conn) {
+    srv_loop *loop = conn->loop;
+
+    if(conn->flags & (CONN_FLUSH | CONN_WRAUTO))
+        return; /* Already queued, or waiting for EVENTWR */
+
+    conn->flags |= CONN_FLUSH;
+    conn->flush_next = loop->flush;
+    loop->flush = conn;
+}
+
+/* The queue has grown past what the connection may buffer. Stop reading
+   from it, and from the connection linked to it, until it drains to the
+   low watermark. Proxied connections pace themselves */
+static void out_above(srv_conn *conn) {
+    srv_conn *peer;
+
+    if(conn->flags & (CONN_HIGH | CONN_PROXY))
+        return;
+
+    conn->flags |= CONN_HIGH;
+    conn_hold_read(conn);
+
+    if(conn->wm_peer != SRV_HANDLE_NONE &&
+            (peer = conn_resolve(&conn->loop->conns, conn->wm_peer)) != NULL) {
+        conn_hold_read(peer);
+        conn->wm_held = conn->wm_peer;
+    }
+}
+
+static void out_resume(srv_conn *conn, void *arg) {
+    (void) arg;
+
+    if(!conn->holds && conn->in_end > conn->in_start)
+        in_deliver(conn);
+}
+
+/* Input left buffered while reads were held gets no new read event. It is
+   delivered from the post queue, away from the write that let go */
+static void out_unhold(srv_conn *conn) {
+    conn_unhold_read(conn);
+    if(!conn->holds && conn->in_end > conn->in_start && IN_MANAGED(conn->ctx))
+        srv_conn_post(conn, out_resume, NULL);
+}
+
+/* Let go of the linked connection held by out_above(), if it is still
+   there */
+static void out_unhold_peer(srv_conn *conn) {
+    srv_conn *peer;
+
+    if(conn->wm_held == SRV_HANDLE_NONE)
+        return;
+
+    if((peer = conn_resolve(&conn->loop->conns, conn->wm_held)) != NULL)
+        out_unhold(peer);
+    conn->wm_held = SRV_HANDLE_NONE;
+}
+
+static void out_below(srv_conn *conn) {
+    conn->flags &= ~CONN_HIGH;
+    out_unhold(conn);
+    out_unhold_peer(conn);
+}
+
+/* Account for n more bytes queued, mem of them in memory. Past the high
+   watermark, or past the memory ceiling of all loops together, reads are
+   held */
+static void out_grow(srv_conn *conn, size_t n, int mem) {
+    srv_t *ctx = conn->ctx;
+
+    conn->out_bytes += n;
+    if(mem) {
+        conn->out_mem += n;
+        if(ctx->out_limit &&
+                __atomic_add_fetch(&ctx->out_total, n, __ATOMIC_RELAXED) > ctx->out_limit) {
+            out_above(conn);
+            return;
+        }
+    }
+
+    if(unlikely(conn->out_bytes > conn->wm_high))
+        out_above(conn);
+}
+
+void out_append(srv_conn *conn, out_seg_t *seg) {
+    seg->next = NULL;
+    if(conn->out_tail)
+        conn->out_tail->next = seg;
+    else
+        conn->out_head = seg;
+    conn->out_tail = seg;
+    out_grow(conn, seg->len, seg->kind == OUT_MEM || seg->kind == OUT_ZC);
+
+    out_schedule(conn);
+}
+
+void out_release(srv_conn *conn, out_seg_t *seg) {
+    if(seg->free_fn)
+        (*(seg->free_fn))(seg->free_arg);
+
+    if(seg->file)
+        file_unref(seg->file);
+    else if(seg->kind != OUT_MEM)
+        close(seg->fd);
+
+    if(seg->pooled)
+        buf_put(&conn->loop->bufs, seg);
+    else
+        free(seg);
+}
+
+/* Drop everything still queued, sent or not. Zero-copy segments the kernel
+   may still read from are held, see zc_linger() and zc_free() */
+void out_free(srv_conn *conn) {
+    out_seg_t *seg;
+
+    while((seg = conn->out_head) != NULL) {
+        conn->out_head = seg->next;
+        if(seg->zc_sent)
+            zc_hold(conn, seg);
+        else
+            out_release(conn, seg);
+    }
+
+    conn->out_tail = NULL;
+    conn->out_bytes = 0;
+    if(conn->ctx->out_limit)
+        __atomic_sub_fetch(&conn->ctx->out_total, conn->out_mem, __ATOMIC_RELAXED);
+    conn->out_mem = 0;
+
+    /* Reads from this connection don't matter any more, but the linked
+       one may be waiting for it */
+    if(conn->flags & CONN_HIGH) {
+        conn->flags &= ~CONN_HIGH;
+        conn->holds--;
+        out_unhold_peer(conn);
+    }
+}
+
+/* Turn the library's interest in EVENTWR on or off. Leaves EVENTWR alone if
+   the application asked for it itself */
+static int out_arm(srv_conn *conn, int on) {
+    if(on) {
+        if((conn->flags & CONN_WRAUTO) || (conn->events & EVENTWR))
+            return 0;
+
+        if(event_mod_fd(&conn->loop->ev, conn->fd, conn->events | EVENTWR, conn) == -1)
+            return -1;
+        conn->events |= EVENTWR;
+        conn->flags |= CONN_WRAUTO;
+    }
+    else if(conn->flags & CONN_WRAUTO) {
+        conn->flags &= ~CONN_WRAUTO;
+        if(event_mod_fd(&conn->loop->ev, conn->fd, conn->events & ~EVENTWR, conn) == -1)
+            return -1;
+        conn->events &= ~EVENTWR;
+    }
+
+    return 0;
+}
+
+/* Drop the first n bytes of the queue, releasing the segments they
+   complete */
+static void out_advance(srv_conn *conn, size_t n) {
+    out_seg_t *seg;
+
+    /* A single write never mixes memory with file or pipe segments */
+    conn->out_bytes -= n;
+    seg = conn->out_head;
+    if(seg->kind == OUT_MEM || seg->kind == OUT_ZC) {
+        conn->out_mem -= n;
+        if(conn->ctx->out_limit)
+            __atomic_sub_fetch(&conn->ctx->out_total, n, __ATOMIC_RELAXED);
+    }
+
+    if(unlikely(conn->flags & CONN_HIGH) && conn->out_bytes <= conn->wm_low)
+        out_below(conn);
+
+    while((seg = conn->out_head) != NULL && n >= seg->len - seg->off) {
+        n -= seg->len - seg->off;
+        conn->out_head = seg->next;
+
+        /* Zero-copy pages stay pinned until the kernel says otherwise */
+        if(seg->zc_sent)
+            zc_hold(conn, seg);
+        else
+            out_release(conn, seg);
+    }
+
+    if(seg == NULL)
+        conn->out_tail = NULL;
+    else
+        seg->off += n;
+}
+
+#ifndef _WIN32
+static ssize_t out_writev(int fd, struct iovec *iov, int niov) {
+#ifdef MSG_NOSIGNAL
+    struct msghdr msg;
+
+    /* writev() that doesn't raise SIGPIPE */
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = niov;
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+#else
+    return writev(fd, iov, niov);
+#endif
+}
+
+/* Write the memory segments at the head of the queue with one writev.
+   Returns 1 if all of them went out, 0 if the socket is full and -1 on
+   errors */
+static int out_flush_mem(srv_conn *conn) {
+    struct iovec iov[OUT_IOV];
+    out_seg_t *seg;
+    size_t total;
+    ssize_t n;
+    int niov;
+
+    niov = 0;
+    total = 0;
+    for(seg = conn->out_head; seg && seg->kind == OUT_MEM && niov < OUT_IOV;
+            seg = seg->next) {
+        iov[niov].iov_base = (void *) (seg->data + seg->off);
+        iov[niov].iov_len = seg->len - seg->off;
+        total += iov[niov].iov_len;
+        niov++;
+    }
+
+    do {
+        n = out_writev(conn->fd, iov, niov);
+    } while(n == -1 && errno == EINTR);
+
+    if(n == -1)
+        return WOULDBLOCK() ? 0 : -1;
+
+    out_advance(conn, (size_t) n);
+    return (size_t) n == total;
+}
+
+/* Send the file or pipe segment at the head of the queue. Returns 1 once
+   it is done, 0 if the socket is full, 2 if the pipe is empty and -1 on
+   errors */
+static int out_flush_fd(srv_conn *conn, out_seg_t *seg) {
+    size_t chunk;
+    ssize_t n;
+#ifdef __linux__
+    off_t pos;
+#else
+    char buf[16384];
+    ssize_t m;
+#endif
+
+    chunk = seg->len - seg->off;
+    if(chunk > OUT_CHUNK)
+        chunk = OUT_CHUNK;
+
+    for(;;) {
+#ifdef __linux__
+        if(seg->kind == OUT_FILE) {
+            pos = (off_t) (seg->pos + (long long) seg->off);
+            n = sendfile(conn->fd, seg->fd, &pos, chunk);
+        }
+        else
+            n = splice(seg->fd, NULL, conn->fd, NULL, chunk,
+                       SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+#else
+        /* No sendfile() with the same semantics everywhere. Bounce through
+           a buffer, the file's page cache makes up for most of it */
+        if(chunk > sizeof(buf))
+            chunk = sizeof(buf);
+        m = pread(seg->fd, buf, chunk, (off_t) (seg->pos + (long long) seg->off));
+        if(m <= 0) {
+            n = m;
+        }
+        else {
+            n = send(conn->fd, buf, m, 0);
+            /* Nothing is lost on a short send, the rest is read again */
+        }
+#endif
+        if(n != -1 || errno != EINTR)
+            break;
+    }
+
+    if(n == 0) {
+        /* The file was truncated, or the pipe closed early */
+        errno = EPIPE;
+        return -1;
+    }
+
+    if(n == -1) {
+        if(!WOULDBLOCK())
+            return -1;
+
+#ifdef __linux__
+        /* splice() doesn't tell a full socket from an empty pipe */
+        if(seg->kind == OUT_PIPE) {
+            int avail;
+
+            if(ioctl(seg->fd, FIONREAD, &avail) == 0 && avail == 0)
+                return 2;
+        }
+#endif
+        return 0;
+    }
+
+    out_advance(conn, (size_t) n);
+    return conn->out_head != seg;
+}
+
+/* Send the zero-copy segment at the head of the queue. Same return values
+   as out_flush_mem() */
+static int out_flush_zc(srv_conn *conn, out_seg_t *seg) {
+    struct msghdr msg;
+    struct iovec iov;
+    int flags;
+    ssize_t n;
+
+    iov.iov_base = (void *) (seg->data + seg->off);
+    iov.iov_len = seg->len - seg->off;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#else
+    flags = 0;
+#endif
+
+    for(;;) {
+#ifdef SRV_ZEROCOPY
+        if(zc_enable(conn) == 0) {
+            n = sendmsg(conn->fd, &msg, flags | MSG_ZEROCOPY);
+            if(n > 0) {
+                seg->zc_last = conn->zc->next++;
+                seg->zc_sent = 1;
+                break;
+            }
+
+            /* Out of optmem for notifications. Copy this one */
+            if(n == -1 && errno == ENOBUFS)
+                n = sendmsg(conn->fd, &msg, flags);
+        }
+        else
+#endif
+            n = sendmsg(conn->fd, &msg, flags);
+
+        if(n != -1 || errno != EINTR)
+            break;
+    }
+
+    if(n == -1)
+        return WOULDBLOCK() ? 0 : -1;
+
+    out_advance(conn, (size_t) n);
+    return conn->out_head != seg;
+}
+
+/* Watch the pipe at the head of the queue until something is written to it
+   or its writer goes away. Meanwhile the socket isn't waited on */
+static int out_pipe_wait(srv_conn *conn) {
+    void *data = (void *) ((uintptr_t) conn | OUT_PIPE_TAG);
+
+    if(event_add_fd(&conn->loop->ev, conn->out_head->fd, EVENTRD, data) == -1)
+        return -1;
+
+    conn->flags |= CONN_PIPEWAIT;
+    return 0;
+}
+#endif
+
+void out_pipe_unwait(srv_conn *conn) {
+    conn->flags &= ~CONN_PIPEWAIT;
+    event_remove_fd(&conn->loop->ev, conn->out_head->fd);
+}
+
+/* The pipe watched by out_pipe_wait() has data, or hung up. Either way
+   the next flush tells */
+void out_pipe_ready(void *data) {
+    srv_conn *conn = (srv_conn *) ((uintptr_t) data & ~(uintptr_t) OUT_PIPE_TAG);
+
+    /* Closed by an earlier event of this batch */
+    if(conn->fd == -1 || !(conn->flags & CONN_PIPEWAIT))
+        return;
+
+    out_pipe_unwait(conn);
+    out_schedule(conn);
+}
+
+/* Write as much of the queue as the socket takes. Returns 1 if the queue
+   is empty afterwards, 0 if the socket is full and -1 on errors. EVENTWR
+   is armed or disarmed to match */
+int out_flush(srv_conn *conn) {
+    out_seg_t *seg;
+    int status;
+
+    if(conn->flags & CONN_PIPEWAIT)
+        return 0; /* Waiting for a pipe to fill up */
+
+#ifndef _WIN32
+    while((seg = conn->out_head) != NULL) {
+        if(seg->kind == OUT_MEM)
+            status = out_flush_mem(conn);
+        else if(seg->kind == OUT_ZC)
+            status = out_flush_zc(conn, seg);
+        else
+            status = out_flush_fd(conn, seg);
+
+        if(status == -1)
+            return -1;
+
+        if(status == 0)
+            return out_arm(conn, 1) == -1 ? -1 : 0;
+
+        if(status == 2) {
+            /* There is no readiness to wait for on the socket, wait on
+               the pipe instead of spinning on EVENTWR */
+            if(out_arm(conn, 0) == -1 || out_pipe_wait(conn) == -1)
+                return -1;
+            return 0;
+        }
+    }
+#else
+    /* TODO: WSASend() */
+    if((seg = conn->out_head) != NULL) {
+        status = send(conn->fd, seg->data + seg->off, (int) (seg->len - seg->off), 0);
+        if(status == -1) {
+            if(!WOULDBLOCK())
+                return -1;
+            status = 0;
+        }
+
+        out_advance(conn, (size_t) status);
+        if(conn->out_head)
+            return out_arm(conn, 1) == -1 ? -1 : 0;
+    }
+#endif
+
+    return out_arm(conn, 0) == -1 ? -1 : 1;
+}
+
+/* Flush every connection that has been sent to during this iteration */
+void loop_flush(srv_loop *loop) {
+    srv_conn *conn;
+    srv_t *ctx = loop->ctx;
+
+    while((conn = loop->flush) != NULL) {
+        loop->flush = conn->flush_next;
+        conn->flags &= ~CONN_FLUSH;
+
+        if(conn->fd == -1)
+            continue; /* Closed since */
+
+        if(out_flush(conn) == -1) {
+            if(ctx->hnd_error)
+                (*(ctx->hnd_error))(conn, SRV_ESOCKET);
+
+            if(conn->fd != -1)
+                srv_close(conn);
+        }
+    }
+
+    /* Replies staged by srv_sendto() */
+    if(loop->udp && loop->udp->nout)
+        udp_flush(loop);
+}
+
+/* Queue a copy of buf for sending. Small sends are packed together in
+   buffers borrowed from the loop's pool, or in heap segments of at least
+   ctx->szwritebuf bytes when they don't fit. Nothing is written until the
+   end of the current loop iteration, when each connection's queue goes out
+   in one writev. EVENTWR is armed for whatever doesn't fit in the socket
+   buffer and disarmed again once it is drained. Returns 0 or -1 */
+int srv_send(srv_conn *conn, const char *buf, int size) {
+    out_seg_t *seg;
+
+    if(!conn || conn->fd == -1 || size < 0 || (size && !buf)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(size == 0)
+        return 0;
+
+    seg = conn->out_tail;
+    if(seg && seg->cap >= seg->len + size) {
+        /* Room left in the last copy */
+        memcpy((char *) (seg + 1) + seg->len, buf, size);
+        seg->len += size;
+        out_grow(conn, size, 1);
+        out_schedule(conn);
+        return 0;
+    }
+
+    if((seg = out_copy(conn, buf, size)) == NULL)
+        return -1;
+
+    out_append(conn, seg);
+    return 0;
+}
+
+/* A segment holding a copy of buf, for conn's queue but not on it yet.
+   Goes to out_append(), or back through out_release() */
+out_seg_t *out_copy(srv_conn *conn, const char *buf, int size) {
+    buf_pool_t *pool;
+    out_seg_t *seg;
+    size_t cap;
+    int pooled;
+
+    pool = &conn->loop->bufs;
+    if(sizeof(out_seg_t) + size <= pool->size && (seg = buf_get(pool)) != NULL) {
+        /* The copy lives in a pool buffer until it has been written */
+        cap = pool->size - sizeof(out_seg_t);
+        pooled = 1;
+    }
+    else {
+        cap = (size_t) size > (size_t) conn->ctx->szwritebuf ? (size_t) size
+                                                             : (size_t) conn->ctx->szwritebuf;
+        seg = malloc(sizeof(out_seg_t) + cap);
+        if(seg == NULL)
+            return NULL;
+        pooled = 0;
+    }
+
+    memcpy(seg + 1, buf, size);
+    seg->data = (const char *) (seg + 1);
+    seg->len = size;
+    seg->off = 0;
+    seg->cap = cap;
+    seg->free_fn = NULL;
+    seg->free_arg = NULL;
+    seg->kind = OUT_MEM;
+    seg->fd = -1;
+    seg->file = NULL;
+    seg->zc_sent = 0;
+    seg->pooled = pooled;
+
+    return seg;
+}
+
+/* Queue buf for sending without copying it. buf must stay valid until
+   free_fn(arg) is called, which happens once it has been sent or the
+   connection has been closed. free_fn may be NULL */
+int srv_send_ref(srv_conn *conn, const char *buf, int size,
+                 void (*free_fn)(void *), void *arg) {
+    out_seg_t *seg;
+
+    if(!conn || conn->fd == -1 || size < 0 || (size && !buf)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    seg = malloc(sizeof(out_seg_t));
+    if(seg == NULL)
+        return -1;
+
+    seg->data = buf;
+    seg->len = size;
+    seg->off = 0;
+    seg->cap = 0;
+    seg->free_fn = free_fn;
+    seg->free_arg = arg;
+    seg->kind = OUT_MEM;
+    seg->fd = -1;
+    seg->file = NULL;
+    seg->zc_sent = 0;
+    seg->pooled = 0;
+
+    out_append(conn, seg);
+    return 0;
+}
+
+/* Queue buf for sending with MSG_ZEROCOPY. The kernel transmits straight
+   from buf's pages, so buf must stay untouched until done(arg) is called.
+   That happens once the kernel reports it no longer needs the pages, not
+   when the data has been written. Closing the connection doesn't stop the
+   kernel either, the socket is kept open in the background until it does.
+   Buffers below ctx->zerocopy_min bytes, and every buffer on sockets or
+   systems without zero-copy support, are sent like srv_send_ref() */
+int srv_send_zerocopy(srv_conn *conn, const char *buf, int size,
+                      void (*done)(void *), void *arg) {
+    out_seg_t *seg;
+
+    if(!conn || conn->fd == -1 || size < 0 || (size && !buf)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(size < conn->ctx->zerocopy_min || zc_enable(conn) == -1)
+        return srv_send_ref(conn, buf, size, done, arg);
+
+    seg = malloc(sizeof(out_seg_t));
+    if(seg == NULL)
+        return -1;
+
+    seg->data = buf;
+    seg->len = size;
+    seg->off = 0;
+    seg->cap = 0;
+    seg->free_fn = done;
+    seg->free_arg = arg;
+    seg->kind = OUT_ZC;
+    seg->fd = -1;
+    seg->file = NULL;
+    seg->zc_sent = 0;
+    seg->pooled = 0;
+
+    out_append(conn, seg);
+    return 0;
+}
+
+/* Queue a segment that owns fd, or a reference to file */
+int out_append_fd(srv_conn *conn, int kind, int fd, long long pos, long long len,
+                  srv_file *file) {
+    out_seg_t *seg;
+
+    seg = malloc(sizeof(out_seg_t));
+    if(seg == NULL)
+        return -1;
+
+    seg->data = NULL;
+    seg->len = (size_t) len;
+    seg->off = 0;
+    seg->cap = 0;
+    seg->free_fn = NULL;
+    seg->free_arg = NULL;
+    seg->kind = kind;
+    seg->fd = fd;
+    seg->pos = pos;
+    seg->file = file;
+    seg->zc_sent = 0;
+    seg->pooled = 0;
+
+    out_append(conn, seg);
+    return 0;
+}
+
+#ifndef _WIN32
+static int out_dup(int fd) {
+#ifdef F_DUPFD_CLOEXEC
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+#else
+    return dup(fd);
+#endif
+}
+#endif
+
+/* Queue len bytes of the file fd, starting at offset off. They are sent
+   with sendfile(), straight from the page cache, once everything queued
+   before them is out. fd is duplicated, the caller may close it right away.
+   The file must not shrink until the range has been sent */
+int srv_sendfile(srv_conn *conn, int fd, long long off, long long len) {
+#ifndef _WIN32
+    int dupfd;
+
+    if(!conn || conn->fd == -1 || fd < 0 || off < 0 || len < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(len == 0)
+        return 0;
+
+    if((dupfd = out_dup(fd)) == -1)
+        return -1;
+
+    if(out_append_fd(conn, OUT_FILE, dupfd, off, len, NULL) == -1) {
+        close(dupfd);
+        return -1;
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Queue len bytes to be moved from the pipe fd to the socket with splice(),
+   without copying them through user space. Whatever writes into the pipe
+   must provide at least len bytes. fd is duplicated, the caller may close
+   it right away. Linux only */
+int srv_splice(srv_conn *conn, int fd, long long len) {
+#ifdef __linux__
+    int dupfd;
+
+    if(!conn || conn->fd == -1 || fd < 0 || len < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(len == 0)
+        return 0;
+
+    if((dupfd = out_dup(fd)) == -1)
+        return -1;
+
+    if(out_append_fd(conn, OUT_PIPE, dupfd, 0, len, NULL) == -1) {
+        close(dupfd);
+        return -1;
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Queue len bytes of a cached file, starting at offset off. The file stays
+   open until they have been sent, even if it drops out of the cache */
+int srv_file_send(srv_conn *conn, srv_file *file, long long off, long long len) {
+    if(!conn || conn->fd == -1 || !file || off < 0 || len < 0 ||
+            off + len > file->size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(len == 0)
+        return 0;
+
+    if(out_append_fd(conn, OUT_FILE, file->fd, off, len, file) == -1)
+        return -1;
+
+    file->refs++;
+    return 0;
+}
+
+/* Bytes queued by srv_send() and friends that have not been written to the
+   socket yet */
+size_t srv_send_pending(srv_conn *conn) {
+    return conn ? conn->out_bytes : 0;
+}
+
+/* Backpressure for new connections: once more than high bytes are queued
+   for output on a connection, the loop stops reading from it, and resumes
+   when the queue has drained to low. 0 for high turns it off, which is the
+   default. Set before srv_run(). Returns 0 or -1 */
+int srv_set_watermarks(srv_t *ctx, size_t high, size_t low) {
+    if(!ctx || (high && low > high)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->wm_high = high ? high : SIZE_MAX;
+    ctx->wm_low = high ? low : 0;
+    return 0;
+}
+
+/* The same for one connection, taking effect right away */
+int srv_conn_set_watermarks(srv_conn *conn, size_t high, size_t low) {
+    if(!conn || conn->fd == -1 || (high && low > high)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    conn->wm_high = high ? high : SIZE_MAX;
+    conn->wm_low = high ? low : 0;
+
+    if((conn->flags & CONN_HIGH) && conn->out_bytes <= conn->wm_low)
+        out_below(conn);
+    else if(conn->out_bytes > conn->wm_high)
+        out_above(conn);
+    return 0;
+}
+
+/* Name peer as the connection that feeds conn, e.g. the other side of a
+   relay: while conn is above its high watermark, reads from peer are held
+   too. Both must belong to the same loop. NULL unlinks. Returns 0 or -1 */
+int srv_conn_link(srv_conn *conn, srv_conn *peer) {
+    if(!conn || conn->fd == -1 || peer == conn ||
+            (peer && (peer->fd == -1 || peer->loop != conn->loop))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    conn->wm_peer = peer ? srv_conn_handle(peer) : SRV_HANDLE_NONE;
+
+    /* A hold already taken follows the link */
+    if((conn->flags & CONN_HIGH) && conn->wm_held != conn->wm_peer) {
+        out_unhold_peer(conn);
+        if(peer) {
+            conn_hold_read(peer);
+            conn->wm_held = conn->wm_peer;
+        }
+    }
+    return 0;
+}
+
+/* Ceiling on the bytes queued in memory for output by all of ctx's
+   connections together, files and pipes not included. Past it, every
+   connection whose queue grows has its reads held until the queue drains
+   to its low watermark, or empties. 0, the default, for none. Set before
+   srv_run(). Returns 0 or -1 */
+int srv_set_memory_limit(srv_t *ctx, size_t limit) {
+    if(!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->out_limit = limit;
+    return 0;
+}
+
+/* Bytes counted against the ceiling right now, 0 without one */
+size_t srv_get_memory_queued(srv_t *ctx) {
+    return ctx ? __atomic_load_n(&ctx->out_total, __ATOMIC_RELAXED) : 0;
+}
@@ -0,0 +1,79 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SERV_OUT_H
+#define _SERV_OUT_H
+
+/* Kinds of output segments */
+#define OUT_MEM  0 /* Bytes in memory */
+#define OUT_FILE 1 /* A range of a file, sent with sendfile() */
+#define OUT_PIPE 2 /* Bytes to be drained from a pipe with splice() */
+#define OUT_ZC   3 /* Bytes in memory, sent with MSG_ZEROCOPY */
+
+/* A piece of a connection's output queue. Either a referenced buffer that
+   is handed to free_fn once sent, a copy, stored right after the header,
+   that later small sends are appended to, or a range of a file or a pipe
+   that is sent without passing through user space */
+typedef struct _out_seg {
+    struct _out_seg *next;
+    const char *data;
+    size_t len;  /* Bytes in the segment */
+    size_t off;  /* Bytes already sent */
+    size_t cap;  /* Room for copies, 0 for referenced buffers */
+    void (*free_fn)(void *);
+    void *free_arg;
+
+    int kind;
+    int pooled;            /* Borrowed from the loop's buffer pool */
+    int fd;                /* OUT_FILE and OUT_PIPE. Owned by the segment */
+    long long pos;         /* File offset of the first byte */
+    struct _srv_file *file; /* Set if fd belongs to the file cache */
+
+    /* OUT_ZC. Number of the last zero-copy send that covered the segment,
+       if any. See zc_state_t */
+    unsigned int zc_last;
+    int zc_sent;
+} out_seg_t;
+
+/* Segments gathered by one writev */
+#define OUT_IOV 128
+
+/* Largest chunk handed to sendfile() or splice() at once */
+#define OUT_CHUNK (1 << 30)
+
+/* Tag of the event data of a pipe registered by out_pipe_wait(). It is the
+   connection's address with the low bit set, which no connection, and none
+   of the loop's own event data, ever has */
+#define OUT_PIPE_TAG 1
+
+int out_flush(srv_conn *conn);
+void out_append(srv_conn *conn, out_seg_t *seg);
+out_seg_t *out_copy(srv_conn *conn, const char *buf, int size);
+void out_release(srv_conn *conn, out_seg_t *seg);
+void out_free(srv_conn *conn);
+int out_append_fd(srv_conn *conn, int kind, int fd, long long pos, long long len,
+                  struct _srv_file *file);
+void loop_flush(srv_loop *loop);
+void out_pipe_unwait(srv_conn *conn);
+void out_pipe_ready(void *data);
+
+#endif
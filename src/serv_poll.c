@@ -0,0 +1,203 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_poll.h"
+
+#ifdef POLL
+/* Initial sizes of the pollfd array and the fd index. Both grow as needed */
+#define POLL_INIT_FDS 64
+
+int event_init(event_t *ev, int max_events) {
+    int i;
+
+    ev->nfds = 0;
+    ev->szfds = POLL_INIT_FDS;
+    ev->szslots = POLL_INIT_FDS;
+    ev->max_events = max_events;
+    ev->next = 0;
+
+    ev->fds = malloc(sizeof(struct pollfd) * ev->szfds);
+    ev->data = malloc(sizeof(void *) * ev->szfds);
+    ev->slots = malloc(sizeof(int) * ev->szslots);
+    ev->events = calloc(max_events, sizeof(event_ready_t));
+    if(!ev->fds || !ev->data || !ev->slots || !ev->events) {
+        event_free(ev);
+        return -1;
+    }
+
+    for(i = 0; i < ev->szslots; i++)
+        ev->slots[i] = -1;
+
+    return 0;
+}
+
+static int poll_reserve(event_t *ev, int fd) {
+    struct pollfd *fds;
+    void **data;
+    int *slots;
+    int i, n;
+
+    if(fd >= ev->szslots) {
+        n = ev->szslots;
+        while(n <= fd)
+            n *= 2;
+
+        slots = realloc(ev->slots, sizeof(int) * n);
+        if(slots == NULL)
+            return -1;
+
+        for(i = ev->szslots; i < n; i++)
+            slots[i] = -1;
+
+        ev->slots = slots;
+        ev->szslots = n;
+    }
+
+    if(ev->nfds == ev->szfds) {
+        n = ev->szfds * 2;
+
+        fds = realloc(ev->fds, sizeof(struct pollfd) * n);
+        if(fds == NULL)
+            return -1;
+        ev->fds = fds;
+
+        data = realloc(ev->data, sizeof(void *) * n);
+        if(data == NULL)
+            return -1;
+        ev->data = data;
+
+        ev->szfds = n;
+    }
+
+    return 0;
+}
+
+int event_add_fd(event_t *ev, int fd, uint32_t flags, void *data) {
+    int slot;
+
+    if(fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(fd < ev->szslots && ev->slots[fd] != -1) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if(poll_reserve(ev, fd) == -1)
+        return -1;
+
+    slot = ev->nfds++;
+    ev->fds[slot].fd = fd;
+    ev->fds[slot].events = flags & ~EVENTET;
+    ev->fds[slot].revents = 0;
+    ev->data[slot] = data;
+    ev->slots[fd] = slot;
+
+    return 0;
+}
+
+int event_mod_fd(event_t *ev, int fd, uint32_t flags, void *data) {
+    int slot;
+
+    if(fd < 0 || fd >= ev->szslots || (slot = ev->slots[fd]) == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    ev->fds[slot].events = flags & ~EVENTET;
+    ev->data[slot] = data;
+
+    return 0;
+}
+
+int event_remove_fd(event_t *ev, int fd) {
+    int slot, last;
+
+    if(fd < 0 || fd >= ev->szslots || (slot = ev->slots[fd]) == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* Move the last entry into the hole to keep the array dense */
+    last = --ev->nfds;
+    if(slot != last) {
+        ev->fds[slot] = ev->fds[last];
+        ev->data[slot] = ev->data[last];
+        ev->slots[ev->fds[slot].fd] = slot;
+    }
+
+    ev->slots[fd] = -1;
+
+    return 0;
+}
+
+int event_wait(event_t *ev, int timeout) {
+    int i, slot, nready, n;
+    uint32_t type;
+
+    nready = poll(ev->fds, ev->nfds, timeout);
+    if(nready <= 0)
+        return nready; /* Return value is -1 on error */
+
+    /* Stop as soon as every ready entry has been seen. The scan starts
+       where the last one stopped so that a full batch does not starve the
+       entries at the end of the array. Whatever doesn't fit is reported
+       again by the next poll() */
+    n = 0;
+    slot = ev->next < ev->nfds ? ev->next : 0;
+    for(i = 0; i < ev->nfds && nready > 0 && n < ev->max_events; i++) {
+        if(ev->fds[slot].revents) {
+            type = ev->fds[slot].revents;
+            if(type & POLLNVAL)
+                type = (type & ~POLLNVAL) | EVENTERR;
+
+            ev->events[n].data = ev->data[slot];
+            ev->events[n].events = type;
+            n++;
+            nready--;
+        }
+
+        if(++slot == ev->nfds)
+            slot = 0;
+    }
+    ev->next = slot;
+
+    return n;
+}
+
+int event_free(event_t *ev) {
+    free(ev->fds);
+    free(ev->data);
+    free(ev->slots);
+    free(ev->events);
+
+    ev->fds = NULL;
+    ev->data = NULL;
+    ev->slots = NULL;
+    ev->events = NULL;
+
+    return 0;
+}
+#endif
@@ -0,0 +1,75 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SERV_POLL_H
+#define _SERV_POLL_H
+
+#ifdef POLL
+#include <poll.h>
+
+#define EVENTRD    POLLIN
+#define EVENTWR    POLLOUT
+#define EVENTHUP   POLLHUP
+#ifdef POLLRDHUP
+#define EVENTRDHUP POLLRDHUP
+#else
+#define EVENTRDHUP (1U<<29) /* Never reported */
+#endif
+#define EVENTERR   POLLERR
+#define EVENTET    (1U<<30) /* Not supported by poll(). The loop's drain
+                               logic still applies */
+#define EVENTEXCL  0 /* Not supported by poll() */
+
+typedef struct {
+    void *data;
+    uint32_t events;
+} event_ready_t;
+
+typedef struct {
+    /* Registered fds, packed at the front of the array so that poll() only
+       sees live entries. data[i] belongs to fds[i] */
+    struct pollfd *fds;
+    void **data;
+    int nfds, szfds;
+
+    /* fd -> index into fds, -1 if the fd is not registered */
+    int *slots;
+    int szslots;
+
+    int max_events;
+    int next;              /* Where the next scan of fds starts */
+    event_ready_t *events; /* Ready batch filled by event_wait() */
+} event_t;
+
+/* Accessors for the i-th entry of the batch returned by event_wait() */
+#define EVENT_DATA(ev, i) ((ev)->events[(i)].data)
+#define EVENT_TYPE(ev, i) ((ev)->events[(i)].events)
+
+int event_init(event_t *ev, int max_events);
+int event_add_fd(event_t *ev, int fd, uint32_t flags, void *data);
+int event_mod_fd(event_t *ev, int fd, uint32_t flags, void *data);
+int event_remove_fd(event_t *ev, int fd);
+int event_wait(event_t *ev, int timeout);
+int event_free(event_t *ev);
+
+#endif
+#endif
@@ -0,0 +1,347 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_loop.h"
+#include "serv_pool.h"
+
+#ifndef _WIN32
+/* Initial size of each worker's deque. Grows as needed */
+#define POOL_DEQUE_SIZE 64
+
+static int deque_push(pool_worker_t *w, pool_work_t *item) {
+    pool_work_t **items;
+    unsigned int i;
+
+    pthread_mutex_lock(&w->lock);
+
+    if(w->count == w->size) {
+        items = malloc(sizeof(pool_work_t *) * w->size * 2);
+        if(items == NULL) {
+            pthread_mutex_unlock(&w->lock);
+            return -1;
+        }
+
+        for(i = 0; i < w->count; i++)
+            items[i] = w->items[(w->head + i) % w->size];
+
+        free(w->items);
+        w->items = items;
+        w->head = 0;
+        w->size *= 2;
+    }
+
+    w->items[(w->head + w->count) % w->size] = item;
+    w->count++;
+
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+/* Oldest first, for the owner and thieves alike. Work comes in round-robin
+   from the loops rather than being spawned by workers, so taking the newest
+   would gain no locality and leave the oldest request waiting behind
+   whatever the owner is busy with */
+static pool_work_t *deque_take(pool_worker_t *w) {
+    pool_work_t *item = NULL;
+
+    pthread_mutex_lock(&w->lock);
+
+    if(w->count) {
+        w->count--;
+        item = w->items[w->head];
+        w->head = (w->head + 1) % w->size;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    return item;
+}
+
+static pool_work_t *pool_take(pool_worker_t *w) {
+    struct _srv_pool *pool = w->pool;
+    pool_work_t *item;
+    int i, victim;
+
+    item = deque_take(w);
+
+    for(i = 1; item == NULL && i < pool->nworkers; i++) {
+        victim = (w->id + i) % pool->nworkers;
+        if(__atomic_load_n(&pool->workers[victim].count, __ATOMIC_RELAXED))
+            item = deque_take(&pool->workers[victim]);
+    }
+
+    if(item)
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+
+    return item;
+}
+
+static void *pool_thread(void *arg) {
+    pool_worker_t *w = arg;
+    struct _srv_pool *pool = w->pool;
+    pool_work_t *item;
+    int stop;
+
+    while(1) {
+        if((item = pool_take(w)) == NULL) {
+            pthread_mutex_lock(&pool->lock);
+
+            /* Submitters check 'idle' after bumping 'pending', so one of
+               the two sides always sees the other */
+            __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+            while(!pool->stop && __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0)
+                pthread_cond_wait(&pool->cond, &pool->lock);
+            __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+
+            stop = pool->stop;
+            pthread_mutex_unlock(&pool->lock);
+
+            if(stop)
+                break;
+            continue;
+        }
+
+        (*(item->work))(item->arg);
+
+        /* Hand the result back to the loop that owns the connection */
+        post_to(item->loop, &item->task);
+    }
+
+    return NULL;
+}
+
+/* Called by srv_run() and srv_run_threads() before the loops start */
+int pool_start(srv_t *ctx) {
+    struct _srv_pool *pool;
+    pool_worker_t *w;
+    int i, status;
+
+    if(ctx->nworkers == 0)
+        return 0;
+
+    pool = calloc(1, sizeof(struct _srv_pool));
+    if(pool == NULL)
+        return -1;
+
+    pool->workers = calloc(ctx->nworkers, sizeof(pool_worker_t));
+    if(pool->workers == NULL) {
+        free(pool);
+        return -1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for(i = 0; i < ctx->nworkers; i++) {
+        w = &pool->workers[i];
+        w->pool = pool;
+        w->id = i;
+        w->size = POOL_DEQUE_SIZE;
+        w->items = malloc(sizeof(pool_work_t *) * w->size);
+        pthread_mutex_init(&w->lock, NULL);
+
+        if(w->items == NULL ||
+                (status = pthread_create(&w->thread, NULL, pool_thread, w)) != 0) {
+            if(w->items == NULL)
+                status = ENOMEM;
+            else
+                free(w->items);
+            pthread_mutex_destroy(&w->lock);
+
+            pool->nworkers = i;
+            ctx->pool = pool;
+            pool_stop(ctx);
+
+            errno = status;
+            return -1;
+        }
+
+        pool->nworkers = i + 1;
+    }
+
+    ctx->pool = pool;
+    return 0;
+}
+
+/* Called once the loops have stopped. Work that has not started yet is
+   dropped without calling its done callback: there is no loop left to run
+   it on */
+void pool_stop(srv_t *ctx) {
+    struct _srv_pool *pool = ctx->pool;
+    pool_worker_t *w;
+    int i;
+
+    if(pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(i = 0; i < pool->nworkers; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    for(i = 0; i < pool->nworkers; i++) {
+        w = &pool->workers[i];
+        while(w->count) {
+            free(w->items[w->head]);
+            w->head = (w->head + 1) % w->size;
+            w->count--;
+        }
+
+        free(w->items);
+        pthread_mutex_destroy(&w->lock);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->workers);
+    free(pool);
+
+    ctx->pool = NULL;
+}
+
+/* Runs on the owning loop once the worker is done */
+static void pool_done(void *arg) {
+    pool_work_t *item = arg;
+    srv_conn *conn;
+
+    conn = conn_resolve(&item->loop->conns, item->handle);
+    if(conn == NULL || !(conn->flags & CONN_OFFLOAD)) {
+        /* Closed while the work was running */
+        conn = NULL;
+    }
+    else {
+        conn->flags &= ~CONN_OFFLOAD;
+
+        /* Resume reading */
+        conn_unhold_read(conn);
+    }
+
+    if(item->done)
+        (*(item->done))(conn, item->arg);
+
+    /* Input that arrived with the offloaded request and is still waiting */
+    if(conn && conn->fd != -1 && IN_MANAGED(conn->ctx) && conn->in_end > conn->in_start)
+        in_deliver(conn);
+}
+
+/* Run work(arg) on the worker pool, then done(conn, arg) back on the loop
+   that owns the connection. Reads on the connection are paused until done
+   is called. If the connection is closed in the meantime, done is called
+   with a NULL connection so that arg can still be released */
+int srv_conn_offload(srv_conn *conn, void (*work)(void *),
+                     void (*done)(srv_conn *, void *), void *arg) {
+    struct _srv_pool *pool;
+    pool_work_t *item;
+    pool_worker_t *w;
+
+    if(!conn || !work || conn->fd == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pool = conn->ctx->pool;
+    if(pool == NULL) {
+        /* srv_set_workers() was not called */
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if(conn->flags & CONN_OFFLOAD) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    item = malloc(sizeof(pool_work_t));
+    if(item == NULL)
+        return -1;
+
+    item->task.fn = pool_done;
+    item->task.conn_fn = NULL;
+    item->task.arg = item;
+    item->task.handle = SRV_HANDLE_NONE;
+    item->work = work;
+    item->done = done;
+    item->arg = arg;
+    item->handle = srv_conn_handle(conn);
+    item->loop = conn->loop;
+
+    conn_hold_read(conn);
+
+    /* Counted before the push so that a worker taking it right away never
+       sees 'pending' go negative */
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+
+    w = &pool->workers[__atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->nworkers];
+    if(deque_push(w, item) == -1) {
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+        conn_unhold_read(conn);
+        free(item);
+        return -1;
+    }
+
+    conn->flags |= CONN_OFFLOAD;
+
+    if(__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return 0;
+}
+#else
+/* TODO: Worker threads on Windows */
+int pool_start(srv_t *ctx) {
+    return 0;
+}
+
+void pool_stop(srv_t *ctx) {
+}
+
+int srv_conn_offload(srv_conn *conn, void (*work)(void *),
+                     void (*done)(srv_conn *, void *), void *arg) {
+    errno = ENOSYS;
+    return -1;
+}
+#endif
+
+/* Number of worker threads started by srv_run() and srv_run_threads() for
+   srv_conn_offload(). 0, the default, starts none */
+int srv_set_workers(srv_t *ctx, int nworkers) {
+    if(!ctx || nworkers < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifdef _WIN32
+    if(nworkers) {
+        errno = ENOSYS;
+        return -1;
+    }
+#endif
+
+    ctx->nworkers = nworkers;
+    return 0;
+}
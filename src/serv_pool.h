@@ -0,0 +1,70 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SERV_POOL_H
+#define _SERV_POOL_H
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+/* A request handed to the worker pool by srv_conn_offload() */
+typedef struct {
+    post_task_t task; /* Must be first: post_run() frees the task */
+    void (*work)(void *);
+    void (*done)(srv_conn *, void *);
+    void *arg;
+    srv_handle_t handle;
+    srv_loop *loop;
+} pool_work_t;
+
+#ifndef _WIN32
+/* Per-worker queue, a ring buffer of pending work. The owner and idle
+   workers stealing from it both take from the front */
+typedef struct {
+    pthread_mutex_t lock;
+    pool_work_t **items;
+    unsigned int head, count, size;
+
+    pthread_t thread;
+    struct _srv_pool *pool;
+    int id;
+} pool_worker_t;
+
+struct _srv_pool {
+    pool_worker_t *workers;
+    int nworkers;
+
+    int pending;   /* Work queued on all deques */
+    int idle;      /* Workers sleeping on 'cond' */
+    int stop;
+    unsigned int next;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+#endif
+
+int pool_start(srv_t *ctx);
+void pool_stop(srv_t *ctx);
+
+#endif
@@ -0,0 +1,307 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_loop.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#else
+#include "serv_tcp.h"
+#endif
+
+#ifndef _WIN32
+int post_init(post_queue_t *q) {
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+    q->signalled = 0;
+    q->more = 0;
+
+#ifdef __linux__
+    q->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(q->fd == -1)
+        return -1;
+    q->fd_write = q->fd;
+#else
+    {
+        int fds[2];
+
+        if(pipe(fds) == -1)
+            return -1;
+
+        srv_setnoblock(fds[0]);
+        srv_setnoblock(fds[1]);
+        q->fd = fds[0];
+        q->fd_write = fds[1];
+    }
+#endif
+
+    return 0;
+}
+
+static void post_push(post_queue_t *q, post_task_t *task) {
+    post_task_t *prev;
+
+    task->next = NULL;
+    prev = __atomic_exchange_n(&q->head, task, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, task, __ATOMIC_RELEASE);
+}
+
+/* Returns NULL if the queue is empty, or if a producer is half way through
+   a push. q->more tells the two apart */
+static post_task_t *post_pop(post_queue_t *q) {
+    post_task_t *tail, *next, *head;
+
+    tail = q->tail;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if(tail == &q->stub) {
+        if(next == NULL)
+            return NULL;
+
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if(next) {
+        q->tail = next;
+        return tail;
+    }
+
+    head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if(tail != head) {
+        /* A push is in progress. Try again on the next iteration */
+        q->more = 1;
+        return NULL;
+    }
+
+    /* 'tail' is the last task. Put the stub behind it so it can be taken */
+    post_push(q, &q->stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if(next) {
+        q->tail = next;
+        return tail;
+    }
+
+    q->more = 1;
+    return NULL;
+}
+
+void post_free(post_queue_t *q) {
+    post_task_t *task;
+
+    while((task = post_pop(q)) != NULL)
+        free(task);
+
+    close(q->fd);
+    if(q->fd_write != q->fd)
+        close(q->fd_write);
+}
+
+static void post_wakeup(post_queue_t *q) {
+    uint64_t one = 1;
+
+    /* Only the first post after a drain writes to the eventfd */
+    if(__atomic_exchange_n(&q->signalled, 1, __ATOMIC_ACQ_REL))
+        return;
+
+#ifdef __linux__
+    write(q->fd_write, &one, sizeof(one));
+#else
+    write(q->fd_write, &one, 1);
+#endif
+}
+
+void post_run(srv_loop *loop) {
+    post_queue_t *q = &loop->post;
+    post_task_t *task;
+    srv_conn *conn;
+    char buf[64];
+    int n;
+
+    /* Reset the eventfd, then allow producers to signal again before
+       looking at the queue so that no post can be missed */
+#ifdef __linux__
+    read(q->fd, buf, sizeof(uint64_t));
+#else
+    while(read(q->fd, buf, sizeof(buf)) > 0)
+        ;
+#endif
+    __atomic_store_n(&q->signalled, 0, __ATOMIC_SEQ_CST);
+
+    q->more = 0;
+    for(n = 0; n < POST_BATCH; n++) {
+        if((task = post_pop(q)) == NULL)
+            return;
+
+        if(task->conn_fn) {
+            /* Skip tasks whose connection has been closed in the meantime */
+            if((conn = conn_resolve(&loop->conns, task->handle)) != NULL)
+                (*(task->conn_fn))(conn, task->arg);
+        }
+        else
+            (*(task->fn))(task->arg);
+
+        free(task);
+    }
+
+    /* Budget exhausted. Let I/O run, then come back */
+    q->more = 1;
+}
+
+int post_to(srv_loop *loop, post_task_t *task) {
+    post_push(&loop->post, task);
+
+    if(loop == loop_current) {
+        /* Posted from the loop itself. No need to wake it up */
+        loop->post.more = 1;
+        return 0;
+    }
+
+    post_wakeup(&loop->post);
+    return 0;
+}
+
+/* Run fn(arg) on one of the loops of ctx. Safe to call from any thread
+   while srv_run() or srv_run_threads() is running. From a loop thread the
+   task goes to that loop, otherwise loops are picked in turn */
+int srv_post(srv_t *ctx, void (*fn)(void *), void *arg) {
+    static unsigned int next_loop = 0;
+    srv_loop *loops, *loop;
+    post_task_t *task;
+    int nloops;
+
+    if(!ctx || !fn) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    loop = loop_current;
+    if(!loop || loop->ctx != ctx) {
+        loops = __atomic_load_n(&ctx->loops, __ATOMIC_ACQUIRE);
+        nloops = ctx->nloops;
+        if(loops == NULL || nloops == 0) {
+            /* Not running */
+            errno = EAGAIN;
+            return -1;
+        }
+
+        loop = &loops[__atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % nloops];
+    }
+
+    task = malloc(sizeof(post_task_t));
+    if(task == NULL)
+        return -1;
+
+    task->fn = fn;
+    task->conn_fn = NULL;
+    task->arg = arg;
+    task->handle = SRV_HANDLE_NONE;
+
+    return post_to(loop, task);
+}
+
+static int post_conn(srv_loop *loop, srv_handle_t h,
+                     void (*fn)(srv_conn *, void *), void *arg) {
+    post_task_t *task;
+
+    task = malloc(sizeof(post_task_t));
+    if(task == NULL)
+        return -1;
+
+    task->fn = NULL;
+    task->conn_fn = fn;
+    task->arg = arg;
+    task->handle = h;
+
+    return post_to(loop, task);
+}
+
+/* Run fn(conn, arg) on the loop that owns the connection. The task is
+   dropped if the connection is closed before it runs. The connection must
+   still be open when this is called; from other threads, where that can't
+   be known, use srv_handle_post() */
+int srv_conn_post(srv_conn *conn, void (*fn)(srv_conn *, void *), void *arg) {
+    if(!conn || !fn || conn->fd == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return post_conn(conn->loop, srv_conn_handle(conn), fn, arg);
+}
+
+/* Run fn(conn, arg) on the loop that owns the handle's connection, if it is
+   still open by then. Safe to call from any thread */
+int srv_handle_post(srv_t *ctx, srv_handle_t h, void (*fn)(srv_conn *, void *), void *arg) {
+    srv_loop *loops;
+
+    if(!ctx || !fn || h == SRV_HANDLE_NONE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    loops = __atomic_load_n(&ctx->loops, __ATOMIC_ACQUIRE);
+    if(loops == NULL) {
+        /* Not running */
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if(HANDLE_LOOP(h) >= ctx->nloops) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return post_conn(&loops[HANDLE_LOOP(h)], h, fn, arg);
+}
+#else
+/* TODO: Wake the loop up with a socket pair */
+int post_init(post_queue_t *q) {
+    q->fd = q->fd_write = -1;
+    q->more = 0;
+    return 0;
+}
+
+void post_free(post_queue_t *q) {
+}
+
+void post_run(srv_loop *loop) {
+}
+
+int srv_post(srv_t *ctx, void (*fn)(void *), void *arg) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int srv_conn_post(srv_conn *conn, void (*fn)(srv_conn *, void *), void *arg) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int srv_handle_post(srv_t *ctx, srv_handle_t h, void (*fn)(srv_conn *, void *), void *arg) {
+    errno = ENOSYS;
+    return -1;
+}
+#endif
@@ -0,0 +1,58 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SERV_POST_H
+#define _SERV_POST_H
+
+/* Tasks handed to a loop by srv_post() and srv_conn_post() */
+typedef struct _post_task {
+    struct _post_task *next;
+    void (*fn)(void *);
+    void (*conn_fn)(srv_conn *, void *);
+    void *arg;
+    srv_handle_t handle; /* Connection conn_fn runs on */
+} post_task_t;
+
+/* Intrusive multi-producer/single-consumer queue (Vyukov). Producers only
+   touch 'head' and 'signalled', the loop only touches the rest, so the two
+   sides are kept on separate cache lines */
+typedef struct {
+    post_task_t *head;
+    int signalled; /* The loop has been woken and has not drained yet */
+    char pad[64];
+
+    post_task_t *tail;
+    post_task_t stub;
+    int more;      /* Tasks are left over for the next iteration */
+    int fd;        /* eventfd (or pipe read end) registered with the loop */
+    int fd_write;
+} post_queue_t;
+
+/* Tasks run per wakeup before the loop goes back to I/O */
+#define POST_BATCH 1024
+
+int post_init(post_queue_t *q);
+void post_free(post_queue_t *q);
+void post_run(srv_loop *loop);
+int post_to(srv_loop *loop, post_task_t *task);
+
+#endif
@@ -0,0 +1,330 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_loop.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+
+/* Proxy mode. srv_proxy() hands two connections over to the loop, which
+   moves bytes between them with splice() through a pipe per direction, so
+   nothing is copied to user space. Reads from a side stop while the pipe
+   towards the other side is full and resume once it drains, so a slow
+   peer holds back a fast one instead of growing buffers. A half-close is
+   passed on once everything before it has been delivered. When both
+   directions are closed, or either side fails, both connections are
+   closed and the done callback gets the byte counts */
+
+static void proxy_end(proxy_state_t *p, int err) {
+    srv_conn *conn;
+    int i;
+
+    p->stats.error = err;
+
+    for(i = 0; i < 2; i++) {
+        if((conn = p->conn[i]) == NULL)
+            continue;
+
+        conn->proxy = NULL;
+        conn->flags &= ~CONN_PROXY;
+        if(conn->fd != -1)
+            srv_close(conn);
+    }
+
+    for(i = 0; i < 2; i++) {
+        close(p->dir[i].pipe[0]);
+        close(p->dir[i].pipe[1]);
+    }
+
+    if(p->done)
+        (*(p->done))(&p->stats, p->arg);
+
+    free(p);
+}
+
+/* Move what has arrived on conn[d] towards conn[!d]. Returns 0, or -1 with
+   errno set if either side failed */
+static int proxy_move(proxy_state_t *p, int d) {
+    proxy_dir_t *pd = &p->dir[d];
+    srv_conn *src = p->conn[d], *dst = p->conn[!d];
+    unsigned long long *bytes = d ? &p->stats.b_to_a : &p->stats.a_to_b;
+    int i, progress;
+    ssize_t n;
+
+    /* Output queued before the proxy started goes first */
+    if(dst->out_head && out_flush(dst) == -1)
+        return -1;
+
+    for(i = 0; i < PROXY_ROUNDS; i++) {
+        progress = 0;
+
+        if(!pd->eof && pd->inpipe < pd->cap) {
+            n = splice(src->fd, NULL, pd->pipe[1], NULL, pd->cap - pd->inpipe,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(n > 0) {
+                pd->inpipe += n;
+                progress = 1;
+            }
+            else if(n == 0)
+                pd->eof = 1;
+            else if(errno == EAGAIN) {
+                /* Either the socket is dry or the pipe ran out of slots
+                   before bytes, which small segments can cause */
+                pd->full = pd->inpipe > 0;
+            }
+            else if(errno != EINTR)
+                return -1;
+        }
+
+        if(pd->inpipe && !dst->out_head) {
+            n = splice(pd->pipe[0], NULL, dst->fd, NULL, pd->inpipe,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(n > 0) {
+                pd->inpipe -= n;
+                pd->full = 0;
+                *bytes += n;
+                progress = 1;
+            }
+            else if(n == -1 && errno != EAGAIN && errno != EINTR)
+                return -1;
+        }
+
+        if(!progress)
+            break;
+    }
+
+    if(pd->eof && !pd->inpipe && !dst->out_head && !pd->shut) {
+        if(shutdown(dst->fd, SHUT_WR) == -1 && errno != ENOTCONN)
+            return -1;
+        pd->shut = 1;
+    }
+
+    return 0;
+}
+
+/* Ask for reads while the pipe out of a side has room, and for writes
+   while the pipe into it holds something */
+static int proxy_arm(proxy_state_t *p, int side) {
+    srv_conn *conn = p->conn[side];
+    proxy_dir_t *out = &p->dir[side], *in = &p->dir[!side];
+    unsigned int want = 0;
+
+    if(p->parked[side])
+        return 0;
+
+    if(!out->eof && !out->full && out->inpipe < out->cap)
+        want |= EVENTRD;
+    if(in->inpipe || conn->out_head)
+        want |= EVENTWR;
+
+    /* The pump is level-triggered, whatever the connection was before */
+    conn->flags &= ~(CONN_WRAUTO | CONN_EDGE);
+    if(want == conn->events)
+        return 0;
+
+    if(event_mod_fd(&conn->loop->ev, conn->fd, want, conn) == -1)
+        return -1;
+
+    conn->events = want;
+    return 0;
+}
+
+static void proxy_pump(proxy_state_t *p) {
+    if(proxy_move(p, 0) == -1 || proxy_move(p, 1) == -1) {
+        proxy_end(p, errno);
+        return;
+    }
+
+    if(p->dir[0].shut && p->dir[1].shut) {
+        proxy_end(p, 0);
+        return;
+    }
+
+    if(proxy_arm(p, 0) == -1 || proxy_arm(p, 1) == -1)
+        proxy_end(p, errno);
+}
+
+/* Events of a proxied connection. A hang-up or an error that the pump
+   doesn't resolve into a clean close ends the pair */
+void proxy_event(srv_conn *conn, unsigned int event_type) {
+    proxy_state_t *p = conn->proxy;
+    int err = 0, side;
+    socklen_t len = sizeof(err);
+
+    proxy_pump(p);
+
+    if(conn->proxy != p || !(event_type & (EVENTERR | EVENTHUP)))
+        return;
+
+    side = p->conn[1] == conn;
+    if(!(event_type & EVENTERR) && p->dir[!side].shut) {
+        /* Closed both ways at conn, expectedly, but with input left that
+           the other side hasn't taken yet. Hang-ups would be reported
+           until then, so stop listening. The rest is read whenever the
+           other side drains */
+        if(!p->parked[side]) {
+            event_remove_fd(&conn->loop->ev, conn->fd);
+            conn->events = 0;
+            p->parked[side] = 1;
+        }
+        return;
+    }
+
+    if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err == 0)
+        err = ECONNRESET;
+    proxy_end(p, err);
+}
+
+/* A proxied connection is being closed from outside the proxy, e.g. by its
+   idle timeout. Its partner goes with it */
+void proxy_close(srv_conn *conn) {
+    proxy_state_t *p = conn->proxy;
+
+    conn->proxy = NULL;
+    conn->flags &= ~CONN_PROXY;
+    p->conn[p->conn[1] == conn] = NULL;
+
+    proxy_end(p, ECONNABORTED);
+}
+
+static int proxy_pipe(proxy_dir_t *pd) {
+    int size;
+
+    if(pipe2(pd->pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+        return -1;
+
+    /* Bigger pipes mean fewer trips through the loop. The size is capped
+       by fs.pipe-max-size, so take what we get */
+    fcntl(pd->pipe[1], F_SETPIPE_SZ, PROXY_PIPE);
+    size = fcntl(pd->pipe[1], F_GETPIPE_SZ);
+    pd->cap = size > 0 ? (size_t) size : 65536;
+    return 0;
+}
+
+/* Join a and b: from now on the loop forwards whatever either of them
+   receives to the other, inside the kernel. Input already read into a's or
+   b's buffer, and output already queued, goes first. The application's
+   handlers are no longer called for either connection. Both are closed
+   once both directions have been shut down or either side fails, after
+   which done gets the byte counts. Like srv_splice(), this writes with
+   splice(), so SIGPIPE should be ignored. Returns 0 or -1, in which case
+   both connections are left as they were */
+int srv_proxy(srv_conn *a, srv_conn *b, void (*done)(const srv_proxy_stats *, void *), void *arg) {
+    proxy_state_t *p;
+    out_seg_t *copy[2] = {NULL, NULL};
+    srv_conn *src;
+    int i, status;
+
+    if(!a || !b || a == b || a->fd == -1 || b->fd == -1 || a->loop != b->loop ||
+            a->proxy || b->proxy ||
+            ((a->flags | b->flags) & (CONN_CONNECTING | CONN_IDLE | CONN_OFFLOAD))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    p = calloc(1, sizeof(proxy_state_t));
+    if(p == NULL)
+        return -1;
+
+    p->dir[0].pipe[0] = p->dir[0].pipe[1] = -1;
+    p->dir[1].pipe[0] = p->dir[1].pipe[1] = -1;
+    if(proxy_pipe(&p->dir[0]) == -1 || proxy_pipe(&p->dir[1]) == -1)
+        goto err;
+
+    p->conn[0] = a;
+    p->conn[1] = b;
+    p->done = done;
+    p->arg = arg;
+
+    /* Input the library has buffered already. Both copies are made before
+       either is queued, so a failure leaves nothing behind */
+    for(i = 0; i < 2; i++) {
+        src = p->conn[i];
+        if(src->in_end > src->in_start &&
+                (copy[i] = out_copy(p->conn[!i], src->in_buf + src->in_start,
+                                    src->in_end - src->in_start)) == NULL)
+            goto err;
+    }
+
+    /* Joined before queueing, output of a proxied connection never holds
+       reads */
+    a->proxy = b->proxy = p;
+    a->flags |= CONN_PROXY;
+    b->flags |= CONN_PROXY;
+
+    for(i = 0; i < 2; i++) {
+        src = p->conn[i];
+        if(copy[i])
+            out_append(p->conn[!i], copy[i]);
+        if(i)
+            p->stats.b_to_a += src->in_end - src->in_start;
+        else
+            p->stats.a_to_b += src->in_end - src->in_start;
+        in_free(src);
+    }
+
+    proxy_pump(p);
+    return 0;
+
+err:
+    status = errno;
+    for(i = 0; i < 2; i++) {
+        if(copy[i])
+            out_release(p->conn[!i], copy[i]);
+        if(p->dir[i].pipe[0] != -1) {
+            close(p->dir[i].pipe[0]);
+            close(p->dir[i].pipe[1]);
+        }
+    }
+    free(p);
+    errno = status;
+    return -1;
+}
+
+int srv_proxy_get_stats(srv_conn *conn, srv_proxy_stats *stats) {
+    if(!conn || !conn->proxy || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *stats = conn->proxy->stats;
+    return 0;
+}
+#else
+void proxy_event(srv_conn *conn, unsigned int event_type) {
+}
+
+void proxy_close(srv_conn *conn) {
+}
+
+/* TODO: A read()/write() fallback for systems without splice() */
+int srv_proxy(srv_conn *a, srv_conn *b, void (*done)(const srv_proxy_stats *, void *), void *arg) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int srv_proxy_get_stats(srv_conn *conn, srv_proxy_stats *stats) {
+    errno = ENOSYS;
+    return -1;
+}
+#endif
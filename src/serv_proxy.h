@@ -0,0 +1,53 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SERV_PROXY_H
+#define _SERV_PROXY_H
+
+#define PROXY_PIPE   (256 << 10) /* Pipe size asked for, per direction */
+#define PROXY_ROUNDS 8           /* Pipe refills per direction and event */
+
+/* One direction of a proxied pair */
+typedef struct {
+    int pipe[2];
+    size_t inpipe; /* Bytes spliced in and not yet out */
+    size_t cap;    /* Capacity of the pipe */
+    int full;      /* The pipe took no more, reads wait until it drains */
+    int eof;       /* The source has half-closed */
+    int shut;      /* Its FIN has been passed on to the destination */
+} proxy_dir_t;
+
+/* Two connections joined by srv_proxy(). dir[i] moves what conn[i]
+   receives to conn[!i] */
+typedef struct _proxy_state {
+    srv_conn *conn[2];
+    proxy_dir_t dir[2];
+    int parked[2]; /* conn[i] hung up and was taken off the event set */
+    srv_proxy_stats stats;
+    void (*done)(const srv_proxy_stats *, void *);
+    void *arg;
+} proxy_state_t;
+
+void proxy_event(srv_conn *conn, unsigned int event_type);
+void proxy_close(srv_conn *conn);
+
+#endif
@@ -0,0 +1,498 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_loop.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+/* Name resolution cache shared by every srv_t in the process, so that
+   srv_connect(), which has no srv_t, uses it too. getaddrinfo() reports no
+   TTL, so answers are kept for a fixed time, see srv_set_resolve_cache().
+   Failures are kept for RESOLVE_NEG_TTL ms so that a dead name isn't
+   looked up on every connect.
+
+   Lookups run on up to RESOLVE_THREADS threads, started on demand and gone
+   again after RESOLVE_IDLE ms without work. Their answers go back to the
+   loops that asked through the post queue. Callers asking for a name that
+   is being looked up join that lookup instead of starting another */
+
+#ifdef _WIN32
+static SRWLOCK resolve_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE resolve_done = CONDITION_VARIABLE_INIT;
+#define RESOLVE_LOCK()   AcquireSRWLockExclusive(&resolve_lock)
+#define RESOLVE_UNLOCK() ReleaseSRWLockExclusive(&resolve_lock)
+#define RESOLVE_WAIT()   SleepConditionVariableSRW(&resolve_done, &resolve_lock, INFINITE, 0)
+#define RESOLVE_WAKE()   WakeAllConditionVariable(&resolve_done)
+#else
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_done = PTHREAD_COND_INITIALIZER; /* For resolve_sync() */
+static pthread_cond_t resolve_work = PTHREAD_COND_INITIALIZER; /* For idle threads */
+#define RESOLVE_LOCK()   pthread_mutex_lock(&resolve_lock)
+#define RESOLVE_UNLOCK() pthread_mutex_unlock(&resolve_lock)
+#define RESOLVE_WAIT()   pthread_cond_wait(&resolve_done, &resolve_lock)
+#define RESOLVE_WAKE()   pthread_cond_broadcast(&resolve_done)
+#endif
+
+static resolve_entry_t *resolve_buckets[RESOLVE_BUCKETS];
+static resolve_entry_t resolve_lru = { /* Sentinel */
+    NULL, &resolve_lru, &resolve_lru, NULL, 0, NULL, NULL, {0}, 0, 0, 0, 0, NULL
+};
+static resolve_entry_t *resolve_queue, *resolve_queue_tail;
+static int resolve_count, resolve_max = 1024;
+static unsigned int resolve_ttl = 60000;
+static int resolve_threads, resolve_idle;
+static srv_resolve_stats resolve_stats;
+
+static unsigned int resolve_hash(const char *host, const char *port) {
+    unsigned int h = 2166136261U; /* FNV-1a */
+
+    while(*host)
+        h = (h ^ (unsigned char) *host++) * 16777619U;
+    h = (h ^ ':') * 16777619U;
+    while(*port)
+        h = (h ^ (unsigned char) *port++) * 16777619U;
+    return h;
+}
+
+static resolve_entry_t *resolve_find(const char *host, const char *port, unsigned int hash) {
+    resolve_entry_t *e;
+
+    for(e = resolve_buckets[hash & (RESOLVE_BUCKETS - 1)]; e; e = e->hnext) {
+        if(e->hash == hash && strcmp(e->name, host) == 0 && strcmp(e->port, port) == 0)
+            return e;
+    }
+
+    return NULL;
+}
+
+static void resolve_link(resolve_entry_t *e) {
+    e->next = resolve_lru.next;
+    e->prev = &resolve_lru;
+    resolve_lru.next->prev = e;
+    resolve_lru.next = e;
+}
+
+static void resolve_touch(resolve_entry_t *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    resolve_link(e);
+}
+
+static void resolve_remove(resolve_entry_t *e) {
+    resolve_entry_t **p;
+
+    p = &resolve_buckets[e->hash & (RESOLVE_BUCKETS - 1)];
+    while(*p != e)
+        p = &(*p)->hnext;
+    *p = e->hnext;
+
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    resolve_count--;
+    free(e->name);
+    free(e);
+}
+
+/* Make room for one more, least recently used first. Entries with a lookup
+   in flight stay */
+static void resolve_evict(int max) {
+    resolve_entry_t *e, *prev;
+
+    for(e = resolve_lru.prev; e != &resolve_lru && resolve_count > max; e = prev) {
+        prev = e->prev;
+        if(!e->pending)
+            resolve_remove(e);
+    }
+}
+
+static resolve_entry_t *resolve_add(const char *host, const char *port, unsigned int hash) {
+    resolve_entry_t *e;
+    size_t hlen = strlen(host), plen = strlen(port);
+
+    resolve_evict(resolve_max - 1);
+
+    e = calloc(1, sizeof(resolve_entry_t));
+    if(e == NULL)
+        return NULL;
+
+    e->name = malloc(hlen + plen + 2);
+    if(e->name == NULL) {
+        free(e);
+        return NULL;
+    }
+    memcpy(e->name, host, hlen + 1);
+    e->port = e->name + hlen + 1;
+    memcpy(e->port, port, plen + 1);
+    e->hash = hash;
+
+    e->hnext = resolve_buckets[hash & (RESOLVE_BUCKETS - 1)];
+    resolve_buckets[hash & (RESOLVE_BUCKETS - 1)] = e;
+    resolve_link(e);
+    resolve_count++;
+    return e;
+}
+
+/* The lookup itself. Returns 0 or an errno value: ENOENT for a name that
+   doesn't exist, EINVAL for an unknown service, EAFNOSUPPORT, EAGAIN and
+   ENOMEM for their EAI_ counterparts, EHOSTUNREACH for anything else.
+   Only the address is cached, so any socket type will do. Datagram
+   listeners resolve their host here too, and a service known for UDP
+   only must not fail */
+static int resolve_lookup(const char *host, const char *port,
+                          struct sockaddr_storage *addr, socklen_t *addrlen) {
+    struct addrinfo hints, *ai;
+    int status;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = 0;
+
+    status = getaddrinfo(host, port, &hints, &ai);
+    if(status != 0) {
+        switch(status) {
+        case EAI_NONAME:  return ENOENT;
+#if defined(EAI_NODATA) && EAI_NODATA != EAI_NONAME
+        case EAI_NODATA:  return ENOENT;
+#endif
+        case EAI_SERVICE: return EINVAL;
+        case EAI_FAMILY:  return EAFNOSUPPORT;
+        case EAI_AGAIN:   return EAGAIN;
+        case EAI_MEMORY:  return ENOMEM;
+#ifdef EAI_SYSTEM
+        case EAI_SYSTEM:  return errno ? errno : EIO;
+#endif
+        default:          return EHOSTUNREACH;
+        }
+    }
+
+    memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+    *addrlen = ai->ai_addrlen;
+    freeaddrinfo(ai);
+    return 0;
+}
+
+/* Store the answer and send it to everyone waiting. Called locked */
+static void resolve_finish(resolve_entry_t *e, struct sockaddr_storage *addr,
+                           socklen_t addrlen, int err) {
+    resolve_wait_t *w;
+    unsigned int ttl;
+
+    e->err = err;
+    if(err == 0) {
+        memcpy(&e->addr, addr, addrlen);
+        e->addrlen = addrlen;
+    }
+    else
+        resolve_stats.failures++;
+
+    ttl = err && resolve_ttl > RESOLVE_NEG_TTL ? RESOLVE_NEG_TTL : resolve_ttl;
+    e->expires = srv_clock_ms() + ttl;
+    e->pending = 0;
+
+    while((w = e->waiters) != NULL) {
+        e->waiters = w->next;
+        w->err = err;
+        w->addrlen = e->addrlen;
+        if(err == 0)
+            memcpy(&w->addr, &e->addr, e->addrlen);
+        post_to(w->loop, &w->task);
+    }
+
+    RESOLVE_WAKE();
+}
+
+/* Run a queued lookup. Called locked, returns locked */
+static void resolve_run(resolve_entry_t *e) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = 0;
+    int err;
+
+    RESOLVE_UNLOCK();
+    err = resolve_lookup(e->name, e->port, &addr, &addrlen);
+    RESOLVE_LOCK();
+
+    resolve_finish(e, &addr, addrlen, err);
+}
+
+static resolve_entry_t *resolve_dequeue(void) {
+    resolve_entry_t *e = resolve_queue;
+
+    if(e) {
+        resolve_queue = e->qnext;
+        if(resolve_queue == NULL)
+            resolve_queue_tail = NULL;
+        e->qnext = NULL;
+    }
+
+    return e;
+}
+
+#ifndef _WIN32
+static void *resolve_thread(void *arg) {
+    struct timespec ts;
+    resolve_entry_t *e;
+
+    (void) arg;
+
+    RESOLVE_LOCK();
+    for(;;) {
+        if((e = resolve_dequeue()) != NULL) {
+            resolve_run(e);
+            continue;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += RESOLVE_IDLE / 1000;
+
+        resolve_idle++;
+        if(pthread_cond_timedwait(&resolve_work, &resolve_lock, &ts) == ETIMEDOUT &&
+                resolve_queue == NULL) {
+            resolve_idle--;
+            break;
+        }
+        resolve_idle--;
+    }
+    resolve_threads--;
+    RESOLVE_UNLOCK();
+
+    return NULL;
+}
+#endif
+
+/* Queue a lookup and make sure a thread picks it up. Called locked */
+static void resolve_queue_lookup(resolve_entry_t *e) {
+    e->pending = 1;
+    if(resolve_queue_tail)
+        resolve_queue_tail->qnext = e;
+    else
+        resolve_queue = e;
+    resolve_queue_tail = e;
+
+#ifndef _WIN32
+    {
+        pthread_attr_t attr;
+        pthread_t thread;
+
+        if(resolve_idle > 0) {
+            pthread_cond_signal(&resolve_work);
+            return;
+        }
+
+        if(resolve_threads < RESOLVE_THREADS) {
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            if(pthread_create(&thread, &attr, resolve_thread, NULL) == 0)
+                resolve_threads++;
+            pthread_attr_destroy(&attr);
+        }
+
+        if(resolve_threads > 0)
+            return;
+    }
+#endif
+
+    /* No thread to run it. Block the caller rather than never answer */
+    while((e = resolve_dequeue()) != NULL)
+        resolve_run(e);
+}
+
+static void resolve_deliver(void *arg) {
+    resolve_wait_t *w = (resolve_wait_t *) arg;
+
+    (*(w->cb))(w->err ? NULL : (struct sockaddr *) &w->addr, w->addrlen, w->err, w->arg);
+}
+
+/* Resolve host and port for the calling loop of ctx. cb gets the address,
+   or NULL and an errno value. A cached answer is passed to cb before
+   srv_resolve() returns, otherwise cb runs on the loop once the lookup is
+   done. Returns 0, or -1 if cb won't be called */
+int srv_resolve(srv_t *ctx, const char *host, const char *port,
+                void (*cb)(const struct sockaddr *, socklen_t, int, void *), void *arg) {
+    srv_loop *loop = loop_current;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    resolve_entry_t *e;
+    resolve_wait_t *w;
+    unsigned int hash;
+    int err;
+
+    if(!ctx || !host || !port || !cb || !loop || loop->ctx != ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    hash = resolve_hash(host, port);
+
+    RESOLVE_LOCK();
+    e = resolve_find(host, port, hash);
+    if(e && !e->pending && srv_clock_ms() < e->expires) {
+        resolve_stats.hits++;
+        resolve_touch(e);
+        err = e->err;
+        addrlen = e->addrlen;
+        memcpy(&addr, &e->addr, addrlen);
+        RESOLVE_UNLOCK();
+
+        (*cb)(err ? NULL : (struct sockaddr *) &addr, addrlen, err, arg);
+        return 0;
+    }
+
+    w = (resolve_wait_t *) malloc(sizeof(resolve_wait_t));
+    if(w == NULL) {
+        RESOLVE_UNLOCK();
+        return -1;
+    }
+    memset(&w->task, 0, sizeof(w->task));
+    w->task.fn = resolve_deliver;
+    w->task.arg = w;
+    w->loop = loop;
+    w->cb = cb;
+    w->arg = arg;
+
+    if(e && e->pending) {
+        resolve_stats.coalesced++;
+    }
+    else {
+        resolve_stats.misses++;
+        if(e == NULL && (e = resolve_add(host, port, hash)) == NULL) {
+            RESOLVE_UNLOCK();
+            free(w);
+            return -1;
+        }
+        resolve_touch(e);
+    }
+
+    w->next = e->waiters;
+    e->waiters = w;
+    if(!e->pending)
+        resolve_queue_lookup(e);
+    RESOLVE_UNLOCK();
+
+    return 0;
+}
+
+/* Blocking resolve through the cache, for callers that are allowed to
+   block: srv_connect() and listener setup. Returns 0, or -1 with errno
+   set */
+int resolve_sync(const char *host, const char *port,
+                 struct sockaddr_storage *addr, socklen_t *addrlen) {
+    resolve_entry_t *e;
+    unsigned int hash;
+    int err, joined = 0;
+
+    hash = resolve_hash(host, port);
+
+    RESOLVE_LOCK();
+    for(;;) {
+        e = resolve_find(host, port, hash);
+        if(e && !e->pending && (joined || srv_clock_ms() < e->expires)) {
+            if(!joined)
+                resolve_stats.hits++;
+            resolve_touch(e);
+            err = e->err;
+            *addrlen = e->addrlen;
+            memcpy(addr, &e->addr, e->addrlen);
+            RESOLVE_UNLOCK();
+            break;
+        }
+
+        if(e && e->pending) {
+            /* Somebody else is on it */
+            if(!joined)
+                resolve_stats.coalesced++;
+            joined = 1;
+            RESOLVE_WAIT();
+            continue;
+        }
+
+        /* Look it up on this thread, it blocks anyway */
+        resolve_stats.misses++;
+        if(e == NULL && (e = resolve_add(host, port, hash)) == NULL) {
+            RESOLVE_UNLOCK();
+            return -1;
+        }
+        resolve_touch(e);
+        e->pending = 1;
+        resolve_run(e);
+        joined = 1;
+    }
+
+    if(err) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Drop the lookups a stopping loop is waiting for, so that nothing is
+   posted to it afterwards */
+void resolve_cancel(srv_loop *loop) {
+    resolve_entry_t *e;
+    resolve_wait_t **p, *w;
+
+    RESOLVE_LOCK();
+    for(e = resolve_lru.next; e != &resolve_lru; e = e->next) {
+        p = &e->waiters;
+        while((w = *p) != NULL) {
+            if(w->loop == loop) {
+                *p = w->next;
+                free(w);
+            }
+            else
+                p = &w->next;
+        }
+    }
+    RESOLVE_UNLOCK();
+}
+
+/* How long answers are cached in ms, and how many names are kept. A ttl of
+   0 caches nothing, concurrent lookups of a name are still joined */
+int srv_set_resolve_cache(unsigned int ttl, int max) {
+    if(max < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    RESOLVE_LOCK();
+    resolve_ttl = ttl;
+    resolve_max = max;
+    resolve_evict(max);
+    RESOLVE_UNLOCK();
+    return 0;
+}
+
+int srv_get_resolve_stats(srv_resolve_stats *stats) {
+    if(!stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    RESOLVE_LOCK();
+    *stats = resolve_stats;
+    stats->entries = resolve_count;
+    RESOLVE_UNLOCK();
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SERV_RESOLVE_H
+#define _SERV_RESOLVE_H
+
+#define RESOLVE_BUCKETS 256   /* Hash buckets, a power of two */
+#define RESOLVE_THREADS 2     /* Lookups running at once */
+#define RESOLVE_IDLE    10000 /* ms an idle lookup thread waits before it exits */
+#define RESOLVE_NEG_TTL 1000  /* ms a failed lookup is remembered */
+
+/* A srv_resolve() waiting for a lookup. Goes back to its loop as a post
+   task once the lookup is done */
+typedef struct _resolve_wait {
+    post_task_t task; /* Must be first: post_run() frees the task */
+    struct _resolve_wait *next;
+    srv_loop *loop;
+    void (*cb)(const struct sockaddr *, socklen_t, int, void *);
+    void *arg;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int err;
+} resolve_wait_t;
+
+/* A cached name. host and port are stored back to back in name */
+typedef struct _resolve_entry {
+    struct _resolve_entry *hnext;       /* Hash chain */
+    struct _resolve_entry *prev, *next; /* LRU list, most recently used first */
+    struct _resolve_entry *qnext;       /* Queue of lookups to run */
+    unsigned int hash;
+    char *name, *port;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int err;          /* errno value of a failed lookup, or 0 */
+    uint64_t expires;
+    int pending;      /* Lookup in flight, the entry must stay */
+    resolve_wait_t *waiters;
+} resolve_entry_t;
+
+int resolve_sync(const char *host, const char *port,
+                 struct sockaddr_storage *addr, socklen_t *addrlen);
+void resolve_cancel(srv_loop *loop);
+
+#endif
@@ -33,13 +33,17 @@ int event_init(event_t *ev, int max_events) {
     FD_ZERO(&(ev->fds_write));
 
     ev->fdmax = 0;
-    ev->nfds = 0;
-    ev->fd_index = 0;
+    ev->max_events = max_events;
+    memset(ev->data, 0, sizeof(ev->data));
+
+    ev->events = calloc(max_events, sizeof(event_ready_t));
+    if(ev->events == NULL)
+        return -1;
 
     return 0;
 }
 
-int event_add_fd(event_t *ev, int fd, uint32_t flags) {
+int event_add_fd(event_t *ev, int fd, uint32_t flags, void *data) {
     if(fd >= FD_SETSIZE) {
         errno = ENOSPC; /* fd set is full */
         return -1;
@@ -55,6 +59,8 @@ int event_add_fd(event_t *ev, int fd, uint32_t flags) {
         FD_SET(fd, &(ev->fds_write_master));
     }
 
+    ev->data[fd] = data;
+
     /* Update fdmax */
     if(fd > ev->fdmax)
         ev->fdmax = fd;
@@ -62,7 +68,12 @@ int event_add_fd(event_t *ev, int fd, uint32_t flags) {
     return 0;
 }
 
-int event_mod_fd(event_t *ev, int fd, uint32_t flags) {
+int event_mod_fd(event_t *ev, int fd, uint32_t flags, void *data) {
+    if(fd >= FD_SETSIZE) {
+        errno = EBADF;
+        return -1;
+    }
+
     if(flags & EVENTRD) {
         /* Add the fd to the read fd_set */
         FD_SET(fd, &(ev->fds_read_master));
@@ -81,83 +92,75 @@ int event_mod_fd(event_t *ev, int fd, uint32_t flags) {
         FD_CLR(fd, &(ev->fds_write_master));
     }
 
+    ev->data[fd] = data;
+
     return 0;
 }
 
 int event_remove_fd(event_t *ev, int fd) {
+    if(fd >= FD_SETSIZE) {
+        errno = EBADF;
+        return -1;
+    }
+
     /* Remove from all fd sets */
     FD_CLR(fd, &(ev->fds_read_master));
     FD_CLR(fd, &(ev->fds_write_master));
-    FD_CLR(fd, &(ev->fds_read));
-    FD_CLR(fd, &(ev->fds_write));
+    ev->data[fd] = NULL;
 
     /* Update fdmax */
-    if(fd == ev->fdmax) {
+    while(ev->fdmax > 0 && !FD_ISSET(ev->fdmax, &(ev->fds_read_master))
+            && !FD_ISSET(ev->fdmax, &(ev->fds_write_master)))
         ev->fdmax--;
 
-        /* The fd that is being handled has just been removed. All the previous
-fds have already been handled */
-        if(fd == ev->fd_index)
-            ev->nfds = 0;
-    }
-
     return 0;
 }
 
-int event_wait(event_t *ev, int *event_fd, int *event_type) {
-    if(ev->nfds == 0) {
-        /* All events processed so far. Wait for new events */
-        ev->fds_read = ev->fds_read_master;
-        ev->fds_write = ev->fds_write_master;
-        ev->fd_index = 0;
+int event_wait(event_t *ev, int timeout) {
+    int fd, nfds, n;
+    uint32_t type;
+    struct timeval tv;
 
-        ev->nfds = select(ev->fdmax + 1, &(ev->fds_read),
-                          &(ev->fds_write), NULL, NULL);
-    }
+    ev->fds_read = ev->fds_read_master;
+    ev->fds_write = ev->fds_write_master;
 
-    if(ev->nfds == -1) {
-        /* An error occured */
-        *event_type = EVENTERR;
-        ev->nfds = 0;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
 
-        return -1;
-    }
-    else if(ev->nfds == 0) {
-        /* No events waiting to be processed */
-        *event_type = 0;
-
-        return 0;
-    }
+    nfds = select(ev->fdmax + 1, &(ev->fds_read), &(ev->fds_write), NULL,
+                  timeout < 0 ? NULL : &tv);
+    if(nfds <= 0)
+        return nfds; /* Return value is -1 on error */
 
-    /* Find the next ready fd */
-    for(;(ev->fd_index <= ev->fdmax) && (ev->nfds > 0); ev->fd_index++) {
-        *event_type = 0;
-        if(FD_ISSET(ev->fd_index, &(ev->fds_read))) {
+    /* Collect the ready fds into the batch. Whatever doesn't fit is reported
+       again by the next select() */
+    n = 0;
+    for(fd = 0; fd <= ev->fdmax && nfds > 0 && n < ev->max_events; fd++) {
+        type = 0;
+        if(FD_ISSET(fd, &(ev->fds_read))) {
             /* fd ready for read */
-            *event_fd = ev->fd_index;
-            *event_type |= EVENTRD;
-            ev->nfds--;
-            FD_CLR(ev->fd_index, &(ev->fds_read));
+            type |= EVENTRD;
+            nfds--;
         }
 
-        if(FD_ISSET(ev->fd_index, &(ev->fds_write))) {
+        if(FD_ISSET(fd, &(ev->fds_write))) {
             /* fd ready for write */
-            *event_fd = ev->fd_index;
-            *event_type |= EVENTWR;
-            ev->nfds--;
+            type |= EVENTWR;
+            nfds--;
         }
 
-        if(*event_type) {
-            /* TODO: Notify the caller about the event */
-            break;
+        if(type) {
+            ev->events[n].data = ev->data[fd];
+            ev->events[n].events = type;
+            n++;
         }
     }
 
-    return ev->nfds;
+    return n;
 }
 
 int event_free(event_t *ev) {
-    /* Nothing to free */
+    free(ev->events);
     return 0;
 }
 #endif
@@ -29,17 +29,32 @@
 #define EVENTHUP    4
 #define EVENTRDHUP  8
 #define EVENTERR   16
+#define EVENTET    32 /* Not supported by select(). The loop's drain logic
+                         still applies */
+#define EVENTEXCL   0 /* Not supported by select() */
+
+typedef struct {
+    void *data;
+    uint32_t events;
+} event_ready_t;
 
 typedef struct {
     fd_set fds_read_master, fds_read, fds_write_master, fds_write;
-    int fdmax, nfds, fd_index;
+    int fdmax, max_events;
+
+    void *data[FD_SETSIZE]; /* User data registered with each fd */
+    event_ready_t *events;  /* Ready batch filled by event_wait() */
 } event_t;
 
+/* Accessors for the i-th entry of the batch returned by event_wait() */
+#define EVENT_DATA(ev, i) ((ev)->events[(i)].data)
+#define EVENT_TYPE(ev, i) ((ev)->events[(i)].events)
+
 int event_init(event_t *ev, int max_events);
-int event_add_fd(event_t *ev, int fd, uint32_t flags);
-int event_mod_fd(event_t *ev, int fd, uint32_t flags);
+int event_add_fd(event_t *ev, int fd, uint32_t flags, void *data);
+int event_mod_fd(event_t *ev, int fd, uint32_t flags, void *data);
 int event_remove_fd(event_t *ev, int fd);
-int event_wait(event_t *ev, int *event_fd, int *event_type);
+int event_wait(event_t *ev, int timeout);
 int event_free(event_t *ev);
 
 #endif
@@ -22,6 +22,7 @@ SOFTWARE.
 
 #include "serv_internal.h"
 #include "serv_tcp.h"
+#include "serv_loop.h"
 
 #ifdef _WIN32
 int read(int fd, char *buffer, int size) {
@@ -46,25 +47,45 @@ int srv_setnoblock(int fd) {
 #endif
 }
 
-int srv_tcp_create_listener(srv_t *ctx) {
-    int status, fd, reuse_addr;
+/* The wildcard address for port */
+static int tcp_any_addr(const char *port, int socktype,
+                        struct sockaddr_storage *addr, socklen_t *addrlen) {
     struct addrinfo hints;
     struct addrinfo *servinfo;
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_socktype = socktype;
+    hints.ai_flags = AI_PASSIVE;
 
-    if(!ctx->host)
-        hints.ai_flags = AI_PASSIVE;
-
-    status = getaddrinfo(ctx->host, ctx->port, &hints, &servinfo);
-    if(status) {
+    if(getaddrinfo(NULL, port, &hints, &servinfo)) {
         /* TODO: Check the error code and set errno appropriately */
         return -1;
     }
 
-    fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+    memcpy(addr, servinfo->ai_addr, servinfo->ai_addrlen);
+    *addrlen = servinfo->ai_addrlen;
+    freeaddrinfo(servinfo);
+    return 0;
+}
+
+int srv_tcp_create_listener(srv_t *ctx, int reuseport) {
+    int status, fd, reuse_addr, socktype;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    socktype = ctx->datagram ? SOCK_DGRAM : SOCK_STREAM;
+
+    /* A host name goes through the resolver cache, so the loops of
+       srv_run_threads() look it up only once */
+    if(ctx->host) {
+        if(resolve_sync(ctx->host, ctx->port, &addr, &addrlen) == -1)
+            return -1;
+    }
+    else if(tcp_any_addr(ctx->port, socktype, &addr, &addrlen) == -1)
+        return -1;
+
+    fd = socket(addr.ss_family, socktype, 0);
     if(fd == -1)
         return -1;
 
@@ -78,31 +99,101 @@ int srv_tcp_create_listener(srv_t *ctx) {
     status = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
 #endif
     if(status == -1)
-        return -1;
+        goto error;
+
+    /* Let several listeners bind to the same address. The kernel then
+       distributes incoming connections among them */
+    if(reuseport) {
+#ifdef SO_REUSEPORT
+        status = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse_addr, sizeof(reuse_addr));
+        if(status == -1)
+            goto error;
+#else
+        errno = ENOSYS;
+        goto error;
+#endif
+    }
 
     /* Bind the socket to the address */
-    status = bind(fd, servinfo->ai_addr, servinfo->ai_addrlen);
+    status = bind(fd, (struct sockaddr *) &addr, addrlen);
     if(status == -1)
-        return -1;
+        goto error;
 
-    /* Listen for incoming connections */
-    status = listen(fd, ctx->backlog);
-    if(status == -1)
-        return -1;
+    /* Listen for incoming connections. A UDP socket is ready once bound */
+    if(!ctx->datagram) {
+        status = listen(fd, ctx->backlog);
+        if(status == -1)
+            goto error;
+    }
 
     return fd;
+
+error:
+    status = errno;
+    close(fd);
+    errno = status;
+    return -1;
 }
 
-int srv_tcp_accept(int fd, char *ip, int *port, int flags) {
+/* Port of an IPv4 or IPv6 address, 0 for anything else */
+int srv_tcp_port(struct sockaddr_storage *addr) {
+    if(addr->ss_family == AF_INET)
+        return ntohs(((struct sockaddr_in *) addr)->sin_port);
+    if(addr->ss_family == AF_INET6)
+        return ntohs(((struct sockaddr_in6 *) addr)->sin6_port);
+    return 0;
+}
+
+/* Format the host part of an address into ip, which is len bytes long */
+int srv_tcp_format_addr(struct sockaddr_storage *addr, char *ip, int len) {
+    const char *res;
+
+    if(addr->ss_family == AF_INET)
+        res = inet_ntop(AF_INET, &((struct sockaddr_in *) addr)->sin_addr, ip, len);
+    else if(addr->ss_family == AF_INET6)
+        res = inet_ntop(AF_INET6, &((struct sockaddr_in6 *) addr)->sin6_addr, ip, len);
+    else {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    return res == NULL ? -1 : 0;
+}
+
+/* Ask the kernel to busy-poll the device queue for up to usec microseconds
+   on blocking reads of the socket and on epoll_wait(), instead of waiting
+   for an interrupt. Best effort: raising SO_BUSY_POLL above the
+   net.core.busy_read sysctl needs CAP_NET_ADMIN, and older kernels lack
+   SO_PREFER_BUSY_POLL */
+void srv_tcp_busy_poll(int fd, unsigned int usec) {
+#ifdef SO_BUSY_POLL
+    int val;
+
+    if(usec == 0)
+        return;
+
+    val = usec > INT_MAX ? INT_MAX : (int) usec;
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, (char *) &val, sizeof(val));
+#ifdef SO_PREFER_BUSY_POLL
+    val = 1;
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, (char *) &val, sizeof(val));
+#endif
+#endif
+}
+
+/* Accept a connection. The peer address is left in addr in its raw form;
+   formatting it is up to whoever needs it */
+int srv_tcp_accept(int fd, struct sockaddr_storage *addr, socklen_t *addrlen,
+                   int flags, unsigned int busy_poll) {
     int fd_new;
-    struct sockaddr_storage addr;
-    socklen_t addrlen = sizeof(addr);
+
+    *addrlen = sizeof(struct sockaddr_storage);
 
 #ifdef linux
-    fd_new = accept4(fd, (struct sockaddr *) &addr, &addrlen, flags);
+    fd_new = accept4(fd, (struct sockaddr *) addr, addrlen, flags);
 #else
     /* Fallback to accept if accept4 is not implemented */
-    fd_new = accept(fd, (struct sockaddr *) &addr, &addrlen);
+    fd_new = accept(fd, (struct sockaddr *) addr, addrlen);
 #endif
 
     if(fd_new == -1) {
@@ -114,22 +205,14 @@ int srv_tcp_accept(int fd, char *ip, int *port, int flags) {
         if(flags == SOCK_NONBLOCK)
             srv_setnoblock(fd_new);
 #endif
-        /* Fill in address info buffers */
-        if(addr.ss_family == AF_INET) {
-            /* IPv4 */
-            struct sockaddr_in *s = (struct sockaddr_in *) &addr;
-
-            if(ip) inet_ntop(AF_INET, &s->sin_addr, ip, INET6_ADDRSTRLEN);
-            if(port) *port = ntohs(s->sin_port);
-        }
-        else {
-            /* IPv6 */
-            struct sockaddr_in6 *s = (struct sockaddr_in6 *) &addr;
-
-            if(ip) inet_ntop(AF_INET6, &s->sin6_addr, ip, INET6_ADDRSTRLEN);
-            if(port) *port = ntohs(s->sin6_port);
-        }
+        srv_tcp_busy_poll(fd_new, busy_poll);
 
         return fd_new;
     }
 }
+
+/* Peer address of a connection accepted without srv_tcp_accept() */
+int srv_tcp_peer(int fd, struct sockaddr_storage *addr, socklen_t *addrlen) {
+    *addrlen = sizeof(struct sockaddr_storage);
+    return getpeername(fd, (struct sockaddr *) addr, addrlen);
+}
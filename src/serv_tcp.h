@@ -29,7 +29,12 @@ int write(int fd, char *buffer, int size);
 #endif
 
 int srv_setnoblock(int fd);
-int srv_tcp_create_listener(srv_t *ctx);
-int srv_tcp_accept(int fd, char *ip, int *port, int flags);
+int srv_tcp_create_listener(srv_t *ctx, int reuseport);
+int srv_tcp_accept(int fd, struct sockaddr_storage *addr, socklen_t *addrlen,
+                   int flags, unsigned int busy_poll);
+int srv_tcp_peer(int fd, struct sockaddr_storage *addr, socklen_t *addrlen);
+int srv_tcp_port(struct sockaddr_storage *addr);
+int srv_tcp_format_addr(struct sockaddr_storage *addr, char *ip, int len);
+void srv_tcp_busy_poll(int fd, unsigned int usec);
 
 #endif
@@ -0,0 +1,429 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_loop.h"
+
+#ifdef _WIN32
+uint64_t srv_clock_ms(void) {
+    return GetTickCount64();
+}
+
+uint64_t srv_clock_us(void) {
+    LARGE_INTEGER freq, now;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t) (now.QuadPart / freq.QuadPart) * 1000000 +
+           (uint64_t) (now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+#else
+#include <time.h>
+
+uint64_t srv_clock_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t srv_clock_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#endif
+
+static inline void tw_list_init(tw_node *head) {
+    head->next = head->prev = head;
+}
+
+static inline void tw_list_append(tw_node *head, tw_node *n) {
+    n->prev = head->prev;
+    n->next = head;
+    head->prev->next = n;
+    head->prev = n;
+}
+
+static inline void tw_list_unlink(tw_node *n) {
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    n->next = n->prev = n;
+}
+
+/* Move every node of 'from' to the empty list 'to' */
+static inline void tw_list_splice(tw_node *from, tw_node *to) {
+    if(from->next == from) {
+        tw_list_init(to);
+        return;
+    }
+
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    tw_list_init(from);
+}
+
+#define TW_USED_SET(w, l, s) ((w)->used[(l)][(s) >> 6] |=  (1ULL << ((s) & 63)))
+#define TW_USED_CLR(w, l, s) ((w)->used[(l)][(s) >> 6] &= ~(1ULL << ((s) & 63)))
+
+void tw_init(timer_wheel_t *w, uint64_t now) {
+    int l, s;
+
+    for(l = 0; l < TW_LEVELS; l++)
+        for(s = 0; s < TW_SLOTS; s++)
+            tw_list_init(&w->slots[l][s]);
+
+    memset(w->used, 0, sizeof(w->used));
+    w->tick = now;
+    w->count = 0;
+}
+
+void tw_free(timer_wheel_t *w) {
+    tw_node *head, *n;
+    int l, s;
+
+    for(l = 0; l < TW_LEVELS; l++) {
+        for(s = 0; s < TW_SLOTS; s++) {
+            head = &w->slots[l][s];
+            while((n = head->next) != head) {
+                tw_list_unlink(n);
+                free(n);
+            }
+        }
+    }
+
+    memset(w->used, 0, sizeof(w->used));
+    w->count = 0;
+}
+
+/* Place a timer due at or after the current tick */
+static void tw_insert(timer_wheel_t *w, srv_timer *t) {
+    uint64_t delta;
+    int level, slot;
+
+    delta = t->expires - w->tick;
+
+    for(level = 0; level < TW_LEVELS - 1; level++) {
+        if(delta < (1ULL << (TW_BITS * (level + 1))))
+            break;
+    }
+
+    if(delta >= (1ULL << (TW_BITS * TW_LEVELS))) {
+        /* Beyond the range of the wheel. Park it in the farthest slot, it
+           is placed again when that slot is cascaded */
+        slot = (int) (((w->tick >> (TW_BITS * level)) + TW_MASK) & TW_MASK);
+    }
+    else
+        slot = (int) ((t->expires >> (TW_BITS * level)) & TW_MASK);
+
+    tw_list_append(&w->slots[level][slot], &t->node);
+    TW_USED_SET(w, level, slot);
+
+    t->level = level;
+    t->slot = slot;
+    t->state = TIMER_PENDING;
+    w->count++;
+}
+
+void tw_add(timer_wheel_t *w, srv_timer *t) {
+    /* The current tick has already been processed */
+    if(t->expires <= w->tick)
+        t->expires = w->tick + 1;
+
+    tw_insert(w, t);
+}
+
+void tw_del(timer_wheel_t *w, srv_timer *t) {
+    tw_node *head;
+
+    if(t->state != TIMER_PENDING)
+        return;
+
+    tw_list_unlink(&t->node);
+
+    head = &w->slots[t->level][t->slot];
+    if(head->next == head)
+        TW_USED_CLR(w, t->level, t->slot);
+
+    t->state = TIMER_IDLE;
+    w->count--;
+}
+
+static inline int tw_ctz(uint64_t x) {
+#ifdef __GNUC__
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while(!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/* Offset (0 to TW_SLOTS - 1) of the first used slot of a level, starting
+   from 'start' and wrapping around. -1 if the level is empty */
+static int tw_find(timer_wheel_t *w, int level, int start) {
+    uint64_t word;
+    int wi, k;
+
+    wi = start >> 6;
+    word = w->used[level][wi] & (~0ULL << (start & 63));
+
+    for(k = 0; k <= TW_SLOTS / 64; k++) {
+        if(word)
+            return ((wi << 6) + tw_ctz(word) - start) & TW_MASK;
+
+        wi = (wi + 1) & (TW_SLOTS / 64 - 1);
+        word = w->used[level][wi];
+
+        /* Back to the first word. Only the bits before 'start' are left */
+        if(k == TW_SLOTS / 64 - 1)
+            word &= ~(~0ULL << (start & 63));
+    }
+
+    return -1;
+}
+
+/* The tick at which the wheel next has work to do, or UINT64_MAX if it is
+   empty. For upper levels this is when their first used slot is cascaded,
+   which is never later than the timers in it expire. Level 0 wraps around,
+   so a cascade can be due before its first used slot */
+uint64_t tw_next(timer_wheel_t *w) {
+    uint64_t next, t;
+    int level, off, pos;
+
+    if(!w->count)
+        return UINT64_MAX;
+
+    next = UINT64_MAX;
+
+    off = tw_find(w, 0, (int) ((w->tick + 1) & TW_MASK));
+    if(off != -1)
+        next = w->tick + 1 + off;
+
+    for(level = 1; level < TW_LEVELS; level++) {
+        pos = (int) ((w->tick >> (TW_BITS * level)) & TW_MASK);
+        off = tw_find(w, level, (pos + 1) & TW_MASK);
+        if(off == -1)
+            continue;
+
+        t = ((w->tick >> (TW_BITS * level)) + off + 1) << (TW_BITS * level);
+        if(t < next)
+            next = t;
+    }
+
+    return next;
+}
+
+static void tw_cascade(timer_wheel_t *w, int level) {
+    tw_node list, *n;
+    srv_timer *t;
+    int slot;
+
+    slot = (int) ((w->tick >> (TW_BITS * level)) & TW_MASK);
+    tw_list_splice(&w->slots[level][slot], &list);
+    TW_USED_CLR(w, level, slot);
+
+    while((n = list.next) != &list) {
+        tw_list_unlink(n);
+        t = (srv_timer *) n;
+        w->count--;
+        tw_insert(w, t);
+    }
+}
+
+static void tw_run(timer_wheel_t *w, int slot) {
+    tw_node list, *n;
+    srv_timer *t;
+
+    tw_list_splice(&w->slots[0][slot], &list);
+    TW_USED_CLR(w, 0, slot);
+
+    /* Callbacks may cancel or re-arm any timer, including the ones still
+       waiting on this list, so always take the first node */
+    while((n = list.next) != &list) {
+        tw_list_unlink(n);
+        t = (srv_timer *) n;
+        w->count--;
+
+        t->state = TIMER_RUNNING;
+        (*(t->cb))(t, t->arg);
+
+        if(t->state == TIMER_RUNNING && t->period) {
+            t->expires += t->period;
+            tw_add(w, t);
+        }
+        else if(t->state == TIMER_RUNNING || t->state == TIMER_CANCELLED)
+            free(t);
+    }
+}
+
+/* Process every tick up to 'now', running the expired timers */
+void tw_advance(timer_wheel_t *w, uint64_t now) {
+    uint64_t mask;
+    int level, top;
+
+    while(w->tick < now) {
+        if(!w->count) {
+            w->tick = now;
+            break;
+        }
+
+        /* Nothing is due before level 0 wraps around. Skip to the tick
+           before the next cascade */
+        if(!(w->used[0][0] | w->used[0][1] | w->used[0][2] | w->used[0][3])
+                && (w->tick | TW_MASK) < now)
+            w->tick |= TW_MASK;
+
+        w->tick++;
+
+        /* Cascade the levels that wrapped around, from the highest one down
+           so that timers can trickle through several levels */
+        for(top = 0; top < TW_LEVELS - 1; top++) {
+            mask = (1ULL << (TW_BITS * (top + 1))) - 1;
+            if(w->tick & mask)
+                break;
+        }
+
+        for(level = top; level > 0; level--)
+            tw_cascade(w, level);
+
+        tw_run(w, (int) (w->tick & TW_MASK));
+    }
+}
+
+/* Arm a timer on the loop of the calling thread. It fires after 'ms'
+   milliseconds, then every 'period' milliseconds if 'period' is not 0.
+   One-shot timers are freed once their callback returns, unless it re-armed
+   them. Must be called from a handler or a timer callback */
+srv_timer *srv_timer_add(srv_t *ctx, unsigned int ms, unsigned int period,
+                         void (*cb)(srv_timer *, void *), void *arg) {
+    srv_loop *loop;
+    srv_timer *t;
+
+    loop = loop_current;
+    if(!ctx || !cb || !loop || loop->ctx != ctx) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    t = malloc(sizeof(srv_timer));
+    if(t == NULL)
+        return NULL;
+
+    t->loop = loop;
+    t->cb = cb;
+    t->arg = arg;
+    t->period = period;
+    t->expires = loop->now + ms;
+    t->state = TIMER_IDLE;
+
+    tw_add(&loop->timers, t);
+    return t;
+}
+
+/* Make the timer fire 'ms' milliseconds from now instead */
+int srv_timer_rearm(srv_timer *t, unsigned int ms) {
+    if(!t) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    tw_del(&t->loop->timers, t);
+    t->expires = t->loop->now + ms;
+    tw_add(&t->loop->timers, t);
+    return 0;
+}
+
+int srv_timer_cancel(srv_timer *t) {
+    if(!t) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(t->state == TIMER_RUNNING) {
+        /* Freed once the callback returns */
+        t->state = TIMER_CANCELLED;
+        return 0;
+    }
+
+    tw_del(&t->loop->timers, t);
+    free(t);
+    return 0;
+}
+
+/* Activity only updates conn->last_active. The timer is pushed back when
+   it fires early, so busy connections cost nothing per event */
+static void conn_idle_expired(srv_timer *t, void *arg) {
+    srv_conn *conn = (srv_conn *) arg;
+    uint64_t idle;
+
+    idle = t->loop->now - conn->last_active;
+    if(idle < conn->idle_timeout) {
+        srv_timer_rearm(t, (unsigned int) (conn->idle_timeout - idle));
+        return;
+    }
+
+    if(conn->ctx->hnd_timeout) {
+        (*(conn->ctx->hnd_timeout))(conn);
+
+        /* The handler kept the connection. Give it another period */
+        if(conn->fd != -1 && conn->idle_timer == t) {
+            conn->last_active = t->loop->now;
+            srv_timer_rearm(t, conn->idle_timeout);
+        }
+    }
+    else
+        srv_close(conn);
+}
+
+/* Close the connection (or call the timeout handler) after 'ms'
+   milliseconds without any event on it. 0 disables the timeout */
+int srv_conn_set_idle_timeout(srv_conn *conn, unsigned int ms) {
+    if(!conn || conn->fd == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(ms == 0) {
+        if(conn->idle_timer) {
+            srv_timer_cancel(conn->idle_timer);
+            conn->idle_timer = NULL;
+        }
+        conn->idle_timeout = 0;
+        return 0;
+    }
+
+    conn->idle_timeout = ms;
+    conn->last_active = conn->loop->now;
+
+    if(conn->idle_timer)
+        return srv_timer_rearm(conn->idle_timer, ms);
+
+    conn->idle_timer = srv_timer_add(conn->ctx, ms, 0, conn_idle_expired, conn);
+    return conn->idle_timer ? 0 : -1;
+}
@@ -0,0 +1,74 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SERV_TIMER_H
+#define _SERV_TIMER_H
+
+/* Hierarchical timer wheel with a resolution of one millisecond. Level 0
+   holds the timers due in the next 256 ticks, each further level covers 256
+   times the range of the previous one. Timers in the upper levels are moved
+   down ("cascaded") when the level below wraps around. Arming and cancelling
+   are O(1) and no per-tick work is done for timers that are not due */
+#define TW_LEVELS 4
+#define TW_BITS   8
+#define TW_SLOTS  (1 << TW_BITS)
+#define TW_MASK   (TW_SLOTS - 1)
+
+typedef struct _tw_node {
+    struct _tw_node *next, *prev;
+} tw_node;
+
+/* Timer states */
+#define TIMER_IDLE      0
+#define TIMER_PENDING   1 /* In the wheel */
+#define TIMER_RUNNING   2 /* Callback in progress */
+#define TIMER_CANCELLED 3 /* Cancelled from its own callback */
+
+struct _srv_timer {
+    tw_node node; /* Must be first */
+    uint64_t expires;
+    unsigned int period;
+    short level, slot, state;
+
+    srv_loop *loop;
+    void (*cb)(srv_timer *, void *);
+    void *arg;
+};
+
+typedef struct {
+    tw_node slots[TW_LEVELS][TW_SLOTS];
+    uint64_t used[TW_LEVELS][TW_SLOTS / 64]; /* Non-empty slots */
+    uint64_t tick;                           /* Last processed tick */
+    int count;
+} timer_wheel_t;
+
+uint64_t srv_clock_ms(void);
+uint64_t srv_clock_us(void);
+
+void tw_init(timer_wheel_t *w, uint64_t now);
+void tw_free(timer_wheel_t *w);
+void tw_add(timer_wheel_t *w, srv_timer *t);
+void tw_del(timer_wheel_t *w, srv_timer *t);
+uint64_t tw_next(timer_wheel_t *w);
+void tw_advance(timer_wheel_t *w, uint64_t now);
+
+#endif
@@ -0,0 +1,360 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_loop.h"
+
+#ifdef __linux__
+#include <netinet/udp.h>
+#endif
+
+#if defined(__linux__) && defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define UDP_OFFLOAD
+#endif
+
+/* Datagram mode. The loop's listener is a UDP socket, read in batches of
+   UDP_BATCH datagrams per recvmmsg(). Replies are staged and written at the
+   end of the loop iteration with one sendmmsg(). Consecutive replies of the
+   same size to the same peer are merged into one UDP_SEGMENT (GSO) send and
+   split by the kernel, or the NIC. With UDP_GRO the kernel merges incoming
+   trains the same way, and they are split again before hnd_datagram */
+
+int udp_init(srv_loop *loop) {
+    udp_state_t *u;
+#ifdef UDP_OFFLOAD
+    int one = 1, zero = 0;
+#endif
+
+    u = calloc(1, sizeof(udp_state_t));
+    if(u == NULL)
+        return -1;
+
+    u->rbuf = malloc((size_t) UDP_BATCH * UDP_RBUF);
+    u->sbuf = malloc(UDP_SBUF);
+    if(!u->rbuf || !u->sbuf) {
+        free(u->rbuf);
+        free(u->sbuf);
+        free(u);
+        return -1;
+    }
+
+#ifdef UDP_OFFLOAD
+    /* Both are optional, older kernels refuse them */
+    u->gro = setsockopt(loop->fdlistener, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+    u->gso = setsockopt(loop->fdlistener, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == 0;
+#endif
+
+    loop->udp = u;
+    return 0;
+}
+
+void udp_free(srv_loop *loop) {
+    if(loop->udp == NULL)
+        return;
+
+    free(loop->udp->rbuf);
+    free(loop->udp->sbuf);
+    free(loop->udp);
+    loop->udp = NULL;
+}
+
+/* Hand one received buffer to the handler, datagram by datagram */
+static void udp_deliver(srv_loop *loop, char *buf, int len, int seg,
+                        struct sockaddr_storage *addr, socklen_t addrlen) {
+    srv_t *ctx = loop->ctx;
+    int off;
+
+    if(seg <= 0 || seg > len)
+        seg = len;
+
+    off = 0;
+    do {
+        (*(ctx->hnd_datagram))(ctx, buf + off, len - off < seg ? len - off : seg,
+                               (struct sockaddr *) addr, addrlen);
+        off += seg;
+    } while(off < len);
+}
+
+/* Read what has arrived, up to a few batches so that a flood on one loop
+   doesn't hold up its timers and replies for too long */
+void udp_readable(srv_loop *loop) {
+    udp_state_t *u = loop->udp;
+    int i, n, round;
+#ifdef __linux__
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    char control[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cm;
+    int seg;
+#else
+    socklen_t addrlen;
+#endif
+
+    for(round = 0; round < 4; round++) {
+#ifdef __linux__
+        memset(msgs, 0, sizeof(msgs));
+        for(i = 0; i < UDP_BATCH; i++) {
+            iov[i].iov_base = u->rbuf + (size_t) i * UDP_RBUF;
+            iov[i].iov_len = UDP_RBUF;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &u->raddr[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+            if(u->gro) {
+                msgs[i].msg_hdr.msg_control = control[i];
+                msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+            }
+        }
+
+        do {
+            n = recvmmsg(loop->fdlistener, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+        } while(n == -1 && errno == EINTR);
+
+        if(n <= 0)
+            return; /* EAGAIN, or an ICMP error of an earlier reply */
+
+        for(i = 0; i < n; i++) {
+            if(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+                continue;
+
+            /* Segment size of a train merged by GRO */
+            seg = 0;
+#ifdef UDP_OFFLOAD
+            for(cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+                if(cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+                    memcpy(&seg, CMSG_DATA(cm), sizeof(int));
+            }
+#else
+            (void) cm;
+#endif
+
+            udp_deliver(loop, u->rbuf + (size_t) i * UDP_RBUF, (int) msgs[i].msg_len, seg,
+                        &u->raddr[i], msgs[i].msg_hdr.msg_namelen);
+        }
+#else
+        /* One datagram per call */
+        for(n = 0; n < UDP_BATCH; n++) {
+            addrlen = sizeof(struct sockaddr_storage);
+            i = recvfrom(loop->fdlistener, u->rbuf, UDP_RBUF, 0,
+                         (struct sockaddr *) &u->raddr[0], &addrlen);
+            if(i < 0)
+                return;
+
+            udp_deliver(loop, u->rbuf, i, 0, &u->raddr[0], addrlen);
+        }
+#endif
+
+        if(n < UDP_BATCH)
+            return;
+    }
+}
+
+static int udp_arm(srv_loop *loop, int on) {
+    udp_state_t *u = loop->udp;
+
+    if(u->armed == on)
+        return 0;
+
+    if(event_mod_fd(&loop->ev, loop->fdlistener, on ? EVENTRD | EVENTWR : EVENTRD,
+                    &loop->fdlistener) == -1)
+        return -1;
+
+    u->armed = on;
+    return 0;
+}
+
+/* Send the segments of a GSO message one by one, for when the path turns
+   out not to support GSO after all */
+static void udp_send_split(srv_loop *loop, udp_out_t *m) {
+    udp_state_t *u = loop->udp;
+    size_t off;
+    int len;
+
+    for(off = 0; off < m->len; off += m->seg) {
+        len = m->len - off < (size_t) m->seg ? (int) (m->len - off) : m->seg;
+        sendto(loop->fdlistener, u->sbuf + m->off + off, len, 0,
+               (struct sockaddr *) &m->addr, m->addrlen);
+    }
+}
+
+/* Write the staged replies. Whatever the socket buffer can't take waits for
+   EVENTWR */
+void udp_flush(srv_loop *loop) {
+    udp_state_t *u = loop->udp;
+    udp_out_t *m;
+    int n;
+#ifdef __linux__
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    char control[UDP_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr *cm;
+    uint16_t seg;
+    int i;
+#endif
+
+    while(u->head < u->nout) {
+#ifdef __linux__
+        memset(msgs, 0, sizeof(msgs));
+        for(i = 0; i < u->nout - u->head; i++) {
+            m = &u->out[u->head + i];
+            iov[i].iov_base = u->sbuf + m->off;
+            iov[i].iov_len = m->len;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &m->addr;
+            msgs[i].msg_hdr.msg_namelen = m->addrlen;
+
+#ifdef UDP_OFFLOAD
+            if(m->nsegs > 1) {
+                msgs[i].msg_hdr.msg_control = control[i];
+                msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+                cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                seg = (uint16_t) m->seg;
+                memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+            }
+#else
+            (void) cm;
+            (void) seg;
+#endif
+        }
+
+        do {
+            n = sendmmsg(loop->fdlistener, msgs, u->nout - u->head, 0);
+        } while(n == -1 && errno == EINTR);
+#else
+        m = &u->out[u->head];
+        n = sendto(loop->fdlistener, u->sbuf + m->off, (int) m->len, 0,
+                   (struct sockaddr *) &m->addr, m->addrlen) < 0 ? -1 : 1;
+#endif
+
+        if(n == -1) {
+            if(WOULDBLOCK()) {
+                udp_arm(loop, 1);
+                return;
+            }
+
+            /* The first message failed. Retry a GSO message without GSO,
+               datagrams are best effort otherwise */
+            m = &u->out[u->head];
+            if(m->nsegs > 1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+                u->gso = 0;
+                udp_send_split(loop, m);
+            }
+            n = 1;
+        }
+
+        u->head += n;
+    }
+
+    u->head = u->nout = 0;
+    u->sused = 0;
+    udp_arm(loop, 0);
+}
+
+/* Queue a datagram for the peer at addr. Must be called from a loop of a
+   datagram mode srv_t, usually from hnd_datagram. Replies are written
+   together at the end of the loop iteration. Returns 0, or -1 with errno
+   set to ENOBUFS if the socket can't keep up, or to EMSGSIZE if the
+   datagram is larger than UDP_MAXDATA */
+int srv_sendto(srv_t *ctx, const char *buf, int len, const struct sockaddr *addr,
+               socklen_t addrlen) {
+    srv_loop *loop = loop_current;
+    udp_state_t *u;
+    udp_out_t *m;
+
+    if(!ctx || !loop || loop->ctx != ctx || !loop->udp || !addr || len < 0 ||
+            (len && !buf) || addrlen > (socklen_t) sizeof(struct sockaddr_storage)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* sendmmsg() would refuse it at the end of the iteration, where
+       nobody can be told */
+    if(len > UDP_MAXDATA) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    u = loop->udp;
+
+    /* Another segment of the last message? */
+    if(u->gso && u->nout > u->head && len > 0) {
+        m = &u->out[u->nout - 1];
+        if(!m->closed && len <= m->seg && m->nsegs < UDP_GSO_MAX &&
+                m->len + len <= UDP_GSO_LEN && m->off + m->len == u->sused &&
+                u->sused + len <= UDP_SBUF && m->addrlen == addrlen &&
+                memcmp(&m->addr, addr, addrlen) == 0) {
+            memcpy(u->sbuf + u->sused, buf, len);
+            u->sused += len;
+            m->len += len;
+            m->nsegs++;
+            m->closed = len < m->seg;
+            return 0;
+        }
+    }
+
+    if(u->nout == UDP_BATCH || u->sused + len > UDP_SBUF) {
+        udp_flush(loop);
+        if(u->nout == UDP_BATCH || u->sused + len > UDP_SBUF) {
+            errno = ENOBUFS;
+            return -1;
+        }
+    }
+
+    m = &u->out[u->nout++];
+    memcpy(u->sbuf + u->sused, buf, len);
+    m->off = u->sused;
+    m->len = len;
+    m->seg = len;
+    m->nsegs = 1;
+    m->closed = 0;
+    memcpy(&m->addr, addr, addrlen);
+    m->addrlen = addrlen;
+    u->sused += len;
+    return 0;
+}
+
+/* Serve datagrams instead of connections. The listener becomes a UDP
+   socket bound to host and port, and every datagram goes to hnd_datagram.
+   Connection handlers are not used */
+int srv_set_datagram(srv_t *ctx, int on) {
+    if(!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->datagram = on ? 1 : 0;
+    return 0;
+}
+
+int srv_hnd_datagram(srv_t *ctx, void (*h)(srv_t *, char *, int, struct sockaddr *, socklen_t)) {
+    if(!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->hnd_datagram = h;
+    return 0;
+}
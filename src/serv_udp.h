@@ -0,0 +1,62 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SERV_UDP_H
+#define _SERV_UDP_H
+
+#define UDP_BATCH   32          /* Datagrams per recvmmsg() and sendmmsg() */
+#define UDP_RBUF    65536       /* Receive buffer per message, fits a GRO train */
+#define UDP_SBUF    (256 << 10) /* Staging area for replies */
+#define UDP_GSO_MAX 64          /* Segments the kernel takes per GSO send */
+#define UDP_GSO_LEN 65000       /* Bytes the kernel takes per GSO send */
+#define UDP_MAXDATA (65535 - 8 - 20) /* Largest payload IPv4 can carry */
+
+/* One outgoing message. With GSO it carries nsegs datagrams of seg bytes,
+   the last of which may be shorter */
+typedef struct {
+    size_t off, len;
+    int seg, nsegs;
+    int closed; /* Ends in a short segment, nothing may follow */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+} udp_out_t;
+
+/* Datagram state of a loop. See srv_set_datagram() */
+typedef struct _udp_state {
+    int gso, gro; /* What the kernel supports, found out at runtime */
+
+    char *rbuf;   /* UDP_BATCH receive buffers of UDP_RBUF bytes */
+    struct sockaddr_storage raddr[UDP_BATCH];
+
+    char *sbuf;   /* Replies waiting for the next flush */
+    size_t sused;
+    udp_out_t out[UDP_BATCH];
+    int head, nout; /* First unsent message, messages queued */
+    int armed;      /* EVENTWR armed until the queue drains */
+} udp_state_t;
+
+int udp_init(srv_loop *loop);
+void udp_free(srv_loop *loop);
+void udp_readable(srv_loop *loop);
+void udp_flush(srv_loop *loop);
+
+#endif
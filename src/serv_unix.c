@@ -0,0 +1,207 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_unix.h"
+
+#ifndef _WIN32
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <stddef.h>
+
+/* Unix domain sockets for peers on the same host. A path starting with '@'
+   names a socket in the abstract namespace, which needs no file and goes
+   away with the last fd. See srv_set_unix() */
+
+static int unix_addr(const char *path, struct sockaddr_un *sa, socklen_t *len) {
+    size_t n = strlen(path);
+
+    if(n == 0 || n >= sizeof(sa->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    memcpy(sa->sun_path, path, n);
+
+    /* Abstract names are not NUL terminated, their length is in len */
+    if(path[0] == '@') {
+        sa->sun_path[0] = '\0';
+        *len = offsetof(struct sockaddr_un, sun_path) + n;
+    }
+    else
+        *len = offsetof(struct sockaddr_un, sun_path) + n + 1;
+
+    return 0;
+}
+
+/* A socket file left behind by a server that is gone would make bind()
+   fail. Remove it, unless something still accepts on it */
+static void unix_remove_stale(const struct sockaddr_un *sa, socklen_t len) {
+    struct stat st;
+    int fd;
+
+    if(stat(sa->sun_path, &st) == -1 || !S_ISSOCK(st.st_mode))
+        return;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd == -1)
+        return;
+
+    if(connect(fd, (const struct sockaddr *) sa, len) == -1 && errno == ECONNREFUSED)
+        unlink(sa->sun_path);
+
+    close(fd);
+}
+
+int srv_unix_create_listener(srv_t *ctx) {
+    struct sockaddr_un sa;
+    socklen_t len;
+    int fd, status;
+
+    if(unix_addr(ctx->unix_path, &sa, &len) == -1)
+        return -1;
+
+    if(sa.sun_path[0] != '\0')
+        unix_remove_stale(&sa, len);
+
+    fd = socket(AF_UNIX, ctx->datagram ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if(fd == -1)
+        return -1;
+
+    if(bind(fd, (struct sockaddr *) &sa, len) == -1)
+        goto error;
+
+    if(!ctx->datagram && listen(fd, ctx->backlog) == -1)
+        goto error;
+
+    return fd;
+
+error:
+    status = errno;
+    close(fd);
+    errno = status;
+    return -1;
+}
+
+/* Format a peer address. Clients rarely bind, so most peers are unnamed */
+int srv_unix_format_addr(struct sockaddr_storage *addr, socklen_t addrlen, char *buf, int len) {
+    struct sockaddr_un *sa = (struct sockaddr_un *) addr;
+    int n;
+
+    n = (int) addrlen - (int) offsetof(struct sockaddr_un, sun_path);
+    if(n <= 0) {
+        snprintf(buf, len, "unix");
+        return 0;
+    }
+
+    if(sa->sun_path[0] == '\0')
+        snprintf(buf, len, "@%.*s", n - 1, sa->sun_path + 1);
+    else
+        snprintf(buf, len, "%.*s", n, sa->sun_path);
+
+    return 0;
+}
+
+/* Remove the socket file when the server stops */
+void srv_unix_unlink(srv_t *ctx) {
+    if(ctx->unix_path && ctx->unix_path[0] != '@')
+        unlink(ctx->unix_path);
+}
+
+/* Connect to a server listening on a unix socket. Returns a blocking fd,
+   or -1 */
+int srv_unix_connect(const char *path) {
+    struct sockaddr_un sa;
+    socklen_t len;
+    int fd, status;
+
+    if(!path) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(unix_addr(path, &sa, &len) == -1)
+        return -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd == -1)
+        return -1;
+
+    if(connect(fd, (struct sockaddr *) &sa, len) == -1) {
+        status = errno;
+        close(fd);
+        errno = status;
+        return -1;
+    }
+
+    return fd;
+}
+
+#else
+
+/* TODO: Winsock has AF_UNIX since Windows 10 */
+int srv_unix_create_listener(srv_t *ctx) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int srv_unix_format_addr(struct sockaddr_storage *addr, socklen_t addrlen, char *buf, int len) {
+    errno = EAFNOSUPPORT;
+    return -1;
+}
+
+void srv_unix_unlink(srv_t *ctx) {
+}
+
+int srv_unix_connect(const char *path) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
+
+/* Listen on a unix domain socket instead of host and port. A path
+   starting with '@' is an abstract name (Linux only). The path is not
+   copied. Pass NULL to go back to TCP */
+int srv_set_unix(srv_t *ctx, const char *path) {
+    if(!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifndef _WIN32
+    if(path && path[0] == '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(path && strlen(path) >= sizeof(((struct sockaddr_un *) 0)->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+#endif
+
+    ctx->unix_path = path;
+    return 0;
+}
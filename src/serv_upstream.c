@@ -0,0 +1,438 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_tcp.h"
+#include "serv_loop.h"
+
+/* Outbound connections. srv_connect_async() starts a non-blocking connect
+   and registers the socket with the loop for EVENTWR. Once the socket turns
+   writable, SO_ERROR tells whether the connect went through. A connected
+   socket becomes an ordinary srv_conn, driven by the same handlers as the
+   accepted ones */
+
+static void connect_done(srv_conn *conn, int err) {
+    void (*cb)(srv_conn *, int, void *) = conn->connect_cb;
+    void *arg = conn->connect_arg;
+
+    conn->connect_cb = NULL;
+    conn->connect_arg = NULL;
+    conn->flags &= ~CONN_CONNECTING;
+
+    if(conn->connect_timer) {
+        srv_timer_cancel(conn->connect_timer);
+        conn->connect_timer = NULL;
+    }
+
+    if(err == 0 && event_mod_fd(&conn->loop->ev, conn->fd, conn->events, conn) == -1)
+        err = errno;
+
+    if(err) {
+        srv_close(conn);
+        conn = NULL;
+    }
+
+    if(cb)
+        (*cb)(conn, err, arg);
+}
+
+static void connect_expired(srv_timer *t, void *arg) {
+    srv_conn *conn = (srv_conn *) arg;
+
+    (void) t;
+    conn->connect_timer = NULL; /* Freed once we return */
+    connect_done(conn, ETIMEDOUT);
+}
+
+/* Start a connect to addr and register the socket with the calling loop */
+static srv_conn *connect_start(srv_loop *loop, const struct sockaddr *addr, socklen_t addrlen,
+                               void (*cb)(srv_conn *, int, void *), void *arg) {
+    srv_conn *conn;
+    int fd, status;
+
+    fd = socket(addr->sa_family, SOCK_STREAM, 0);
+    if(fd == -1)
+        return NULL;
+
+    if(srv_setnoblock(fd) == -1)
+        goto error;
+
+    /* Usually EINPROGRESS. Even if it connected right away, the callback
+       runs from the loop like for every other connect */
+    if(connect(fd, addr, addrlen) == -1 && errno != EINPROGRESS && !WOULDBLOCK())
+        goto error;
+
+    conn = new_conn(&loop->conns, loop, fd);
+    if(conn == NULL)
+        goto error;
+
+    memcpy(&conn->addr, addr, addrlen);
+    conn->addrlen = addrlen;
+    conn->port = srv_tcp_port(&conn->addr);
+    conn->host = NULL;
+    conn->flags |= CONN_CONNECTING;
+    conn->connect_cb = cb;
+    conn->connect_arg = arg;
+
+    /* conn->events is what the connection gets once connected */
+    if(event_add_fd(&loop->ev, fd, EVENTWR, conn) == -1) {
+        status = errno;
+        remove_conn_by_fd(&loop->conns, fd);
+        close(fd);
+        errno = status;
+        return NULL;
+    }
+
+    if(loop->ctx->connect_timeout)
+        conn->connect_timer = srv_timer_add(loop->ctx, loop->ctx->connect_timeout, 0,
+                                            connect_expired, conn);
+
+    return conn;
+
+error:
+    status = errno;
+    close(fd);
+    errno = status;
+    return NULL;
+}
+
+static void upstream_release(upstream_loop_t *ul);
+
+static void connect_resolved(const struct sockaddr *addr, socklen_t addrlen, int err, void *arg) {
+    connect_req_t *req = (connect_req_t *) arg;
+    srv_conn *conn = NULL;
+
+    if(err == 0 && (conn = connect_start(loop_current, addr, addrlen, req->cb, req->arg)) == NULL)
+        err = errno;
+
+    if(conn)
+        conn->upstream = req->ul;
+    else {
+        if(req->ul)
+            upstream_release(req->ul);
+        (*(req->cb))(NULL, err, req->arg);
+    }
+
+    free(req);
+}
+
+/* Resolve host through the cache, then connect. Returns 0, or -1 if cb
+   won't be called */
+static int connect_begin(srv_t *ctx, const char *host, const char *port,
+                         void (*cb)(srv_conn *, int, void *), void *arg, upstream_loop_t *ul) {
+    connect_req_t *req;
+
+    req = (connect_req_t *) malloc(sizeof(connect_req_t));
+    if(req == NULL)
+        return -1;
+
+    req->cb = cb;
+    req->arg = arg;
+    req->ul = ul;
+
+    if(srv_resolve(ctx, host, port, connect_resolved, req) == -1) {
+        free(req);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Connect the calling loop to host and port without blocking it. The name
+   is resolved through the resolver cache, off the loop if it isn't cached.
+   cb is called with the new connection, or with NULL and an errno value if
+   the connect failed or took longer than the connect timeout. cb may run
+   before srv_connect_async() returns. Must be called from a handler or a
+   timer callback. Returns 0, or -1 if the connect could not be started, in
+   which case cb is not called */
+int srv_connect_async(srv_t *ctx, const char *host, const char *port,
+                      void (*cb)(srv_conn *, int, void *), void *arg) {
+    srv_loop *loop = loop_current;
+
+    if(!ctx || !loop || loop->ctx != ctx || !host || !port || !cb) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return connect_begin(ctx, host, port, cb, arg, NULL);
+}
+
+int srv_set_connect_timeout(srv_t *ctx, unsigned int ms) {
+    if(!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->connect_timeout = ms;
+    return 0;
+}
+
+/* Events of a connection that isn't the application's right now: one that
+   is still connecting, or one parked in an upstream pool. Anything but
+   silence on a parked connection means the server closed it or broke the
+   protocol, so it is dropped */
+void upstream_event(srv_conn *conn, unsigned int event_type) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if(conn->flags & CONN_IDLE) {
+        srv_close(conn);
+        return;
+    }
+
+    if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, (char *) &err, &len) == -1)
+        err = errno;
+    else if(err == 0 && (event_type & (EVENTERR | EVENTHUP)))
+        err = ECONNREFUSED;
+    else if(err == 0 && !(event_type & EVENTWR))
+        return;
+
+    connect_done(conn, err);
+}
+
+/* Keep-alive pools. An upstream is shared by all loops, but each loop keeps
+   its own connections to it, so nothing needs locking. max_size bounds the
+   connections a loop has to the upstream, including the ones being
+   connected. Requests beyond that wait for a connection to be released or
+   closed. At most max_idle released connections are kept open */
+
+static upstream_loop_t *upstream_loop(srv_upstream *up, srv_loop *loop) {
+    upstream_loop_t *ul = up->loops[loop->index];
+
+    if(ul == NULL) {
+        ul = calloc(1, sizeof(upstream_loop_t));
+        if(ul == NULL)
+            return NULL;
+        ul->up = up;
+        up->loops[loop->index] = ul;
+    }
+
+    return ul;
+}
+
+static int upstream_connect(upstream_loop_t *ul, void (*cb)(srv_conn *, int, void *), void *arg) {
+    ul->nconns++;
+    if(connect_begin(ul->up->ctx, ul->up->host, ul->up->port, cb, arg, ul) == -1) {
+        ul->nconns--;
+        return -1;
+    }
+
+    return 0;
+}
+
+srv_upstream *srv_upstream_create(srv_t *ctx, const char *host, const char *port,
+                                  int max_size, int max_idle) {
+    srv_upstream *up;
+
+    if(!ctx || !host || !port || max_size < 1 || max_idle < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    up = calloc(1, sizeof(srv_upstream));
+    if(up == NULL)
+        return NULL;
+
+    up->host = strdup(host);
+    up->port = strdup(port);
+    if(!up->host || !up->port) {
+        free(up->host);
+        free(up->port);
+        free(up);
+        return NULL;
+    }
+
+    up->ctx = ctx;
+    up->max_size = max_size;
+    up->max_idle = max_idle > max_size ? max_size : max_idle;
+    return up;
+}
+
+/* Free an upstream once the loops using it have stopped */
+void srv_upstream_free(srv_upstream *up) {
+    upstream_wait_t *w;
+    int i;
+
+    if(!up)
+        return;
+
+    for(i = 0; i < HANDLE_MAX_LOOPS; i++) {
+        if(up->loops[i] == NULL)
+            continue;
+
+        while((w = up->loops[i]->wait_head) != NULL) {
+            up->loops[i]->wait_head = w->next;
+            free(w);
+        }
+        free(up->loops[i]);
+    }
+
+    free(up->host);
+    free(up->port);
+    free(up);
+}
+
+/* Get a connection to the upstream for the calling loop. A warm connection
+   from the pool is passed to cb right away, otherwise cb runs once a new
+   connection is up or an old one is released. On failure cb gets NULL and
+   an errno value. Returns 0, or -1 if cb won't be called */
+int srv_upstream_get(srv_upstream *up, void (*cb)(srv_conn *, int, void *), void *arg) {
+    srv_loop *loop = loop_current;
+    upstream_loop_t *ul;
+    upstream_wait_t *w;
+    srv_conn *conn;
+
+    if(!up || !cb || !loop || loop->ctx != up->ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if((ul = upstream_loop(up, loop)) == NULL)
+        return -1;
+
+    while((conn = ul->idle) != NULL) {
+        ul->idle = conn->idle_next;
+        ul->nidle--;
+        conn->flags &= ~CONN_IDLE;
+
+        /* Back to the events the application asked for */
+        if(event_mod_fd(&loop->ev, conn->fd, conn->events, conn) == -1) {
+            srv_close(conn);
+            continue;
+        }
+
+        (*cb)(conn, 0, arg);
+        return 0;
+    }
+
+    if(ul->nconns < up->max_size)
+        return upstream_connect(ul, cb, arg);
+
+    w = malloc(sizeof(upstream_wait_t));
+    if(w == NULL)
+        return -1;
+
+    w->cb = cb;
+    w->arg = arg;
+    w->next = NULL;
+    if(ul->wait_tail)
+        ul->wait_tail->next = w;
+    else
+        ul->wait_head = w;
+    ul->wait_tail = w;
+    return 0;
+}
+
+static upstream_wait_t *upstream_next_waiter(upstream_loop_t *ul) {
+    upstream_wait_t *w = ul->wait_head;
+
+    if(w) {
+        ul->wait_head = w->next;
+        if(ul->wait_head == NULL)
+            ul->wait_tail = NULL;
+    }
+
+    return w;
+}
+
+/* Give a connection back to its upstream pool once a response has been
+   read in full. A connection with unread input or unsent output can't be
+   reused and is closed, as is one the pool has no room for. Returns 0, or
+   -1 if conn didn't come from srv_upstream_get() */
+int srv_upstream_put(srv_conn *conn) {
+    upstream_loop_t *ul;
+    upstream_wait_t *w;
+    void (*cb)(srv_conn *, int, void *);
+    void *arg;
+
+    if(!conn || conn->fd == -1 || !conn->upstream || (conn->flags & CONN_IDLE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ul = conn->upstream;
+
+    if(conn->out_head || conn->in_end > conn->in_start || (conn->flags & CONN_OFFLOAD)) {
+        srv_close(conn);
+        return 0;
+    }
+
+    /* Straight to the next in line */
+    if((w = upstream_next_waiter(ul)) != NULL) {
+        cb = w->cb;
+        arg = w->arg;
+        free(w);
+        (*cb)(conn, 0, arg);
+        return 0;
+    }
+
+    if(ul->nidle >= ul->up->max_idle) {
+        srv_close(conn);
+        return 0;
+    }
+
+    /* Parked connections only listen for the server closing them */
+    srv_conn_set_idle_timeout(conn, 0);
+    in_free(conn);
+    if(event_mod_fd(&conn->loop->ev, conn->fd, EVENTRD, conn) == -1) {
+        srv_close(conn);
+        return 0;
+    }
+
+    conn->flags |= CONN_IDLE;
+    conn->idle_next = ul->idle;
+    ul->idle = conn;
+    ul->nidle++;
+    return 0;
+}
+
+/* A connection of an upstream pool is being closed */
+void upstream_close(srv_conn *conn) {
+    upstream_loop_t *ul = conn->upstream;
+    srv_conn **p;
+
+    conn->upstream = NULL;
+
+    if(conn->flags & CONN_IDLE) {
+        for(p = &ul->idle; *p != conn; p = &(*p)->idle_next)
+            ;
+        *p = conn->idle_next;
+        ul->nidle--;
+        conn->flags &= ~CONN_IDLE;
+    }
+
+    upstream_release(ul);
+}
+
+/* A connection, or a connect in progress, no longer counts against the
+   pool. Its place goes to the next request waiting for one */
+static void upstream_release(upstream_loop_t *ul) {
+    upstream_wait_t *w;
+
+    ul->nconns--;
+
+    while(ul->nconns < ul->up->max_size && (w = upstream_next_waiter(ul)) != NULL) {
+        if(upstream_connect(ul, w->cb, w->arg) == -1)
+            (*(w->cb))(NULL, errno, w->arg);
+        free(w);
+    }
+}
@@ -0,0 +1,59 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SERV_UPSTREAM_H
+#define _SERV_UPSTREAM_H
+
+/* A srv_upstream_get() waiting for a connection to free up */
+typedef struct _upstream_wait {
+    struct _upstream_wait *next;
+    void (*cb)(srv_conn *, int, void *);
+    void *arg;
+} upstream_wait_t;
+
+/* A connect waiting for its host name. See srv_connect_async() */
+typedef struct {
+    void (*cb)(srv_conn *, int, void *);
+    void *arg;
+    struct _upstream_loop *ul; /* Pool the connection is for, or NULL */
+} connect_req_t;
+
+/* The share of an upstream pool owned by one loop */
+typedef struct _upstream_loop {
+    struct _srv_upstream *up;
+    srv_conn *idle;   /* Most recently released first */
+    int nidle;
+    int nconns;       /* Idle, lent out and connecting */
+    upstream_wait_t *wait_head, *wait_tail;
+} upstream_loop_t;
+
+struct _srv_upstream {
+    srv_t *ctx;
+    char *host, *port;
+    int max_size, max_idle;
+    upstream_loop_t *loops[HANDLE_MAX_LOOPS]; /* Set up by each loop on first use */
+};
+
+void upstream_event(srv_conn *conn, unsigned int event_type);
+void upstream_close(srv_conn *conn);
+
+#endif
@@ -0,0 +1,484 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_uring.h"
+
+#ifdef URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Layout of the user_data of a request: the fd in the low 32 bits, the
+   generation of its registration in bits 32-61 and the request kind in the
+   top two bits */
+#define URING_POLL    0ULL
+#define URING_ACCEPT  1ULL
+#define URING_CANCEL  2ULL
+
+#define URING_UDATA(kind, gen, fd) (((uint64_t)(kind) << 62) | \
+                                    ((uint64_t)((gen) & 0x3fffffff) << 32) | \
+                                    (uint32_t)(fd))
+#define URING_KIND(u) ((u) >> 62)
+#define URING_GEN(u)  ((uint32_t)((u) >> 32) & 0x3fffffff)
+#define URING_FD(u)   ((int)(uint32_t)(u))
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags, void *arg, size_t argsz) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int ring_init(event_t *ev, unsigned entries) {
+    struct io_uring_params p;
+    char *ring;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP;
+
+    ev->ring_fd = uring_setup(entries, &p);
+    if(ev->ring_fd == -1)
+        return -1;
+
+    /* Multishot poll and accept need a recent kernel. There is no feature
+       bit for them, CQE_SKIP (5.17) is the closest one. EXT_ARG is needed
+       for wait timeouts */
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_CQE_SKIP)
+            || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(ev->ring_fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    /* Both queues share a single mapping */
+    ev->ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if(p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > ev->ring_sz)
+        ev->ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    ev->ring = mmap(NULL, ev->ring_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ev->ring_fd, IORING_OFF_SQ_RING);
+    if(ev->ring == MAP_FAILED) {
+        close(ev->ring_fd);
+        return -1;
+    }
+
+    ev->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ev->sqes = mmap(NULL, ev->sqes_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ev->ring_fd, IORING_OFF_SQES);
+    if(ev->sqes == MAP_FAILED) {
+        munmap(ev->ring, ev->ring_sz);
+        close(ev->ring_fd);
+        return -1;
+    }
+
+    ring = (char *) ev->ring;
+    ev->sq_head  = (unsigned *) (ring + p.sq_off.head);
+    ev->sq_tail  = (unsigned *) (ring + p.sq_off.tail);
+    ev->sq_mask  = (unsigned *) (ring + p.sq_off.ring_mask);
+    ev->sq_array = (unsigned *) (ring + p.sq_off.array);
+    ev->sq_entries = p.sq_entries;
+    ev->sq_pending = 0;
+    ev->sq_local_tail = *ev->sq_tail;
+
+    ev->cq_head = (unsigned *) (ring + p.cq_off.head);
+    ev->cq_tail = (unsigned *) (ring + p.cq_off.tail);
+    ev->cq_mask = (unsigned *) (ring + p.cq_off.ring_mask);
+    ev->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+
+    return 0;
+}
+
+/* Hand the queued submissions to the kernel, and wait for at least wait_nr
+   completions for at most 'timeout' ms (forever if -1) */
+static int ring_submit(event_t *ev, unsigned wait_nr, int timeout) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags;
+    int ret;
+
+    __atomic_store_n(ev->sq_tail, ev->sq_local_tail, __ATOMIC_RELEASE);
+
+    flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    memset(&arg, 0, sizeof(arg));
+    if(wait_nr && timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000LL;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    ret = uring_enter(ev->ring_fd, ev->sq_pending, wait_nr, flags,
+                      (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL,
+                      (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+    if(ret == -1) {
+        /* The submissions went through even if the wait timed out */
+        if(errno == ETIME)
+            ev->sq_pending = 0;
+        return -1;
+    }
+
+    ev->sq_pending -= ret;
+    return 0;
+}
+
+static struct io_uring_sqe *ring_get_sqe(event_t *ev) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    /* Without SQPOLL the kernel consumes the queue on every enter, so a full
+       queue only needs to be flushed */
+    if(ev->sq_pending == ev->sq_entries && ring_submit(ev, 0, 0) == -1)
+        return NULL;
+
+    idx = ev->sq_local_tail & *ev->sq_mask;
+    sqe = &ev->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+
+    ev->sq_array[idx] = idx;
+    ev->sq_local_tail++;
+    ev->sq_pending++;
+
+    return sqe;
+}
+
+static uring_reg_t *ring_reg(event_t *ev, int fd) {
+    uring_reg_t *regs;
+    int n;
+
+    if(fd >= ev->szregs) {
+        n = ev->szregs ? ev->szregs : 64;
+        while(n <= fd)
+            n *= 2;
+
+        regs = realloc(ev->regs, n * sizeof(uring_reg_t));
+        if(regs == NULL)
+            return NULL;
+
+        memset(regs + ev->szregs, 0, (n - ev->szregs) * sizeof(uring_reg_t));
+        ev->regs = regs;
+        ev->szregs = n;
+    }
+
+    return &ev->regs[fd];
+}
+
+/* Queue the request that reports events for a registered fd */
+static int ring_arm(event_t *ev, int fd) {
+    uring_reg_t *reg = &ev->regs[fd];
+    struct io_uring_sqe *sqe;
+
+    if((sqe = ring_get_sqe(ev)) == NULL)
+        return -1;
+
+    sqe->fd = fd;
+    if(reg->listener) {
+        /* One request keeps accepting connections */
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK;
+        sqe->user_data = URING_UDATA(URING_ACCEPT, reg->gen, fd);
+    }
+    else {
+        /* Edge-triggered fds stay armed. Level-triggered ones are re-armed
+           after every event so that undrained sockets are reported again */
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = reg->flags & ~EVENTET;
+        if(reg->flags & EVENTET)
+            sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = URING_UDATA(URING_POLL, reg->gen, fd);
+    }
+
+    reg->armed = 1;
+    return 0;
+}
+
+/* Queue the cancellation of the fd's outstanding request, if any */
+static int ring_cancel(event_t *ev, int fd) {
+    uring_reg_t *reg = &ev->regs[fd];
+    struct io_uring_sqe *sqe;
+
+    if(!reg->armed)
+        return 0;
+
+    if((sqe = ring_get_sqe(ev)) == NULL)
+        return -1;
+
+    sqe->fd = -1;
+    if(reg->listener) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_UDATA(URING_ACCEPT, reg->gen, fd);
+    }
+    else {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = URING_UDATA(URING_POLL, reg->gen, fd);
+    }
+    sqe->user_data = URING_UDATA(URING_CANCEL, 0, fd);
+
+    reg->armed = 0;
+    return 0;
+}
+
+static int ring_add(event_t *ev, int fd, uint32_t flags, void *data, int listener) {
+    uring_reg_t *reg;
+
+    if(fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if((reg = ring_reg(ev, fd)) == NULL)
+        return -1;
+
+    if(reg->active) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    reg->active = 1;
+    reg->listener = listener;
+    reg->flags = flags;
+    reg->data = data;
+    reg->gen++;
+
+    return ring_arm(ev, fd);
+}
+
+int event_init(event_t *ev, int max_events) {
+    ev->max_events = max_events;
+    ev->regs = NULL;
+    ev->szregs = 0;
+    ev->epfd = -1;
+    ev->epevents = NULL;
+
+    ev->events = calloc(max_events, sizeof(event_ready_t));
+    if(ev->events == NULL)
+        return -1;
+
+    if(ring_init(ev, max_events < 256 ? 256 : max_events) == 0)
+        return 0;
+
+    /* io_uring is not available (old kernel, seccomp, sysctl). Fall back
+       to epoll */
+    ev->ring_fd = -1;
+    ev->epfd = epoll_create1(0);
+    if(ev->epfd == -1) {
+        free(ev->events);
+        return -1;
+    }
+
+    ev->epevents = calloc(max_events, sizeof(struct epoll_event));
+    if(ev->epevents == NULL) {
+        close(ev->epfd);
+        free(ev->events);
+        return -1;
+    }
+
+    return 0;
+}
+
+int event_add_fd(event_t *ev, int fd, uint32_t flags, void *data) {
+    struct epoll_event tmp_event;
+
+    if(ev->epfd != -1) {
+        tmp_event.data.ptr = data;
+        tmp_event.events = flags;
+        return epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &tmp_event);
+    }
+
+    return ring_add(ev, fd, flags, data, 0);
+}
+
+/* Register a listening socket. Connections are accepted by the kernel and
+   reported as EVENTACCEPT with the new fd in EVENT_RESULT(). With the epoll
+   fallback this is a plain read registration, exclusive since the socket
+   may be shared between loops */
+int event_add_listener(event_t *ev, int fd, void *data) {
+    if(ev->epfd != -1)
+        return event_add_fd(ev, fd, EVENTRD | EVENTEXCL, data);
+
+    return ring_add(ev, fd, EVENTRD, data, 1);
+}
+
+int event_mod_fd(event_t *ev, int fd, uint32_t flags, void *data) {
+    struct epoll_event tmp_event;
+    uring_reg_t *reg;
+
+    if(ev->epfd != -1) {
+        tmp_event.data.ptr = data;
+        tmp_event.events = flags;
+        return epoll_ctl(ev->epfd, EPOLL_CTL_MOD, fd, &tmp_event);
+    }
+
+    if(fd < 0 || fd >= ev->szregs || !ev->regs[fd].active) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    reg = &ev->regs[fd];
+    if(reg->flags == flags && reg->data == data && reg->armed)
+        return 0;
+
+    if(ring_cancel(ev, fd) == -1)
+        return -1;
+
+    reg->flags = flags;
+    reg->data = data;
+    reg->gen++;
+
+    return ring_arm(ev, fd);
+}
+
+int event_remove_fd(event_t *ev, int fd) {
+    struct epoll_event tmp_event; /* Required for linux versions before 2.6.9 */
+
+    if(ev->epfd != -1)
+        return epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, &tmp_event);
+
+    if(fd < 0 || fd >= ev->szregs || !ev->regs[fd].active) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if(ring_cancel(ev, fd) == -1)
+        return -1;
+
+    ev->regs[fd].active = 0;
+    ev->regs[fd].gen++;
+
+    return 0;
+}
+
+static int epoll_wait_batch(event_t *ev, int timeout) {
+    int i, n;
+
+    n = epoll_wait(ev->epfd, ev->epevents, ev->max_events, timeout);
+
+    for(i = 0; i < n; i++) {
+        ev->events[i].data = ev->epevents[i].data.ptr;
+        ev->events[i].events = ev->epevents[i].events;
+        ev->events[i].res = 0;
+    }
+
+    return n;
+}
+
+int event_wait(event_t *ev, int timeout) {
+    struct io_uring_cqe *cqe;
+    uring_reg_t *reg;
+    unsigned head, tail;
+    uint64_t udata;
+    int fd, n, more;
+
+    if(ev->epfd != -1)
+        return epoll_wait_batch(ev, timeout);
+
+    /* Submit the queued requests and, unless completions are already
+       waiting, block for one. Both happen in the same system call */
+    head = *ev->cq_head;
+    if(head == __atomic_load_n(ev->cq_tail, __ATOMIC_ACQUIRE) && timeout != 0) {
+        if(ring_submit(ev, 1, timeout) == -1) {
+            if(errno != ETIME)
+                return -1;
+        }
+    }
+    else if(ev->sq_pending) {
+        if(ring_submit(ev, 0, 0) == -1)
+            return -1;
+    }
+
+    n = 0;
+    tail = __atomic_load_n(ev->cq_tail, __ATOMIC_ACQUIRE);
+
+    while(head != tail && n < ev->max_events) {
+        cqe = &ev->cqes[head & *ev->cq_mask];
+        head++;
+
+        udata = cqe->user_data;
+        if(URING_KIND(udata) == URING_CANCEL)
+            continue;
+
+        /* Drop completions of requests that have been cancelled or
+           replaced since they were queued */
+        fd = URING_FD(udata);
+        if(fd >= ev->szregs)
+            continue;
+
+        reg = &ev->regs[fd];
+        if(!reg->active || (reg->gen & 0x3fffffff) != URING_GEN(udata))
+            continue;
+
+        more = cqe->flags & IORING_CQE_F_MORE;
+        if(!more)
+            reg->armed = 0;
+
+        if(URING_KIND(udata) == URING_ACCEPT) {
+            if(cqe->res == -EINVAL && !more) {
+                /* No multishot accept in this kernel. Report readiness
+                   instead and let the caller accept */
+                reg->listener = 0;
+                reg->flags = EVENTRD;
+                reg->gen++;
+                ring_arm(ev, fd);
+                continue;
+            }
+
+            ev->events[n].events = EVENTACCEPT;
+            ev->events[n].res = cqe->res;
+        }
+        else {
+            ev->events[n].events = cqe->res < 0 ? EVENTERR : (uint32_t) cqe->res;
+            ev->events[n].res = cqe->res < 0 ? cqe->res : 0;
+        }
+        ev->events[n].data = reg->data;
+        n++;
+
+        if(!reg->armed)
+            ring_arm(ev, fd);
+    }
+
+    __atomic_store_n(ev->cq_head, head, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+int event_free(event_t *ev) {
+    int status = 0;
+
+    free(ev->events);
+
+    if(ev->epfd != -1) {
+        free(ev->epevents);
+        return close(ev->epfd);
+    }
+
+    munmap(ev->sqes, ev->sqes_sz);
+    munmap(ev->ring, ev->ring_sz);
+    free(ev->regs);
+
+    if(close(ev->ring_fd) == -1)
+        status = -1;
+
+    return status;
+}
+#endif
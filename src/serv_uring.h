@@ -0,0 +1,97 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SERV_URING_H
+#define _SERV_URING_H
+
+#ifdef URING
+/* io_uring reports poll masks, which use the same bits as epoll */
+#define EVENTRD     EPOLLIN
+#define EVENTWR     EPOLLOUT
+#define EVENTHUP    EPOLLHUP
+#define EVENTRDHUP  EPOLLRDHUP
+#define EVENTERR    EPOLLERR
+#define EVENTET     EPOLLET
+#ifdef EPOLLEXCLUSIVE
+#define EVENTEXCL   EPOLLEXCLUSIVE /* Epoll fallback only, see serv_epoll.h */
+#else
+#define EVENTEXCL   0
+#endif
+
+/* A listener registered with event_add_listener() reports accepted fds
+   with this type. EVENT_RESULT() holds the new fd or -errno */
+#define EVENTACCEPT (1U << 24)
+
+typedef struct {
+    void *data;
+    uint32_t events;
+    int res;
+} event_ready_t;
+
+/* Registration of an fd. Indexed by fd */
+typedef struct {
+    void *data;
+    uint32_t flags;
+    uint32_t gen;     /* Bumped on every change, stale completions are dropped */
+    unsigned char active, armed, listener;
+} uring_reg_t;
+
+typedef struct {
+    /* Submission queue. sq_local_tail is published to the kernel on enter */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries, sq_pending, sq_local_tail;
+    struct io_uring_sqe *sqes;
+
+    /* Completion queue */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring;
+    size_t ring_sz, sqes_sz;
+    int ring_fd;
+
+    uring_reg_t *regs;
+    int szregs;
+
+    /* Used instead of the ring when the kernel refuses io_uring */
+    int epfd;
+    struct epoll_event *epevents;
+
+    event_ready_t *events;
+    int max_events;
+} event_t;
+
+/* Accessors for the i-th entry of the batch returned by event_wait() */
+#define EVENT_DATA(ev, i)   ((ev)->events[(i)].data)
+#define EVENT_TYPE(ev, i)   ((ev)->events[(i)].events)
+#define EVENT_RESULT(ev, i) ((ev)->events[(i)].res)
+
+int event_init(event_t *ev, int max_events);
+int event_add_fd(event_t *ev, int fd, uint32_t flags, void *data);
+int event_add_listener(event_t *ev, int fd, void *data);
+int event_mod_fd(event_t *ev, int fd, uint32_t flags, void *data);
+int event_remove_fd(event_t *ev, int fd);
+int event_wait(event_t *ev, int timeout);
+int event_free(event_t *ev);
+
+#endif
+#endif
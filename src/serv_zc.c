@@ -0,0 +1,325 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "serv_internal.h"
+#include "serv_loop.h"
+
+/* Hand a segment the kernel is done with back to its owner. Zero-copy
+   segments never come from the buffer pool and never carry an fd, so this
+   needs no connection and works for lingering sockets too */
+static void zc_release(out_seg_t *seg) {
+    if(seg->free_fn)
+        (*(seg->free_fn))(seg->free_arg);
+    free(seg);
+}
+
+#ifdef SRV_ZEROCOPY
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+/* Turn on SO_ZEROCOPY for the connection. Returns 0, or -1 if zero-copy
+   sends can't be used on it, in which case the caller copies instead */
+int zc_enable(srv_conn *conn) {
+    int one = 1;
+
+    if(conn->zc == NULL) {
+        conn->zc = calloc(1, sizeof(zc_state_t));
+        if(conn->zc == NULL)
+            return -1;
+
+        if(setsockopt(conn->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1)
+            conn->zc->off = 1;
+    }
+
+    return conn->zc->off || conn->zc->copied ? -1 : 0;
+}
+
+/* Keep a segment that has been written until the kernel is done with it */
+void zc_hold(srv_conn *conn, out_seg_t *seg) {
+    zc_state_t *zc = conn->zc;
+
+    /* Its zero-copy sends may have completed already, with the rest of it
+       copied after the kernel reported copying. Nothing else would release
+       it then */
+    if(zc->head == NULL && (int) (seg->zc_last - zc->done) < 0) {
+        out_release(conn, seg);
+        return;
+    }
+
+    seg->next = NULL;
+    if(zc->tail)
+        zc->tail->next = seg;
+    else
+        zc->head = seg;
+    zc->tail = seg;
+}
+
+/* Remember a range that arrived ahead of older sends. Ranges it overlaps or
+   touches are merged into it, so the list only grows with real gaps.
+   Returns -1 if the list couldn't grow */
+static int zc_early_add(zc_state_t *zc, unsigned int lo, unsigned int hi) {
+    zc_range_t *early;
+    int i, sz;
+
+    for(i = 0; i < zc->nearly; i++) {
+        if((int) (lo - (zc->early[i].hi + 1)) > 0 ||
+           (int) (zc->early[i].lo - (hi + 1)) > 0)
+            continue;
+
+        if((int) (zc->early[i].lo - lo) < 0)
+            lo = zc->early[i].lo;
+        if((int) (zc->early[i].hi - hi) > 0)
+            hi = zc->early[i].hi;
+
+        zc->early[i] = zc->early[--zc->nearly];
+        i = -1; /* The range grew, start over */
+    }
+
+    if(zc->nearly == zc->szearly) {
+        sz = zc->szearly ? zc->szearly * 2 : ZC_EARLY;
+        early = realloc(zc->early, sz * sizeof(zc_range_t));
+        if(early == NULL)
+            return -1;
+        zc->early = early;
+        zc->szearly = sz;
+    }
+
+    zc->early[zc->nearly].lo = lo;
+    zc->early[zc->nearly].hi = hi;
+    zc->nearly++;
+    return 0;
+}
+
+/* Account for the completion of the sends numbered lo to hi */
+static void zc_complete(zc_state_t *zc, unsigned int lo, unsigned int hi) {
+    int i;
+
+    if((int) (lo - zc->done) > 0) {
+        /* Older sends still pending. Remember the range for later. Without
+           memory for it the older ones are taken as done too: freeing their
+           buffers early is better than holding every later one for good */
+        if(zc_early_add(zc, lo, hi) == 0)
+            return;
+    }
+
+    if((int) (hi + 1 - zc->done) > 0)
+        zc->done = hi + 1;
+
+    /* Ranges that have become contiguous */
+    for(i = 0; i < zc->nearly; i++) {
+        if((int) (zc->early[i].lo - zc->done) > 0)
+            continue;
+
+        if((int) (zc->early[i].hi + 1 - zc->done) > 0)
+            zc->done = zc->early[i].hi + 1;
+
+        zc->early[i] = zc->early[--zc->nearly];
+        i = -1; /* done moved, start over */
+    }
+}
+
+/* Read the completion notifications off the error queue of fd and release
+   the segments they cover. Returns 1 if there were any */
+static int zc_drain(int fd, zc_state_t *zc) {
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+    char control[128];
+    out_seg_t *seg;
+    int reaped;
+
+    reaped = 0;
+    for(;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if(recvmsg(fd, &msg, MSG_ERRQUEUE) == -1) {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+
+        for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if(!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                 (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if(serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+                continue;
+
+            /* The kernel had to copy, e.g. over loopback. Zero-copy only
+               costs extra bookkeeping then */
+            if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->copied = 1;
+
+            zc_complete(zc, serr->ee_info, serr->ee_data);
+            reaped = 1;
+        }
+    }
+
+    while((seg = zc->head) != NULL && (int) (seg->zc_last - zc->done) < 0) {
+        zc->head = seg->next;
+        zc_release(seg);
+    }
+    if(zc->head == NULL)
+        zc->tail = NULL;
+
+    return reaped;
+}
+
+/* Release the segments covered by the completions on the error queue.
+   Returns 1 if the error event was caused by them alone, 0 if the socket
+   has a real error */
+int zc_reap(srv_conn *conn) {
+    socklen_t len;
+    int err;
+
+    if(!zc_drain(conn->fd, conn->zc))
+        return 0;
+
+    /* Reading SO_ERROR clears it, but the connection is closed anyway if
+       it is set */
+    err = 0;
+    len = sizeof(err);
+    if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err)
+        return 0;
+
+    return 1;
+}
+
+/* Take over the socket of a connection being closed while the kernel still
+   transmits from held buffers. close() wouldn't stop that, so their owners
+   can only be told once the completions are in. The socket stays open until
+   then, watched for errors only, and the connection itself is closed as
+   usual. A peer that stops reading keeps it open until TCP gives up on it.
+   Returns 1 if the socket was taken over, 0 if it can be closed now */
+int zc_linger(srv_conn *conn) {
+    zc_state_t *zc = conn->zc;
+    srv_loop *loop = conn->loop;
+
+    zc_drain(conn->fd, zc);
+    if(zc->head == NULL ||
+       event_mod_fd(&loop->ev, conn->fd, EVENTERR, &loop->zc_linger) == -1) {
+        zc_free(conn);
+        return 0;
+    }
+
+    zc->fd = conn->fd;
+    zc->lnext = loop->zc_linger;
+    loop->zc_linger = zc;
+    conn->zc = NULL;
+    return 1;
+}
+
+/* Completions for lingering sockets. They share one event data pointer, so
+   every one of them is checked. Those with nothing left held are closed */
+void zc_linger_reap(srv_loop *loop) {
+    zc_state_t **p, *zc;
+
+    p = &loop->zc_linger;
+    while((zc = *p) != NULL) {
+        zc_drain(zc->fd, zc);
+        if(zc->head) {
+            p = &zc->lnext;
+            continue;
+        }
+
+        *p = zc->lnext;
+        event_remove_fd(&loop->ev, zc->fd);
+        close(zc->fd);
+        free(zc->early);
+        free(zc);
+    }
+}
+#else
+int zc_enable(srv_conn *conn) {
+    return -1;
+}
+
+void zc_hold(srv_conn *conn, out_seg_t *seg) {
+    out_release(conn, seg);
+}
+
+int zc_reap(srv_conn *conn) {
+    return 0;
+}
+
+int zc_linger(srv_conn *conn) {
+    zc_free(conn);
+    return 0;
+}
+
+void zc_linger_reap(srv_loop *loop) {
+}
+#endif
+
+/* Release the segments still waiting for completions, whether the kernel
+   is done with them or not. Only for when the loop is going away, closed
+   connections go through zc_linger() */
+void zc_free(srv_conn *conn) {
+    out_seg_t *seg;
+
+    if(conn->zc == NULL)
+        return;
+
+    while((seg = conn->zc->head) != NULL) {
+        conn->zc->head = seg->next;
+        zc_release(seg);
+    }
+
+    free(conn->zc->early);
+    free(conn->zc);
+    conn->zc = NULL;
+}
+
+/* Same for the sockets still lingering when the loop is freed */
+void zc_linger_free(srv_loop *loop) {
+    zc_state_t *zc;
+    out_seg_t *seg;
+
+    while((zc = loop->zc_linger) != NULL) {
+        loop->zc_linger = zc->lnext;
+
+        while((seg = zc->head) != NULL) {
+            zc->head = seg->next;
+            zc_release(seg);
+        }
+
+        close(zc->fd);
+        free(zc->early);
+        free(zc);
+    }
+}
+
+/* Smallest buffer srv_send_zerocopy() sends without copying. Pinning pages
+   and reading completions costs more than copying small buffers */
+int srv_set_zerocopy(srv_t *ctx, int threshold) {
+    if(!ctx || threshold < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->zerocopy_min = threshold;
+    return 0;
+}
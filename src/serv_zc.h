@@ -0,0 +1,66 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SERV_ZC_H
+#define _SERV_ZC_H
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define SRV_ZEROCOPY
+#endif
+
+/* Room for completion ranges that arrived ahead of older ones, the list
+   grows past it if need be */
+#define ZC_EARLY 8
+
+typedef struct {
+    unsigned int lo, hi;
+} zc_range_t;
+
+/* Zero-copy state of a connection, allocated by its first srv_send_zerocopy().
+   The kernel numbers every send made with MSG_ZEROCOPY and reports ranges of
+   those numbers on the socket's error queue once it no longer needs the
+   pages. Segments that have been written wait on a list until then. A
+   connection closed before that leaves its state on the loop's linger list,
+   see zc_linger() */
+typedef struct _zc_state {
+    unsigned int next; /* Number of the next zero-copy send */
+    unsigned int done; /* Every send numbered below this one has completed */
+    int copied;        /* The kernel copied the data anyway */
+    int off;           /* The socket refused SO_ZEROCOPY */
+    struct _out_seg *head, *tail;
+    zc_range_t *early; /* Ranges ahead of done, neither overlapping nor adjacent */
+    int nearly, szearly;
+
+    /* Lingering only */
+    int fd;
+    struct _zc_state *lnext;
+} zc_state_t;
+
+int zc_enable(srv_conn *conn);
+void zc_hold(srv_conn *conn, struct _out_seg *seg);
+int zc_reap(srv_conn *conn);
+void zc_free(srv_conn *conn);
+int zc_linger(srv_conn *conn);
+void zc_linger_reap(srv_loop *loop);
+void zc_linger_free(srv_loop *loop);
+
+#endif
@@ -0,0 +1,172 @@
+/*
+Copyright (C) 2011 Cem Saldırım <cem.saldirim@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Spill of a read into the loop's scratch segment.
+
+   With srv_set_readbuf(ctx, 4096, 65536) and the default 16 KiB pool
+   buffer, the handler consumes 100 of the first 1000 bytes and stalls
+   while the client sends 64636 more. The next readv() fills the pool
+   buffer, spills the rest into the scratch segment, and the buffer has
+   to grow to exactly the limit with the consumed bytes dropped. The
+   handler checks that every byte arrives intact.
+
+   Usage: test_readbuf [port] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "serv.h"
+
+#define FIRST    1000
+#define CONSUMED 100
+#define REST     64636
+#define MAXBUF   65536
+
+static srv_t ctx;
+static int first_done;
+
+static char pattern(int off) {
+    return (char) ((off * 7 + 3) % 251);
+}
+
+static void check_data(srv_conn *conn, char *buf, int len) {
+    char result = 'O';
+    int i;
+
+    if(!first_done) {
+        if(len < FIRST)
+            return;
+
+        first_done = 1;
+        srv_consume(conn, CONSUMED);
+        srv_write(conn, "A", 1);
+
+        /* Let the rest pile up in the socket so it arrives in one read */
+        usleep(200000);
+        return;
+    }
+
+    if(len < FIRST - CONSUMED + REST)
+        return;
+
+    for(i = 0; i < len; i++) {
+        if(buf[i] != pattern(CONSUMED + i)) {
+            fprintf(stderr, "byte %d differs\n", CONSUMED + i);
+            result = 'F';
+            break;
+        }
+    }
+
+    srv_consume(conn, len);
+    srv_write(conn, &result, 1);
+}
+
+static void *server_thread(void *arg) {
+    (void) arg;
+
+    if(srv_run(&ctx) == -1)
+        perror("srv_run");
+    exit(1);
+    return NULL;
+}
+
+static int connect_to(int port) {
+    struct sockaddr_in addr;
+    int fd, tries;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for(tries = 0; tries < 100; tries++) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+            return fd;
+        close(fd);
+        usleep(10000); /* The server may not be listening yet */
+    }
+
+    return -1;
+}
+
+static int send_all(int fd, const char *buf, int len) {
+    int n;
+
+    while(len > 0) {
+        if((n = write(fd, buf, len)) == -1)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int port = 5711, fd, i;
+    char portstr[16], *data, c;
+    pthread_t server;
+
+    if(argc > 1) port = atoi(argv[1]);
+
+    snprintf(portstr, sizeof(portstr), "%d", port);
+
+    srv_init(&ctx);
+    srv_set_port(&ctx, portstr);
+    srv_set_readbuf(&ctx, 4096, MAXBUF);
+    srv_hnd_data(&ctx, check_data);
+
+    pthread_create(&server, NULL, server_thread, NULL);
+    alarm(10);
+
+    data = malloc(FIRST + REST);
+    for(i = 0; i < FIRST + REST; i++)
+        data[i] = pattern(i);
+
+    if((fd = connect_to(port)) == -1) {
+        perror("connect");
+        return 1;
+    }
+
+    if(send_all(fd, data, FIRST) == -1 || read(fd, &c, 1) != 1 || c != 'A' ||
+            send_all(fd, data + FIRST, REST) == -1 || read(fd, &c, 1) != 1) {
+        fprintf(stderr, "connection lost\n");
+        return 1;
+    }
+
+    close(fd);
+    free(data);
+
+    if(c != 'O')
+        return 1;
+
+    printf("ok\n");
+    return 0;
+}